@@ -121,6 +121,11 @@ struct rl_msg_layout rl_ker_numtables[] = {
     [RLITE_KER_FLOW_CFG_UPDATE] = {
         .copylen = sizeof(struct rl_kmsg_flow_cfg_update),
     },
+    [RLITE_KER_IPCP_PDUFT_MOD] = {
+        .copylen = sizeof(struct rl_kmsg_ipcp_pduft_mod) -
+                    2 * sizeof(struct rl_buf_field),
+        .buffers = 2,
+    },
     [RLITE_KER_MSG_MAX] = {
         .copylen = 0,
         .names = 0,
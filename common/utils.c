@@ -141,11 +141,23 @@ serialize_buffer(void **pptr, const struct rl_buf_field *bf)
     *pptr += bf->len;
 }
 
-/* Deserialize a buffer. */
+/* Deserialize a buffer, without reading beyond @end. */
 static int
-deserialize_buffer(const void **pptr, struct rl_buf_field *bf)
+deserialize_buffer(const void **pptr, const void *end,
+                   struct rl_buf_field *bf)
 {
+    bf->buf = NULL;
+    if (*pptr > end || (size_t)(end - *pptr) < sizeof(uint32_t)) {
+        bf->len = 0;
+        return -1;
+    }
+
     deserialize_obj(*pptr, uint32_t, &bf->len);
+    if (bf->len > (size_t)(end - *pptr)) {
+        bf->len = 0;
+        return -1;
+    }
+
     if (bf->len) {
         bf->buf = COMMON_ALLOC(bf->len, 1);
         if (!(bf->buf)) {
@@ -324,7 +336,18 @@ deserialize_rlite_msg(struct rl_msg_layout *numtables, size_t num_entries,
 
     bf = (struct rl_buf_field *)str;
     for (i = 0; i < numtables[bmsg->msg_type].buffers; i++, bf++) {
-        ret = deserialize_buffer(&desptr, bf);
+        ret = deserialize_buffer(&desptr, serbuf + serbuf_len, bf);
+        if (ret) {
+            /* Release the buffers deserialized so far. */
+            while (i-- > 0) {
+                bf--;
+                if (bf->buf) {
+                    COMMON_FREE(bf->buf);
+                    bf->buf = NULL;
+                }
+            }
+            return ret;
+        }
     }
 
     if ((desptr - serbuf) != serbuf_len) {
@@ -341,6 +364,7 @@ rl_msg_free(struct rl_msg_layout *numtables, size_t num_entries,
 {
     unsigned int copylen = numtables[msg->msg_type].copylen;
     struct rina_name *name;
+    struct rl_buf_field *bf;
     string_t *str;
     int i;
 
@@ -363,6 +387,14 @@ rl_msg_free(struct rl_msg_layout *numtables, size_t num_entries,
             COMMON_FREE(*str);
         }
     }
+
+    bf = (struct rl_buf_field *)(str);
+    for (i = 0; i < numtables[msg->msg_type].buffers; i++, bf++) {
+        if (bf->buf) {
+            COMMON_FREE(bf->buf);
+            bf->buf = NULL;
+        }
+    }
 }
 COMMON_EXPORT(rl_msg_free);
 
@@ -375,7 +407,8 @@ unsigned int rl_numtables_max_size(struct rl_msg_layout *numtables,
     for (i = 0; i < n; i++) {
         unsigned int cur = numtables[i].copylen +
                            numtables[i].names * sizeof(struct rina_name) +
-                           numtables[i].strings * sizeof(char *);
+                           numtables[i].strings * sizeof(char *) +
+                           numtables[i].buffers * sizeof(struct rl_buf_field);
 
         if (cur > max) {
             max = cur;
@@ -648,6 +681,7 @@ flow_config_dump(const struct rl_flow_config *c)
     }
 
     COMMON_PRINT("Flow configuration:\n"
+                "   qos_id=%u\n"
                 "   partial_delivery=%u\n"
                 "   incomplete_delivery=%u\n"
                 "   in_order_delivery=%u\n"
@@ -657,6 +691,7 @@ flow_config_dump(const struct rl_flow_config *c)
                 "   dtcp.bandwidth=%u\n"
                 "   dtcp.flow_control=%u\n"
                 "   dtcp.rtx_control=%u\n",
+                c->qos_id,
                 c->partial_delivery,
                 c->incomplete_delivery,
                 c->in_order_delivery,
@@ -669,9 +704,11 @@ flow_config_dump(const struct rl_flow_config *c)
 
     if (c->dtcp.fc.fc_type == RLITE_FC_T_WIN) {
         COMMON_PRINT("   dtcp.fc.max_cwq_len=%lu\n"
-                    "   dtcp.fc.initial_credit=%lu\n",
+                    "   dtcp.fc.initial_credit=%lu\n"
+                    "   dtcp.fc.cong_ctrl=%u\n",
                     (long unsigned)c->dtcp.fc.cfg.w.max_cwq_len,
-                    (long unsigned)c->dtcp.fc.cfg.w.initial_credit);
+                    (long unsigned)c->dtcp.fc.cfg.w.initial_credit,
+                    c->dtcp.fc.cfg.w.cong_ctrl);
     } else if (c->dtcp.fc.fc_type == RLITE_FC_T_RATE) {
         COMMON_PRINT("   dtcp.fc.sending_rate=%lu\n"
                     "   dtcp.fc.time_period=%lu\n",
@@ -28,6 +28,57 @@ int rl_flow_alloc(const char *dif_name, const char *local_appl,
 
 void rl_flow_spec_default(struct rl_flow_spec *spec);
 
+/* Descriptor of an SDU buffer for the batched I/O calls. For writes, 'len'
+ * is the length of the SDU to be sent. For reads, 'len' is the size of the
+ * buffer on input, and the length of the received SDU on output. */
+struct rl_sdu_vec {
+    void *buf;
+    uint32_t len;
+};
+
+/* Write up to 'num' SDUs to the flow 'fd', blocking (if 'fd' is blocking)
+ * only until the first one can be written. Returns the number of SDUs
+ * written, or -1 on error. */
+int rl_flow_write_mmsg(int fd, struct rl_sdu_vec *vec, unsigned int num);
+
+/* Read up to 'num' SDUs from the flow 'fd', blocking (if 'fd' is blocking)
+ * only until the first one is available. Returns the number of SDUs read
+ * (0 on EOF), or -1 on error. */
+int rl_flow_read_mmsg(int fd, struct rl_sdu_vec *vec, unsigned int num);
+
+/* Shared-memory SDU rings attached to the flow 'fd'. Each ring has
+ * 'num_slots' slots (a power of two) of 'slot_size' bytes. */
+struct rl_rings;
+
+struct rl_rings *rl_rings_open(int fd, unsigned int num_slots,
+                               unsigned int slot_size);
+
+void rl_rings_close(struct rl_rings *rings);
+
+/* Return the buffer of the next free TX slot, or NULL if the TX ring is
+ * full. The SDU is queued by rl_rings_tx_push(). */
+void *rl_rings_tx_slot(struct rl_rings *rings);
+
+void rl_rings_tx_push(struct rl_rings *rings, unsigned int len);
+
+/* Number of TX slots not yet transmitted by the kernel. */
+unsigned int rl_rings_tx_pending(struct rl_rings *rings);
+
+/* Return the next received SDU and its length, or NULL if the RX ring is
+ * empty. The slot is given back to the kernel by rl_rings_rx_pop(). */
+const void *rl_rings_rx_slot(struct rl_rings *rings, unsigned int *len);
+
+void rl_rings_rx_pop(struct rl_rings *rings);
+
+/* Return 1 if the flow has been deallocated and the RX ring is empty. */
+int rl_rings_eof(struct rl_rings *rings);
+
+/* Doorbell: ask the kernel to transmit the pushed TX slots and to fill
+ * the free RX slots. poll() on 'fd' does the same before checking
+ * for readiness. Returns -1 (with errno set) if some TX slots could not
+ * be transmitted; those slots are dropped. */
+int rl_rings_sync(struct rl_rings *rings);
+
 #ifdef __cplusplus
 }
 #endif
@@ -106,6 +106,84 @@ struct rl_ioctl_info {
     rl_ipcp_id_t    ipcp_id;
 } __attribute__((packed));
 
+/* Commands for the ioctl() on rlite-io devices. */
+#define RLITE_IOCTL_INFO            73  /* struct rl_ioctl_info */
+#define RLITE_IOCTL_MMSG_WRITE      74  /* struct rl_ioctl_mmsg */
+#define RLITE_IOCTL_MMSG_READ       75  /* struct rl_ioctl_mmsg */
+
+/* Maximum number of SDUs moved by a single MMSG ioctl(). */
+#define RLITE_MMSG_MAX              1024
+
+/* Argument for batched SDU I/O, see rl_flow_write_mmsg() and
+ * rl_flow_read_mmsg(). On return, 'num' contains the number of SDUs
+ * transferred. */
+struct rl_ioctl_mmsg {
+    struct rl_sdu_vec   *vec;
+    uint32_t            num;
+};
+
+/*
+ * Shared-memory SDU rings for rlite-io devices bound to a flow
+ * (RLITE_IO_MODE_APPL_BIND). RLITE_IOCTL_RINGS_SETUP allocates a memory
+ * region that the application maps with mmap(). The region starts with a
+ * struct rl_rings_hdr, followed by the TX ring slots and the RX ring slots.
+ * The application produces into the TX ring and consumes from the RX ring,
+ * while the kernel does the opposite. Indices are free running, and
+ * (idx & (num_slots - 1)) is the slot index.
+ * The RLITE_IOCTL_RINGS_SYNC doorbell (and poll()) asks the kernel to
+ * transmit the pending TX slots and to fill the free RX slots with the
+ * SDUs received on the flow. TX slots that cannot be transmitted because
+ * of an error are consumed anyway: they are counted in 'tx_errors', and
+ * the doorbell fails with the error of the first one.
+ * RLITE_IOCTL_RINGS_FREE releases the rings, which must not be mapped
+ * anymore.
+ */
+#define RLITE_IOCTL_RINGS_SETUP     76  /* struct rl_ioctl_rings */
+#define RLITE_IOCTL_RINGS_SYNC      77  /* no argument */
+#define RLITE_IOCTL_RINGS_FREE      78  /* no argument */
+
+#define RLITE_RINGS_MAX_SLOTS       4096
+#define RLITE_RINGS_ALIGN           64
+
+struct rl_ioctl_rings {
+    uint32_t            num_slots;  /* in: power of two */
+    uint32_t            slot_size;  /* in: maximum SDU size */
+    uint32_t            mem_size;   /* out: size of the region to mmap() */
+};
+
+struct rl_ring_slot {
+    uint32_t            len;
+    uint32_t            pad;
+    uint8_t             data[0];
+};
+
+struct rl_ring {
+    uint32_t            num_slots;
+    uint32_t            slot_size;
+    uint32_t            slot_stride;
+    uint32_t            slots_ofs;  /* from the start of the region */
+
+    /* Written by the producer. */
+    uint32_t            prod __attribute__((aligned(RLITE_RINGS_ALIGN)));
+    /* Written by the consumer. */
+    uint32_t            cons __attribute__((aligned(RLITE_RINGS_ALIGN)));
+} __attribute__((aligned(RLITE_RINGS_ALIGN)));
+
+/* The kernel sets this flag when the flow has been deallocated and
+ * there are no more SDUs to be received. */
+#define RLITE_RINGS_F_EOF           (1 << 0)
+
+struct rl_rings_hdr {
+    uint32_t            flags;
+    uint32_t            tx_errors;  /* TX slots dropped by the kernel */
+    struct rl_ring      tx;
+    struct rl_ring      rx;
+};
+
+#define RLITE_RING_SLOT(_hdr, _ring, _idx)                              \
+    ((struct rl_ring_slot *)((uint8_t *)(_hdr) + (_ring)->slots_ofs +   \
+        ((_idx) & ((_ring)->num_slots - 1)) * (_ring)->slot_stride))
+
 #define RLITE_MGMT_HDR_T_OUT_LOCAL_PORT      1
 #define RLITE_MGMT_HDR_T_OUT_DST_ADDR        2
 #define RLITE_MGMT_HDR_T_IN                  3
@@ -139,8 +217,13 @@ struct rate_based_config {
 struct window_based_config {
     rl_seq_t max_cwq_len; /* closed window queue */
     rl_seq_t initial_credit;
+    uint8_t cong_ctrl; /* sender congestion control, RL_CC_* */
 } __attribute__((packed));
 
+#define RL_CC_NONE          0
+#define RL_CC_AIMD          1
+#define RL_CC_CUBIC         2
+
 #define RLITE_FC_T_NONE      0
 #define RLITE_FC_T_WIN       1
 #define RLITE_FC_T_RATE      2
@@ -168,8 +251,14 @@ struct dtcp_config {
     uint32_t bandwidth; /* in bps */
 } __attribute__((packed));
 
+/* QoS identifiers carried by the PDUs of a flow, used by the RMTs to
+ * select the output queue (see RL_RMTQ_CLASSES). */
+#define RL_QOS_ID_BEST_EFFORT   0
+#define RL_QOS_ID_LOW_LATENCY   1
+
 struct rl_flow_config {
     /* Used by normal IPCP. */
+    uint8_t qos_id;
     uint8_t partial_delivery;
     uint8_t incomplete_delivery;
     uint8_t in_order_delivery;
@@ -195,6 +284,11 @@ static inline int rl_flow_spec_best_effort(struct rl_flow_spec *spec) {
             && !spec->flow_control;
 }
 
+/* Number of RMT output queues of an N-1 flow: management and EFCP
+ * control PDUs, low latency data PDUs and other data PDUs, in
+ * decreasing priority order. */
+#define RL_RMTQ_CLASSES     3
+
 struct rl_flow_stats {
     uint64_t tx_pkt;
     uint64_t tx_byte;
@@ -202,13 +296,36 @@ struct rl_flow_stats {
     uint64_t rx_pkt;
     uint64_t rx_byte;
     uint64_t rx_err;
-    /*uint64_t unused[6];*/
+    /* RMT output queues, when used as an N-1 flow: PDUs dropped
+     * and bytes currently queued, per class. */
+    uint64_t rmtq_drop[RL_RMTQ_CLASSES];
+    uint64_t rmtq_bytes[RL_RMTQ_CLASSES];
+    /* PDUs marked with ECN by the RMT output queues. */
+    uint64_t rmtq_ecn;
+    /* Window reductions in response to congestion echoed by the
+     * receiver. */
+    uint64_t ecn_cuts;
+    /* Sender congestion window (PDUs), 0 if not limiting. */
+    uint64_t cwnd;
+    /* Receive window advertised to the sender (PDUs). */
+    uint64_t rcv_win;
+    /* Retransmitted PDUs, and how many of them were retransmitted
+     * because of selective ACKs or NACKs rather than on timeout. */
+    uint64_t rtx_pkt;
+    uint64_t rtx_fast;
 };
 
 static inline void
 rl_flow_stats_init(struct rl_flow_stats *stats) {
+    int i;
+
     stats->tx_pkt = stats->tx_byte = stats->tx_err = 0;
     stats->rx_pkt = stats->rx_byte = stats->rx_err = 0;
+    for (i = 0; i < RL_RMTQ_CLASSES; i++) {
+        stats->rmtq_drop[i] = stats->rmtq_bytes[i] = 0;
+    }
+    stats->rmtq_ecn = stats->ecn_cuts = stats->cwnd = 0;
+    stats->rcv_win = stats->rtx_pkt = stats->rtx_fast = 0;
 }
 
 #define RL_SHIM_UDP_PORT    0x0d1f
@@ -55,6 +55,7 @@ enum {
     RLITE_KER_FLOW_STATS_REQ, /* 22 */
     RLITE_KER_FLOW_STATS_RESP, /* 23 */
     RLITE_KER_FLOW_CFG_UPDATE, /* 24 */
+    RLITE_KER_IPCP_PDUFT_MOD, /* 25 */
 
     RLITE_KER_MSG_MAX,
 };
@@ -225,12 +226,46 @@ struct rl_kmsg_ipcp_pduft_set {
     rl_addr_t dst_addr;
     /* The local port through which the remote IPCP
      * can be reached. */
-    uint16_t local_port;
+    rl_port_t local_port;
 } __attribute__((packed));
 
 /* application --> kernel message to flush the PDUFT of an IPC Process. */
 #define rl_kmsg_ipcp_pduft_flush rl_kmsg_ipcp_create_resp
 
+/* Maximum number of equal-cost next hops (lower flows) per
+ * destination address in the kernel PDUFT. */
+#define RLITE_PDUFT_ECMP_MAX    8
+
+/* An entry of a PDUFT modification batch. Entries with the same
+ * destination address form the equal-cost multipath set of that
+ * destination. At most one entry per destination can be marked as
+ * backup: it is used only when none of the primary lower flows is
+ * available. */
+struct rl_pduft_mod_entry {
+    rl_addr_t dst_addr;
+    rl_port_t local_port;
+#define RL_PDUFT_F_BACKUP   (1 << 0)
+    uint8_t flags;
+} __attribute__((packed));
+
+/* application --> kernel message to modify the PDUFT of an IPC Process
+ * in a single atomic step, so that forwarding never sees a partially
+ * updated (or empty) table. */
+struct rl_kmsg_ipcp_pduft_mod {
+    rl_msg_t msg_type;
+    uint32_t event_id;
+
+    rl_ipcp_id_t ipcp_id;
+    /* If set, the PDUFT is replaced by the entries in 'set', otherwise
+     * the addresses in 'del' are removed and, for each destination in
+     * 'set', the entries in 'set' replace the current ones. */
+    uint8_t replace;
+    /* Array of struct rl_pduft_mod_entry. */
+    struct rl_buf_field set;
+    /* Array of rl_addr_t. */
+    struct rl_buf_field del;
+} __attribute__((packed));
+
 /* uipcp (application) --> kernel to tell the kernel that this event
  * loop corresponds to an uipcp. */
 struct rl_kmsg_ipcp_uipcp_set {
@@ -23,35 +23,300 @@
 
 #include <linux/types.h>
 #include <linux/slab.h>
+#include <linux/percpu.h>
+#include <linux/irqflags.h>
+#include <linux/skbuff.h>
+#include <linux/mm.h>
 #include "rlite-kernel.h"
 
 
+/*
+ * Buffers are allocated from a small set of dedicated slab caches. Pool
+ * 0 contains the headers used by clones and the header+rawbuf pairs of
+ * buffers wrapping an sk_buff, while the other pools contain header and
+ * rawbuf co-located, with increasing data size classes.
+ * Requests that do not fit the largest class fall back to kmalloc().
+ * On top of each slab cache, a per-CPU free list (magazine) avoids
+ * going through the slab allocator in the common case.
+ * When zero-copy transmission is supported (RL_HAVE_ZCOPY_TX), medium
+ * size buffers (up to RL_BUF_FRAG_MAX) are instead carved out of per-CPU
+ * page chunks, still with header and rawbuf co-located: unlike slab
+ * memory, page fragments can be attached to an skb.
+ */
+#define RL_BUF_POOL_HDR         0
+#define RL_BUF_POOL_KMALLOC     0xff
+#define RL_BUF_NUM_POOLS        4
+#define RL_BUF_MAG_SIZE         32
+
+#ifdef RL_HAVE_ZCOPY_TX
+#define RL_BUF_PAGE_FRAG
+#define RL_BUF_FRAG_MAX         2048
+#define RL_BUF_FRAG_ORDER       3
+#endif
+
+struct rl_buf_pool {
+    const char          *name;
+    size_t              data_size;  /* rawbuf capacity, 0 for headers */
+    size_t              obj_size;
+    struct kmem_cache   *cache;
+};
+
+static struct rl_buf_pool rl_buf_pools[RL_BUF_NUM_POOLS] = {
+    [RL_BUF_POOL_HDR] = { .name = "rl_buf_hdr", .data_size = 0, },
+    { .name = "rl_buf_256", .data_size = 256, },
+    { .name = "rl_buf_2048", .data_size = 2048, },
+    { .name = "rl_buf_9216", .data_size = 9216, },
+};
+
+struct rl_buf_mag {
+    unsigned int        count;
+    void                *objs[RL_BUF_MAG_SIZE];
+};
+
+struct rl_buf_pcpu {
+    struct rl_buf_mag   mags[RL_BUF_NUM_POOLS];
+};
+
+static DEFINE_PER_CPU(struct rl_buf_pcpu, rl_buf_pcpu);
+
+#ifdef RL_BUF_PAGE_FRAG
+/* Page chunk currently carved by a CPU. Each fragment holds a reference
+ * to the (compound) page, and so does the cache. */
+struct rl_buf_frag_cache {
+    struct page         *page;
+    unsigned int        offset;
+    unsigned int        size;
+};
+
+static DEFINE_PER_CPU(struct rl_buf_frag_cache, rl_buf_frag_cache);
+
+static void *
+rl_buf_frag_alloc(size_t size, gfp_t gfp)
+{
+    struct page *page = NULL;
+    unsigned int order = RL_BUF_FRAG_ORDER;
+    unsigned long flags;
+    void *obj = NULL;
+
+    size = SKB_DATA_ALIGN(size);
+
+    for (;;) {
+        struct rl_buf_frag_cache *fc;
+        struct page *old = NULL;
+
+        /* Same context considerations as rl_buf_pool_alloc(). */
+        local_irq_save(flags);
+        fc = this_cpu_ptr(&rl_buf_frag_cache);
+        if (fc->page && fc->offset + size > fc->size) {
+            old = fc->page;
+            fc->page = NULL;
+        }
+        if (!fc->page && page) {
+            fc->page = page;
+            fc->offset = 0;
+            fc->size = PAGE_SIZE << order;
+            page = NULL;
+        }
+        if (fc->page) {
+            obj = (uint8_t *)page_address(fc->page) + fc->offset;
+            fc->offset += size;
+            get_page(fc->page);
+        }
+        local_irq_restore(flags);
+
+        if (old) {
+            put_page(old);
+        }
+        if (obj) {
+            break;
+        }
+
+        /* Refill out of the critical section, so that the caller's gfp
+         * can be honoured. Fall back to a single page under memory
+         * pressure. */
+        page = alloc_pages(gfp | __GFP_COMP | __GFP_NOWARN, order);
+        if (!page && order) {
+            order = 0;
+            page = alloc_pages(gfp | __GFP_NOWARN, 0);
+        }
+        if (!page) {
+            return NULL;
+        }
+    }
+
+    if (page) {
+        /* Another context refilled the cache in the meanwhile. */
+        put_page(page);
+    }
+
+    return obj;
+}
+#endif
+
+static void *
+rl_buf_pool_alloc(unsigned int idx, gfp_t gfp)
+{
+    struct rl_buf_mag *mag;
+    unsigned long flags;
+    void *obj = NULL;
+
+    /* Disable local interrupts, since buffers are allocated and freed
+     * from any context (process, softirq and hardirq for some shims). */
+    local_irq_save(flags);
+    mag = &this_cpu_ptr(&rl_buf_pcpu)->mags[idx];
+    if (likely(mag->count)) {
+        obj = mag->objs[--mag->count];
+    }
+    local_irq_restore(flags);
+
+    if (unlikely(!obj)) {
+        obj = kmem_cache_alloc(rl_buf_pools[idx].cache, gfp);
+    }
+
+    return obj;
+}
+
+static void
+rl_buf_pool_free(unsigned int idx, void *obj)
+{
+    struct rl_buf_mag *mag;
+    unsigned long flags;
+
+    local_irq_save(flags);
+    mag = &this_cpu_ptr(&rl_buf_pcpu)->mags[idx];
+    if (likely(mag->count < RL_BUF_MAG_SIZE)) {
+        mag->objs[mag->count++] = obj;
+        obj = NULL;
+    }
+    local_irq_restore(flags);
+
+    if (unlikely(obj)) {
+        kmem_cache_free(rl_buf_pools[idx].cache, obj);
+    }
+}
+
+void
+rl_bufs_fini(void)
+{
+    int cpu;
+    int i;
+
+    for_each_possible_cpu(cpu) {
+        struct rl_buf_pcpu *pcpu = per_cpu_ptr(&rl_buf_pcpu, cpu);
+
+        for (i = 0; i < RL_BUF_NUM_POOLS; i++) {
+            struct rl_buf_mag *mag = &pcpu->mags[i];
+
+            while (mag->count) {
+                kmem_cache_free(rl_buf_pools[i].cache,
+                                mag->objs[--mag->count]);
+            }
+        }
+
+#ifdef RL_BUF_PAGE_FRAG
+        {
+            struct rl_buf_frag_cache *fc = per_cpu_ptr(&rl_buf_frag_cache,
+                                                       cpu);
+
+            if (fc->page) {
+                put_page(fc->page);
+                fc->page = NULL;
+            }
+        }
+#endif
+    }
+
+    for (i = 0; i < RL_BUF_NUM_POOLS; i++) {
+        if (rl_buf_pools[i].cache) {
+            kmem_cache_destroy(rl_buf_pools[i].cache);
+            rl_buf_pools[i].cache = NULL;
+        }
+    }
+}
+
+int
+rl_bufs_init(void)
+{
+    int i;
+
+    for (i = 0; i < RL_BUF_NUM_POOLS; i++) {
+        struct rl_buf_pool *pool = &rl_buf_pools[i];
+
+        pool->obj_size = sizeof(struct rl_buf) + sizeof(struct rl_rawbuf) +
+                         pool->data_size;
+
+        pool->cache = kmem_cache_create(pool->name, pool->obj_size, 0,
+                                        SLAB_HWCACHE_ALIGN, NULL);
+        if (!pool->cache) {
+            PE("Failed to create slab cache %s\n", pool->name);
+            rl_bufs_fini();
+            return -ENOMEM;
+        }
+    }
+
+    return 0;
+}
+
 struct rl_buf *
 rl_buf_alloc(size_t size, size_t num_pci, gfp_t gfp)
 {
     struct rl_buf *rb;
     size_t real_size = size + num_pci * sizeof(struct rina_pci);
-    uint8_t *kbuf;
+    unsigned int idx;
 
-    rb = kmalloc(sizeof(*rb), gfp);
-    if (unlikely(!rb)) {
-        PE("Out of memory\n");
-        return NULL;
+#ifdef RL_BUF_PAGE_FRAG
+    if (real_size > rl_buf_pools[RL_BUF_POOL_HDR + 1].data_size &&
+            real_size <= RL_BUF_FRAG_MAX) {
+        rb = rl_buf_frag_alloc(sizeof(*rb) + sizeof(*rb->raw) + real_size,
+                               gfp);
+        if (unlikely(!rb)) {
+            PE("Out of memory\n");
+            return NULL;
+        }
+
+        rb->raw = (struct rl_rawbuf *)(rb + 1);
+        rb->raw->size = real_size;
+        rb->raw->pool = RL_BUF_POOL_FRAG;
+        rb->raw->head = rb->raw->buf;
+        rb->raw->skb = NULL;
+        atomic_set(&rb->raw->refcnt, 1);
+        rb->pci = (struct rina_pci *)(rb->raw->buf +
+                                      num_pci * sizeof(struct rina_pci));
+        rb->len = size;
+        rb->flags = 0;
+
+        return rb;
     }
+#endif
 
-    kbuf = kmalloc(sizeof(*rb->raw) + real_size, gfp);
-    if (unlikely(!kbuf)) {
-        kfree(rb);
+    /* Select the smallest size class that can contain the buffer. */
+    for (idx = RL_BUF_POOL_HDR + 1; idx < RL_BUF_NUM_POOLS; idx++) {
+        if (real_size <= rl_buf_pools[idx].data_size) {
+            break;
+        }
+    }
+
+    if (likely(idx < RL_BUF_NUM_POOLS)) {
+        rb = rl_buf_pool_alloc(idx, gfp);
+    } else {
+        idx = RL_BUF_POOL_KMALLOC;
+        rb = kmalloc(sizeof(*rb) + sizeof(*rb->raw) + real_size, gfp);
+    }
+
+    if (unlikely(!rb)) {
         PE("Out of memory\n");
         return NULL;
     }
 
-    rb->raw = (struct rl_rawbuf *)kbuf;
+    rb->raw = (struct rl_rawbuf *)(rb + 1);
     rb->raw->size = real_size;
+    rb->raw->pool = idx;
+    rb->raw->head = rb->raw->buf;
+    rb->raw->skb = NULL;
     atomic_set(&rb->raw->refcnt, 1);
     rb->pci = (struct rina_pci *)(rb->raw->buf + num_pci * sizeof(struct rina_pci));
     rb->len = size;
-    rb->tx_compl_flow = NULL;
+    rb->flags = 0;
 
     return rb;
 }
@@ -64,12 +329,40 @@ rl_buf_alloc_ctrl(size_t num_pci, gfp_t gfp)
 }
 EXPORT_SYMBOL(rl_buf_alloc_ctrl);
 
+/* Build a rl_buf that references the linear data of a received skb,
+ * without copying it. The rl_buf takes a reference to the skb, which
+ * is released when the rl_buf (and all its clones) are freed. The caller
+ * must make sure the skb is linear and its data is not shared. */
+struct rl_buf *
+rl_buf_alloc_skb(struct sk_buff *skb, gfp_t gfp)
+{
+    struct rl_buf *rb;
+
+    rb = rl_buf_pool_alloc(RL_BUF_POOL_HDR, gfp);
+    if (unlikely(!rb)) {
+        return NULL;
+    }
+
+    rb->raw = (struct rl_rawbuf *)(rb + 1);
+    rb->raw->size = skb->len;
+    rb->raw->pool = RL_BUF_POOL_HDR;
+    rb->raw->head = skb->head;
+    rb->raw->skb = skb_get(skb);
+    atomic_set(&rb->raw->refcnt, 1);
+    rb->pci = (struct rina_pci *)skb->data;
+    rb->len = skb->len;
+    rb->flags = 0;
+
+    return rb;
+}
+EXPORT_SYMBOL(rl_buf_alloc_skb);
+
 struct rl_buf *
 rl_buf_clone(struct rl_buf *rb, gfp_t gfp)
 {
     struct rl_buf *crb;
 
-    crb = kmalloc(sizeof(*crb), gfp);
+    crb = rl_buf_pool_alloc(RL_BUF_POOL_HDR, gfp);
     if (unlikely(!crb)) {
         return NULL;
     }
@@ -79,6 +372,7 @@ rl_buf_clone(struct rl_buf *rb, gfp_t gfp)
 
     /* Normal copy - includes pointer copy. */
     memcpy(crb, rb, sizeof(*rb));
+    crb->flags |= RL_BUF_F_CLONE;
 
     INIT_LIST_HEAD(&crb->node);
 
@@ -89,10 +383,33 @@ EXPORT_SYMBOL(rl_buf_clone);
 void
 rl_buf_free(struct rl_buf *rb)
 {
-    if (atomic_dec_and_test(&rb->raw->refcnt)) {
-        kfree(rb->raw);
+    struct rl_rawbuf *raw = rb->raw;
+
+    if (rb->flags & RL_BUF_F_CLONE) {
+        rl_buf_pool_free(RL_BUF_POOL_HDR, rb);
+    }
+
+    if (atomic_dec_and_test(&raw->refcnt)) {
+        /* The memory object starts with the original header. */
+        void *obj = ((struct rl_buf *)raw) - 1;
+
+        if (raw->skb) {
+            consume_skb(raw->skb);
+        }
+
+#ifdef RL_BUF_PAGE_FRAG
+        if (raw->pool == RL_BUF_POOL_FRAG) {
+            put_page(virt_to_head_page(obj));
+            return;
+        }
+#endif
+
+        if (likely(raw->pool != RL_BUF_POOL_KMALLOC)) {
+            rl_buf_pool_free(raw->pool, obj);
+        } else {
+            kfree(obj);
+        }
     }
-    kfree(rb);
 }
 EXPORT_SYMBOL(rl_buf_free);
 
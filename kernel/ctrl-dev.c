@@ -36,6 +36,8 @@
 #include <linux/bitmap.h>
 #include <linux/hashtable.h>
 #include <linux/spinlock.h>
+#include <linux/rcupdate.h>
+#include <linux/idr.h>
 
 
 int verbosity = RL_VERB_DBG;
@@ -96,29 +98,25 @@ struct registered_appl {
     struct list_head node;
 };
 
-#define IPCP_ID_BITMAP_SIZE     1024
-#define PORT_ID_BITMAP_SIZE     1024
-#define CEP_ID_BITMAP_SIZE      1024
+/* IPCP ids are allocated in [0, IPCP_ID_MAX), since 0xffff is used
+ * as an invalid IPCP id. */
+#define IPCP_ID_MAX             0xffff
 #define IPCP_HASHTABLE_BITS     7
-#define PORT_ID_HASHTABLE_BITS  7
-#define CEP_ID_HASHTABLE_BITS  7
 
 struct rl_dm {
-    /* Bitmap to manage IPC process ids. */
-    DECLARE_BITMAP(ipcp_id_bitmap, IPCP_ID_BITMAP_SIZE);
+    /* Allocator for IPC process ids. */
+    struct idr ipcp_idr;
 
     /* Hash table to store information about each IPC process. */
     DECLARE_HASHTABLE(ipcp_table, IPCP_HASHTABLE_BITS);
 
-    /* Bitmap to manage port ids. */
-    DECLARE_BITMAP(port_id_bitmap, PORT_ID_BITMAP_SIZE);
-
-    /* Hash tables to store information about each flow. */
-    DECLARE_HASHTABLE(flow_table, PORT_ID_HASHTABLE_BITS);
-    DECLARE_HASHTABLE(flow_table_by_cep, CEP_ID_HASHTABLE_BITS);
-
-    /* Bitmap to manage connection endpoint ids. */
-    DECLARE_BITMAP(cep_id_bitmap, CEP_ID_BITMAP_SIZE);
+    /* Port ids and connection endpoint ids allocators, which are
+     * also used to look up flows by port id and by cep id. The radix
+     * trees grow with the number of flows, and support lockless
+     * lookups under RCU. Ids are allocated cyclically, so that an id is
+     * not reused soon after its flow is removed. */
+    struct idr port_idr;
+    struct idr cep_idr;
 
     struct list_head ipcp_factories;
 
@@ -197,7 +195,7 @@ rl_ipcp_factory_register(struct ipcp_factory *factory)
         goto out;
     }
 
-    if (factory->ops.pduft_set && ! factory->ops.pduft_del) {
+    if (factory->ops.pduft_set && ! factory->ops.pduft_flow_del) {
         ret = -EINVAL;
         goto out;
     }
@@ -444,6 +442,7 @@ ipcp_add_entry(struct rl_kmsg_ipcp_create *req,
         return -ENOMEM;
     }
 
+    idr_preload(GFP_KERNEL);
     PLOCK();
 
     /* Check if an IPC process with that name already exists.
@@ -451,6 +450,7 @@ ipcp_add_entry(struct rl_kmsg_ipcp_create *req,
     hash_for_each(rl_dm.ipcp_table, bucket, cur, node) {
         if (rina_name_cmp(&cur->name, &req->name) == 0) {
             PUNLOCK();
+            idr_preload_end();
             kfree(entry);
             return -EINVAL;
         }
@@ -460,15 +460,16 @@ ipcp_add_entry(struct rl_kmsg_ipcp_create *req,
     dif = dif_get(req->dif_name, req->dif_type, &ret);
     if (!dif) {
         PUNLOCK();
+        idr_preload_end();
         kfree(entry);
         return ret;
     }
 
-    /* Try to alloc an IPC process id from the bitmap. */
-    entry->id = bitmap_find_next_zero_area(rl_dm.ipcp_id_bitmap,
-                            IPCP_ID_BITMAP_SIZE, 0, 1, 0);
-    if (entry->id < IPCP_ID_BITMAP_SIZE) {
-        bitmap_set(rl_dm.ipcp_id_bitmap, entry->id, 1);
+    /* Try to alloc an IPC process id. */
+    ret = idr_alloc(&rl_dm.ipcp_idr, entry, 0, IPCP_ID_MAX, GFP_NOWAIT);
+    if (ret >= 0) {
+        entry->id = ret;
+        ret = 0;
         /* Build and insert an IPC process entry in the hash table. */
         rina_name_move(&entry->name, &req->name);
         entry->dif = dif;
@@ -480,20 +481,18 @@ ipcp_add_entry(struct rl_kmsg_ipcp_create *req,
         init_waitqueue_head(&entry->uipcp_wqh);
         mutex_init(&entry->lock);
         hash_add(rl_dm.ipcp_table, &entry->node, entry->id);
-        INIT_LIST_HEAD(&entry->rmtq);
-        entry->rmtq_len = 0;
-        spin_lock_init(&entry->rmtq_lock);
+        rl_rmtq_ipcp_init(entry);
         tasklet_init(&entry->tx_completion, tx_completion_func,
                      (unsigned long)entry);
         init_waitqueue_head(&entry->tx_wqh);
         *pentry = entry;
     } else {
-        ret = -ENOSPC;
         dif_put(dif);
         kfree(entry);
     }
 
     PUNLOCK();
+    idr_preload_end();
 
     return ret;
 }
@@ -811,34 +810,31 @@ application_del_by_rc(struct rl_ctrl *rc)
     }
 }
 
-/* To be called under FLOCK. */
+/* To be called under FLOCK or rcu_read_lock(). */
 struct flow_entry *
 flow_lookup(rl_port_t port_id)
 {
-    struct flow_entry *entry;
-    struct hlist_head *head;
-    head = &rl_dm.flow_table[hash_min(port_id, HASH_BITS(rl_dm.flow_table))];
-    hlist_for_each_entry(entry, head, node) {
-        if (entry->local_port == port_id) {
-            return entry;
-        }
+    if (unlikely(port_id > INT_MAX)) {
+        return NULL;
     }
 
-    return NULL;
+    return idr_find(&rl_dm.port_idr, port_id);
 }
 EXPORT_SYMBOL(flow_lookup);
 
+/* Lookups do not take the flows_lock. A flow whose reference counter
+ * dropped to zero is being destroyed, and it cannot be taken anymore. */
 struct flow_entry *
 flow_get(rl_port_t port_id)
 {
     struct flow_entry *flow;
 
-    FLOCK();
+    rcu_read_lock();
     flow = flow_lookup(port_id);
-    if (flow) {
-        flow->refcnt++;
+    if (flow && !atomic_inc_not_zero(&flow->refcnt)) {
+        flow = NULL;
     }
-    FUNLOCK();
+    rcu_read_unlock();
 
     return flow;
 }
@@ -848,23 +844,19 @@ struct flow_entry *
 flow_get_by_cep(unsigned int cep_id)
 {
     struct flow_entry *entry;
-    struct hlist_head *head;
-
-    FLOCK();
 
-    head = &rl_dm.flow_table_by_cep[hash_min(cep_id,
-                                      HASH_BITS(rl_dm.flow_table_by_cep))];
-    hlist_for_each_entry(entry, head, node_cep) {
-        if (entry->local_cep == cep_id) {
-            entry->refcnt++;
-            FUNLOCK();
-            return entry;
-        }
+    if (unlikely(cep_id > INT_MAX)) {
+        return NULL;
     }
 
-    FUNLOCK();
+    rcu_read_lock();
+    entry = idr_find(&rl_dm.cep_idr, cep_id);
+    if (entry && !atomic_inc_not_zero(&entry->refcnt)) {
+        entry = NULL;
+    }
+    rcu_read_unlock();
 
-    return NULL;
+    return entry;
 }
 EXPORT_SYMBOL(flow_get_by_cep);
 
@@ -875,9 +867,7 @@ flow_get_ref(struct flow_entry *flow)
         return;
     }
 
-    FLOCK();
-    flow->refcnt++;
-    FUNLOCK();
+    atomic_inc(&flow->refcnt);
 }
 EXPORT_SYMBOL(flow_get_ref);
 
@@ -886,9 +876,7 @@ __flow_put(struct flow_entry *entry, bool maysleep)
 {
     struct rl_buf *rb;
     struct rl_buf *tmp;
-    struct pduft_entry *pfte, *tmp_pfte;
     struct dtp *dtp;
-    struct flow_entry *ret = entry;
     struct ipcp_entry *ipcp;
     unsigned long postpone = 0;
 
@@ -896,16 +884,18 @@ __flow_put(struct flow_entry *entry, bool maysleep)
         return NULL;
     }
 
-    FLOCK();
-
-    dtp = &entry->dtp;
-
-    entry->refcnt--;
-    if (entry->refcnt) {
+    if (!atomic_dec_and_test(&entry->refcnt)) {
         /* Flow is still being used by someone. */
-        goto out;
+        return entry;
     }
 
+    /* From now on the upper IPCP will use the backup PDUFT entries
+     * (if any) in place of this flow, even if the removal is
+     * postponed. */
+    WRITE_ONCE(entry->down, true);
+
+    dtp = &entry->dtp;
+
     if (entry->cfg.dtcp_present && !maysleep) {
         /* If DTCP is present, check if we should postopone flow
          * removal. We check mauusleep to make sure
@@ -928,24 +918,24 @@ __flow_put(struct flow_entry *entry, bool maysleep)
     }
 
     if (!maysleep) {
-        schedule_delayed_work(&entry->remove, postpone);
         /* Reference counter is zero here, but since the delayed
          * worker is going to use the flow, we reset the reference
-         * counter to 1. The delayed worker will invoke flow_put()
-         * after having performed its work.
+         * counter to 1 before scheduling it. The delayed worker will
+         * invoke flow_put() after having performed its work.
          */
-        entry->refcnt++;
-        goto out;
+        atomic_set(&entry->refcnt, 1);
+        schedule_delayed_work(&entry->remove, postpone);
+        return entry;
     }
 
-    ret = NULL;
-
     ipcp = entry->txrx.ipcp;
 
     if (ipcp->ops.flow_deallocated) {
         ipcp->ops.flow_deallocated(ipcp, entry);
     }
 
+    rl_rmtq_flush(ipcp, entry);
+
     if (verbosity >= RL_VERB_VERY) {
         dtp_dump(dtp);
     }
@@ -957,19 +947,12 @@ __flow_put(struct flow_entry *entry, bool maysleep)
     }
     entry->txrx.rx_qlen = 0;
 
-    list_for_each_entry_safe(pfte, tmp_pfte, &entry->pduft_entries, fnode) {
-        int ret;
-        rl_addr_t dst_addr = pfte->address;
-
-        BUG_ON(!entry->upper.ipcp || !entry->upper.ipcp->ops.pduft_del);
+    if (entry->upper.ipcp && entry->upper.ipcp->ops.pduft_flow_del) {
         /* Here we are sure that 'entry->upper.ipcp' will not be destroyed
-         * before 'entry' is destroyed.. */
-        ret = entry->upper.ipcp->ops.pduft_del(entry->upper.ipcp, pfte);
-        if (ret == 0) {
-            PD("Removed IPC process %u PDUFT entry: %llu --> %u\n",
-                    entry->upper.ipcp->id,
-                    (unsigned long long)dst_addr, entry->local_port);
-        }
+         * before 'entry' is destroyed. The entries are removed under
+         * the PDUFT lock of the upper IPCP, since concurrent PDUFT
+         * updates may be relinking them. */
+        entry->upper.ipcp->ops.pduft_flow_del(entry->upper.ipcp, entry);
     }
 
     if (ipcp->uipcp) {
@@ -1003,21 +986,22 @@ __flow_put(struct flow_entry *entry, bool maysleep)
 
         ipcp_put(entry->upper.ipcp);
     }
-    ipcp_put(ipcp);
 
-    hash_del(&entry->node);
-    rina_name_free(&entry->local_appl);
-    rina_name_free(&entry->remote_appl);
-    bitmap_clear(rl_dm.port_id_bitmap, entry->local_port, 1);
+    FLOCK();
+    idr_remove(&rl_dm.port_idr, entry->local_port);
     if (ipcp->flags & RL_K_IPCP_USE_CEP_IDS) {
-        hash_del(&entry->node_cep);
-        bitmap_clear(rl_dm.cep_id_bitmap, entry->local_cep, 1);
+        idr_remove(&rl_dm.cep_idr, entry->local_cep);
     }
-    PD("flow entry %u removed\n", entry->local_port);
-    kfree(entry);
-out:
     FUNLOCK();
-    return ret;
+
+    ipcp_put(ipcp);
+    rina_name_free(&entry->local_appl);
+    rina_name_free(&entry->remote_appl);
+    PD("flow entry %u removed\n", entry->local_port);
+    /* Lockless readers may still be looking at the entry. */
+    kfree_rcu(entry, rcu);
+
+    return NULL;
 }
 
 struct flow_entry *
@@ -1051,30 +1035,31 @@ flow_add(struct ipcp_entry *ipcp, struct upper_ref upper,
         return -ENOMEM;
     }
 
+    idr_preload(gfp);
     FLOCK();
 
-    /* Try to alloc a port id and a cep id from the bitmaps, cep
-     * ids being allocated only if needed. */
-    entry->local_port = bitmap_find_next_zero_area(rl_dm.port_id_bitmap,
-                                                   PORT_ID_BITMAP_SIZE,
-                                                   0, 1, 0);
-    if (ipcp->flags & RL_K_IPCP_USE_CEP_IDS) {
-        entry->local_cep = bitmap_find_next_zero_area(rl_dm.cep_id_bitmap,
-                                                      CEP_ID_BITMAP_SIZE,
-                                                      0, 1, 0);
-    } else {
-        entry->local_cep = 0;
-    }
-
-    if (entry->local_port < PORT_ID_BITMAP_SIZE &&
-                entry->local_cep < CEP_ID_BITMAP_SIZE) {
-        bitmap_set(rl_dm.port_id_bitmap, entry->local_port, 1);
-
+    /* Try to alloc a port id and a cep id, cep ids being allocated
+     * only if needed. Ids are reserved with a NULL pointer, so that
+     * lockless readers cannot see the entry until it is initialized. */
+    ret = idr_alloc_cyclic(&rl_dm.port_idr, NULL, 0, 0, GFP_NOWAIT);
+    if (ret >= 0) {
+        entry->local_port = ret;
+        ret = 0;
         if (ipcp->flags & RL_K_IPCP_USE_CEP_IDS) {
-            bitmap_set(rl_dm.cep_id_bitmap, entry->local_cep, 1);
+            ret = idr_alloc_cyclic(&rl_dm.cep_idr, NULL, 0, 0, GFP_NOWAIT);
+            if (ret >= 0) {
+                entry->local_cep = ret;
+                ret = 0;
+            } else {
+                idr_remove(&rl_dm.port_idr, entry->local_port);
+            }
+        } else {
+            entry->local_cep = 0;
         }
+    }
 
-        /* Build and insert a flow entry in the hash table. */
+    if (ret == 0) {
+        /* Build and insert a flow entry in the id tables. */
         rina_name_copy(&entry->local_appl, local_appl);
         rina_name_copy(&entry->remote_appl, remote_appl);
         entry->remote_port = 0;  /* Not valid. */
@@ -1082,19 +1067,22 @@ flow_add(struct ipcp_entry *ipcp, struct upper_ref upper,
         entry->remote_addr = 0;  /* Not valid. */
         entry->upper = upper;
         entry->event_id = event_id;
-        entry->refcnt = 1;  /* Cogito, ergo sum. */
+        atomic_set(&entry->refcnt, 1);  /* Cogito, ergo sum. */
         entry->never_bound = true;
         INIT_LIST_HEAD(&entry->pduft_entries);
         txrx_init(&entry->txrx, ipcp, false);
-        hash_add(rl_dm.flow_table, &entry->node, entry->local_port);
-        if (ipcp->flags & RL_K_IPCP_USE_CEP_IDS) {
-            hash_add(rl_dm.flow_table_by_cep, &entry->node_cep,
-                     entry->local_cep);
-        }
         INIT_DELAYED_WORK(&entry->remove, flow_del_func);
         rl_flow_stats_init(&entry->stats);
+        rl_rmtq_init(&entry->rmtq);
         dtp_init(&entry->dtp);
+        /* Publish the entry to lockless readers only after it has been
+         * initialized. */
+        idr_replace(&rl_dm.port_idr, entry, entry->local_port);
+        if (ipcp->flags & RL_K_IPCP_USE_CEP_IDS) {
+            idr_replace(&rl_dm.cep_idr, entry, entry->local_cep);
+        }
         FUNLOCK();
+        idr_preload_end();
 
         PLOCK();
         ipcp->refcnt++;
@@ -1110,10 +1098,10 @@ flow_add(struct ipcp_entry *ipcp, struct upper_ref upper,
         }
     } else {
         FUNLOCK();
+        idr_preload_end();
 
         kfree(entry);
         *pentry = NULL;
-        ret = -ENOSPC;
     }
 
 
@@ -1124,10 +1112,10 @@ static void
 flow_rc_unbind(struct rl_ctrl *rc)
 {
     struct flow_entry *flow;
-    struct hlist_node *tmp;
-    int bucket;
+    int id;
 
-    hash_for_each_safe(rl_dm.flow_table, bucket, tmp, flow, node) {
+    rcu_read_lock();
+    idr_for_each_entry(&rl_dm.port_idr, flow, id) {
         if (flow->upper.rc == rc) {
             /* Since this 'rc' is going to disappear, we have to remove
              * the reference stored into this flow. */
@@ -1151,6 +1139,7 @@ flow_rc_unbind(struct rl_ctrl *rc)
             }
         }
     }
+    rcu_read_unlock();
 }
 
 void
@@ -1165,7 +1154,7 @@ flow_make_mortal(struct flow_entry *flow)
              * didn't do it, the flow would live forever with its refcount
              * set to 1. */
             flow->never_bound = false;
-            flow->refcnt--;
+            atomic_dec(&flow->refcnt);
         }
 
         FUNLOCK();
@@ -1175,8 +1164,6 @@ flow_make_mortal(struct flow_entry *flow)
 int
 __ipcp_put(struct ipcp_entry *entry)
 {
-    struct rl_buf *rb, *tmp;
-
     if (!entry) {
         return 0;
     }
@@ -1190,7 +1177,7 @@ __ipcp_put(struct ipcp_entry *entry)
     }
 
     hash_del(&entry->node);
-    bitmap_clear(rl_dm.ipcp_id_bitmap, entry->id, 1);
+    idr_remove(&rl_dm.ipcp_idr, entry->id);
 
     PUNLOCK();
 
@@ -1207,10 +1194,9 @@ __ipcp_put(struct ipcp_entry *entry)
 
     tasklet_kill(&entry->tx_completion);
 
-    list_for_each_entry_safe(rb, tmp, &entry->rmtq, node) {
-        list_del(&rb->node);
-        rl_buf_free(rb);
-    }
+    /* The N-1 flows hold a reference to this IPCP, so there are no
+     * RMT queues left. */
+    WARN_ON(!list_empty(&entry->rmtq));
 
     /* If the module was refcounted for this IPC process instance,
      * remove the reference. Note that this operation **must** happen
@@ -1234,7 +1220,7 @@ ipcp_del(rl_ipcp_id_t ipcp_id)
     struct ipcp_entry *entry;
     int ret = 0;
 
-    if (ipcp_id >= IPCP_ID_BITMAP_SIZE) {
+    if (ipcp_id >= IPCP_ID_MAX) {
         /* No IPC process found. */
         return -ENXIO;
     }
@@ -1428,13 +1414,13 @@ rl_flow_fetch(struct rl_ctrl *rc, struct rl_msg_base *req)
 {
     struct flows_fetch_q_entry *fqe;
     struct flow_entry *entry;
-    int bucket;
+    int id;
     int ret = -ENOMEM;
 
     FLOCK();
 
     if (list_empty(&rc->flows_fetch_q)) {
-        hash_for_each(rl_dm.flow_table, bucket, entry, node) {
+        idr_for_each_entry(&rl_dm.port_idr, entry, id) {
             fqe = kmalloc(sizeof(*fqe), GFP_ATOMIC);
             if (!fqe) {
                 PE("Out of memory\n");
@@ -1504,6 +1490,11 @@ rl_ipcp_config(struct rl_ctrl *rc, struct rl_msg_base *bmsg)
                 entry->depth = depth;
             }
 
+        } else if (strncmp(req->name, "rmt-", 4) == 0) {
+            /* RMT queues of the flows supported by this IPCP, when
+             * used as N-1 flows. */
+            ret = rl_rmtq_config(entry, req->name, req->value);
+
         } else {
             mutex_lock(&entry->lock);
             if (entry->ops.config) {
@@ -1588,6 +1579,71 @@ rl_ipcp_pduft_flush(struct rl_ctrl *rc, struct rl_msg_base *bmsg)
     return ret;
 }
 
+static int
+rl_ipcp_pduft_mod(struct rl_ctrl *rc, struct rl_msg_base *bmsg)
+{
+    struct rl_kmsg_ipcp_pduft_mod *req =
+                    (struct rl_kmsg_ipcp_pduft_mod *)bmsg;
+    const struct rl_pduft_mod_entry *set = req->set.buf;
+    unsigned int num_set = req->set.len / sizeof(*set);
+    unsigned int num_del = req->del.len / sizeof(rl_addr_t);
+    struct flow_entry **flows = NULL;
+    struct ipcp_entry *ipcp = NULL;
+    unsigned int num_flows = 0;
+    int ret = -EINVAL;  /* Report failure by default. */
+    unsigned int i;
+
+    if (req->set.len % sizeof(*set) || req->del.len % sizeof(rl_addr_t)) {
+        goto out;
+    }
+
+    ipcp = ipcp_get(req->ipcp_id);
+    if (!ipcp || !ipcp->ops.pduft_mod) {
+        goto out;
+    }
+
+    if (num_set) {
+        flows = kcalloc(num_set, sizeof(*flows), GFP_KERNEL);
+        if (!flows) {
+            ret = -ENOMEM;
+            goto out;
+        }
+    }
+
+    /* Take a reference to all the lower flows involved, checking that
+     * they are really used by the requesting IPCP (see
+     * rl_ipcp_pduft_set()). */
+    for (num_flows = 0; num_flows < num_set; num_flows++) {
+        flows[num_flows] = flow_get(set[num_flows].local_port);
+        if (!flows[num_flows]) {
+            goto out;
+        }
+        if (flows[num_flows]->upper.ipcp != ipcp) {
+            num_flows++;
+            goto out;
+        }
+    }
+
+    mutex_lock(&ipcp->lock);
+    ret = ipcp->ops.pduft_mod(ipcp, req->replace, set, flows, num_set,
+                              req->del.buf, num_del);
+    mutex_unlock(&ipcp->lock);
+
+    if (ret == 0) {
+        PV("Modified PDUFT for IPC process %u: %u set, %u del, replace %u\n",
+                req->ipcp_id, num_set, num_del, req->replace);
+    }
+out:
+    for (i = 0; i < num_flows; i++) {
+        flow_put(flows[i]);
+    }
+    kfree(flows);
+    ipcp_put(ipcp);
+    rl_msg_free(rl_ker_numtables, RLITE_KER_MSG_MAX, bmsg);
+
+    return ret;
+}
+
 static int
 rl_ipcp_uipcp_set(struct rl_ctrl *rc, struct rl_msg_base *bmsg)
 {
@@ -1770,6 +1826,7 @@ rl_flow_get_stats(struct rl_ctrl *rc,
     if (flow->txrx.ipcp->ops.flow_get_stats) {
         ret = flow->txrx.ipcp->ops.flow_get_stats(flow, &resp.stats);
     }
+    rl_rmtq_get_stats(flow->txrx.ipcp, flow, &resp.stats);
     flow_put(flow);
 
     ret = rl_upqueue_append(rc, (const struct rl_msg_base *)&resp);
@@ -2276,6 +2333,7 @@ static rl_msg_handler_t rl_ctrl_handlers[] = {
     [RLITE_KER_FLOW_DEALLOC] = rl_flow_dealloc,
     [RLITE_KER_FLOW_STATS_REQ] = rl_flow_get_stats,
     [RLITE_KER_FLOW_CFG_UPDATE] = rl_flow_cfg_update,
+    [RLITE_KER_IPCP_PDUFT_MOD] = rl_ipcp_pduft_mod,
     [RLITE_KER_MSG_MAX] = NULL,
 };
 
@@ -2326,6 +2384,7 @@ rl_ctrl_write(struct file *f, const char __user *ubuf, size_t len, loff_t *ppos)
         case RLITE_KER_IPCP_CONFIG:
         case RLITE_KER_IPCP_PDUFT_SET:
         case RLITE_KER_IPCP_PDUFT_FLUSH:
+        case RLITE_KER_IPCP_PDUFT_MOD:
         case RLITE_KER_APPL_REGISTER_RESP:
         case RLITE_KER_IPCP_UIPCP_SET:
         case RLITE_KER_UIPCP_FA_REQ_ARRIVED:
@@ -2584,12 +2643,10 @@ rl_ctrl_init(void)
 {
     int ret;
 
-    bitmap_zero(rl_dm.ipcp_id_bitmap, IPCP_ID_BITMAP_SIZE);
+    idr_init(&rl_dm.ipcp_idr);
     hash_init(rl_dm.ipcp_table);
-    bitmap_zero(rl_dm.port_id_bitmap, PORT_ID_BITMAP_SIZE);
-    hash_init(rl_dm.flow_table);
-    bitmap_zero(rl_dm.cep_id_bitmap, CEP_ID_BITMAP_SIZE);
-    hash_init(rl_dm.flow_table_by_cep);
+    idr_init(&rl_dm.port_idr);
+    idr_init(&rl_dm.cep_idr);
     mutex_init(&rl_dm.general_lock);
     spin_lock_init(&rl_dm.flows_lock);
     spin_lock_init(&rl_dm.ipcps_lock);
@@ -2601,8 +2658,15 @@ rl_ctrl_init(void)
     INIT_LIST_HEAD(&rl_dm.appl_removeq);
     INIT_WORK(&rl_dm.appl_removew, appl_removew_func);
 
+    ret = rl_bufs_init();
+    if (ret) {
+        PE("Failed to initialize packet buffers\n");
+        return ret;
+    }
+
     ret = misc_register(&rl_ctrl_misc);
     if (ret) {
+        rl_bufs_fini();
         PE("Failed to register rlite misc device\n");
         return ret;
     }
@@ -2610,6 +2674,7 @@ rl_ctrl_init(void)
     ret = misc_register(&rl_io_misc);
     if (ret) {
         misc_deregister(&rl_ctrl_misc);
+        rl_bufs_fini();
         PE("Failed to register rlite-io misc device\n");
         return ret;
     }
@@ -2622,6 +2687,10 @@ rl_ctrl_fini(void)
 {
     misc_deregister(&rl_io_misc);
     misc_deregister(&rl_ctrl_misc);
+    rl_bufs_fini();
+    idr_destroy(&rl_dm.cep_idr);
+    idr_destroy(&rl_dm.port_idr);
+    idr_destroy(&rl_dm.ipcp_idr);
 }
 
 module_init(rl_ctrl_init);
@@ -36,49 +36,365 @@
 #include <linux/bitmap.h>
 #include <linux/hashtable.h>
 #include <linux/spinlock.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
 
 
+/* Default per-class limit (in bytes) for the RMT queues of an N-1
+ * flow, and default DRR quanta, which give twice the bandwidth share to
+ * each class with respect to the next one. */
+#define RL_RMTQ_MAX_BYTES_DFLT      (64 * 1500)
+#define RL_RMT_QUANTUM_DFLT         1500
+
+/* Default per-class occupancy (in bytes) above which data transfer PDUs
+ * are marked with ECN, so that senders slow down before the queue
+ * overflows. */
+#define RL_RMTQ_ECN_BYTES_DFLT      (16 * 1500)
+
+static inline unsigned int
+rmtq_class(struct rl_buf *rb)
+{
+    struct rina_pci *pci = RLITE_BUF_PCI(rb);
+
+    if (pci->pdu_type == PDU_T_MGMT ||
+            (pci->pdu_type & PDU_T_CTRL) == PDU_T_CTRL) {
+        return RL_RMTQ_CLASS_CTRL;
+    }
+
+    if (pci->conn_id.qos_id == RL_QOS_ID_LOW_LATENCY) {
+        return RL_RMTQ_CLASS_LOW_LATENCY;
+    }
+
+    return RL_RMTQ_CLASS_BEST_EFFORT;
+}
+
+/* Strict priority: the first non-empty class is served. */
+static struct rl_buf *
+rmt_prio_dequeue(struct ipcp_entry *ipcp, struct rmtq *q)
+{
+    unsigned int i;
+
+    for (i = 0; i < RL_RMTQ_CLASSES; i++) {
+        if (!list_empty(&q->queues[i])) {
+            return list_first_entry(&q->queues[i], struct rl_buf, node);
+        }
+    }
+
+    return NULL;
+}
+
+/* Deficit round robin: each class receives its quantum at the beginning
+ * of its turn, and is served as long as its head PDU fits the deficit.
+ * The deficit of an empty class is reset. */
+static struct rl_buf *
+rmt_drr_dequeue(struct ipcp_entry *ipcp, struct rmtq *q)
+{
+    for (;;) {
+        unsigned int i = q->drr_cur;
+
+        if (!list_empty(&q->queues[i])) {
+            struct rl_buf *rb = list_first_entry(&q->queues[i],
+                                                 struct rl_buf, node);
+
+            if (!q->drr_turn) {
+                q->deficit[i] += ipcp->rmt_quantum[i];
+                q->drr_turn = true;
+            }
+
+            if (rb->len <= q->deficit[i]) {
+                q->deficit[i] -= rb->len;
+                return rb;
+            }
+        } else {
+            q->deficit[i] = 0;
+        }
+
+        q->drr_cur = (i + 1) % RL_RMTQ_CLASSES;
+        q->drr_turn = false;
+    }
+}
+
+static void
+rmt_drr_requeue(struct ipcp_entry *ipcp, struct rmtq *q, unsigned int cls,
+                struct rl_buf *rb)
+{
+    /* Give back the deficit, the PDU will be served again in the
+     * current turn. */
+    q->deficit[cls] += rb->len;
+    q->drr_cur = cls;
+    q->drr_turn = true;
+}
+
+static const struct rmt_sched rmt_scheds[] = {
+    {
+        .name = "prio",
+        .dequeue = rmt_prio_dequeue,
+    },
+    {
+        .name = "drr",
+        .dequeue = rmt_drr_dequeue,
+        .requeue = rmt_drr_requeue,
+    },
+};
+
+void
+rl_rmtq_ipcp_init(struct ipcp_entry *ipcp)
+{
+    unsigned int i;
+
+    INIT_LIST_HEAD(&ipcp->rmtq);
+    ipcp->rmtq_len = 0;
+    spin_lock_init(&ipcp->rmtq_lock);
+    ipcp->rmt_sched = &rmt_scheds[0];
+    ipcp->rmtq_max_bytes = RL_RMTQ_MAX_BYTES_DFLT;
+    ipcp->rmtq_ecn_bytes = RL_RMTQ_ECN_BYTES_DFLT;
+    for (i = 0; i < RL_RMTQ_CLASSES; i++) {
+        ipcp->rmt_quantum[i] = RL_RMT_QUANTUM_DFLT <<
+                                    (RL_RMTQ_CLASSES - 1 - i);
+    }
+}
+
+void
+rl_rmtq_init(struct rmtq *q)
+{
+    unsigned int i;
+
+    for (i = 0; i < RL_RMTQ_CLASSES; i++) {
+        INIT_LIST_HEAD(&q->queues[i]);
+        q->bytes[i] = 0;
+        q->drops[i] = 0;
+        q->deficit[i] = 0;
+    }
+    q->ecn_marks = 0;
+    q->len = 0;
+    q->drr_cur = 0;
+    q->drr_turn = false;
+    INIT_LIST_HEAD(&q->node);
+}
+
+/* Queue a PDU that cannot be transmitted now on the N-1 flow. The PDU
+ * is dropped if its class queue is full, and marked with ECN if the
+ * queue is above the marking threshold. */
+int
+rl_rmtq_enqueue(struct ipcp_entry *ipcp, struct flow_entry *flow,
+                struct rl_buf *rb)
+{
+    struct rmtq *q = &flow->rmtq;
+    unsigned int cls = rmtq_class(rb);
+
+    spin_lock_bh(&ipcp->rmtq_lock);
+    if (q->bytes[cls] + rb->len > ipcp->rmtq_max_bytes) {
+        q->drops[cls]++;
+        spin_unlock_bh(&ipcp->rmtq_lock);
+        RPD(2, "rmtq overrun (class %u): dropping PDU\n", cls);
+        rl_buf_free(rb);
+        return -ENOBUFS;
+    }
+
+    /* The PCI is written in place, so PDUs whose rawbuf is shared
+     * (e.g. with the retransmission queue, or with an skb still being
+     * transmitted) are not marked. */
+    if (ipcp->rmtq_ecn_bytes && q->bytes[cls] >= ipcp->rmtq_ecn_bytes &&
+            RLITE_BUF_PCI(rb)->pdu_type == PDU_T_DT &&
+            atomic_read(&rb->raw->refcnt) == 1) {
+        RLITE_BUF_PCI(rb)->pdu_flags |= PDU_F_ECN;
+        q->ecn_marks++;
+    }
+
+    list_add_tail(&rb->node, &q->queues[cls]);
+    q->bytes[cls] += rb->len;
+    q->len++;
+    ipcp->rmtq_len++;
+    if (list_empty(&q->node)) {
+        list_add_tail(&q->node, &ipcp->rmtq);
+    }
+    spin_unlock_bh(&ipcp->rmtq_lock);
+
+    return 0;
+}
+EXPORT_SYMBOL(rl_rmtq_enqueue);
+
+/* Drop the PDUs queued on an N-1 flow which is going away. */
+void
+rl_rmtq_flush(struct ipcp_entry *ipcp, struct flow_entry *flow)
+{
+    struct rmtq *q = &flow->rmtq;
+    struct rl_buf *rb, *tmp;
+    unsigned int i;
+
+    spin_lock_bh(&ipcp->rmtq_lock);
+    for (i = 0; i < RL_RMTQ_CLASSES; i++) {
+        list_for_each_entry_safe(rb, tmp, &q->queues[i], node) {
+            list_del(&rb->node);
+            rl_buf_free(rb);
+        }
+        q->bytes[i] = 0;
+    }
+    ipcp->rmtq_len -= q->len;
+    q->len = 0;
+    list_del_init(&q->node);
+    spin_unlock_bh(&ipcp->rmtq_lock);
+}
+
+/* RMT queues configuration: "rmt-sched" (prio or drr), "rmt-qlimit"
+ * (bytes per class), "rmt-ecn" (ECN marking threshold in bytes per
+ * class, 0 to disable marking) and "rmt-quantum" (comma separated DRR
+ * quanta in bytes, one per class). Returns -ENOENT for other
+ * parameters. */
+int
+rl_rmtq_config(struct ipcp_entry *ipcp, const char *param_name,
+               const char *param_value)
+{
+    unsigned int quantum[RL_RMTQ_CLASSES];
+    unsigned int i;
+    int ret = -EINVAL;
+
+    if (strcmp(param_name, "rmt-sched") == 0) {
+        for (i = 0; i < ARRAY_SIZE(rmt_scheds); i++) {
+            if (strcmp(param_value, rmt_scheds[i].name) == 0) {
+                spin_lock_bh(&ipcp->rmtq_lock);
+                ipcp->rmt_sched = &rmt_scheds[i];
+                spin_unlock_bh(&ipcp->rmtq_lock);
+                ret = 0;
+                break;
+            }
+        }
+
+    } else if (strcmp(param_name, "rmt-qlimit") == 0) {
+        unsigned int max_bytes;
+
+        ret = kstrtouint(param_value, 10, &max_bytes);
+        if (ret == 0) {
+            spin_lock_bh(&ipcp->rmtq_lock);
+            ipcp->rmtq_max_bytes = max_bytes;
+            spin_unlock_bh(&ipcp->rmtq_lock);
+        }
+
+    } else if (strcmp(param_name, "rmt-ecn") == 0) {
+        unsigned int ecn_bytes;
+
+        ret = kstrtouint(param_value, 10, &ecn_bytes);
+        if (ret == 0) {
+            spin_lock_bh(&ipcp->rmtq_lock);
+            ipcp->rmtq_ecn_bytes = ecn_bytes;
+            spin_unlock_bh(&ipcp->rmtq_lock);
+        }
+
+    } else if (strcmp(param_name, "rmt-quantum") == 0) {
+        BUILD_BUG_ON(RL_RMTQ_CLASSES != 3);
+        if (sscanf(param_value, "%u,%u,%u", &quantum[0], &quantum[1],
+                   &quantum[2]) == RL_RMTQ_CLASSES &&
+                quantum[0] && quantum[1] && quantum[2]) {
+            spin_lock_bh(&ipcp->rmtq_lock);
+            memcpy(ipcp->rmt_quantum, quantum, sizeof(quantum));
+            spin_unlock_bh(&ipcp->rmtq_lock);
+            ret = 0;
+        }
+
+    } else {
+        ret = -ENOENT;
+    }
+
+    return ret;
+}
+
+void
+rl_rmtq_get_stats(struct ipcp_entry *ipcp, struct flow_entry *flow,
+                  struct rl_flow_stats *stats)
+{
+    unsigned int i;
+
+    spin_lock_bh(&ipcp->rmtq_lock);
+    for (i = 0; i < RL_RMTQ_CLASSES; i++) {
+        stats->rmtq_drop[i] = flow->rmtq.drops[i];
+        stats->rmtq_bytes[i] = flow->rmtq.bytes[i];
+    }
+    stats->rmtq_ecn = flow->rmtq.ecn_marks;
+    spin_unlock_bh(&ipcp->rmtq_lock);
+}
+
+/* Transmit the PDUs queued on the N-1 flows of an IPCP, until the IPCP
+ * cannot accept more. Flows are served in round robin order, one PDU
+ * at a time, and the PDU to transmit is picked by the scheduler among
+ * the queues of the flow. Process contexts waiting on a flow are woken
+ * up when its queues get drained. */
 void
 tx_completion_func(unsigned long arg)
 {
     struct ipcp_entry *ipcp= (struct ipcp_entry *)arg;
 
     for (;;) {
+        struct flow_entry *flow;
         struct rl_buf *rb;
+        struct rmtq *q;
+        unsigned int cls;
+        bool drained;
         int ret;
 
         spin_lock_bh(&ipcp->rmtq_lock);
-        if (ipcp->rmtq_len == 0) {
+        if (list_empty(&ipcp->rmtq)) {
             spin_unlock_bh(&ipcp->rmtq_lock);
             break;
         }
 
-        rb = list_first_entry(&ipcp->rmtq, struct rl_buf, node);
+        q = list_first_entry(&ipcp->rmtq, struct rmtq, node);
+        flow = container_of(q, struct flow_entry, rmtq);
+        if (unlikely(!atomic_inc_not_zero(&flow->refcnt))) {
+            /* The flow is going away: stop serving it, its PDUs are
+             * going to be dropped by rl_rmtq_flush(). */
+            list_del_init(&q->node);
+            spin_unlock_bh(&ipcp->rmtq_lock);
+            continue;
+        }
+        rb = ipcp->rmt_sched->dequeue(ipcp, q);
+        BUG_ON(!rb);
+        cls = rmtq_class(rb);
         list_del(&rb->node);
+        q->bytes[cls] -= rb->len;
+        q->len--;
         ipcp->rmtq_len--;
+        drained = (q->len == 0);
+        if (drained) {
+            list_del_init(&q->node);
+        } else {
+            list_move_tail(&q->node, &ipcp->rmtq);
+        }
         spin_unlock_bh(&ipcp->rmtq_lock);
 
         PD("Sending [%lu] from rmtq\n",
                 (long unsigned)RLITE_BUF_PCI(rb)->seqnum);
 
-        BUG_ON(!rb->tx_compl_flow);
-        ret = ipcp->ops.sdu_write(ipcp, rb->tx_compl_flow, rb, false);
+        /* The reference taken above keeps the flow (and its queues)
+         * alive while the lock is not held. */
+        ret = ipcp->ops.sdu_write(ipcp, flow, rb, false);
         if (unlikely(ret == -EAGAIN)) {
             PD("Pushing [%lu] back to rmtq\n",
                     (long unsigned)RLITE_BUF_PCI(rb)->seqnum);
             spin_lock_bh(&ipcp->rmtq_lock);
-            list_add_tail(&rb->node, &ipcp->rmtq);
+            list_add(&rb->node, &q->queues[cls]);
+            q->bytes[cls] += rb->len;
+            q->len++;
             ipcp->rmtq_len++;
+            /* This flow is served first next time. */
+            if (list_empty(&q->node)) {
+                list_add(&q->node, &ipcp->rmtq);
+            } else {
+                list_move(&q->node, &ipcp->rmtq);
+            }
+            if (ipcp->rmt_sched->requeue) {
+                ipcp->rmt_sched->requeue(ipcp, q, cls, rb);
+            }
             spin_unlock_bh(&ipcp->rmtq_lock);
+            flow_put(flow);
             break;
         }
+
+        if (drained) {
+            wake_up_interruptible_poll(flow->txrx.tx_wqh, POLLOUT |
+                                       POLLWRBAND | POLLWRNORM);
+        }
+        flow_put(flow);
     }
-#if 0
-    if (drained) {
-        wake_up_interruptible_poll(flow->txrx.tx_wqh, POLLOUT |
-                                   POLLWRBAND | POLLWRNORM);
-    }
-#endif
 }
 
 /* Userspace queue threshold. */
@@ -239,11 +555,30 @@ rl_write_restart_port(rl_port_t local_port)
 }
 EXPORT_SYMBOL(rl_write_restart_port);
 
+/* Kernel-side state of the shared-memory rings. The ring geometry and
+ * the indices owned by the kernel are kept here, since userspace can
+ * overwrite the shared header at any time. */
+struct rl_io_rings {
+    struct rl_rings_hdr *hdr;
+    size_t mem_size;
+    uint32_t num_slots;
+    uint32_t slot_size;
+    uint32_t slot_stride;
+    uint32_t tx_ofs;
+    uint32_t rx_ofs;
+    uint32_t tx_cons;
+    uint32_t rx_prod;
+};
+
 struct rl_io {
     uint8_t mode;
     struct flow_entry *flow;
     struct txrx *txrx;
     size_t max_sdu_size; /* temporary */
+
+    /* Serializes the rings setup and synchronization. */
+    struct mutex rings_lock;
+    struct rl_io_rings *rings;
 };
 
 static int
@@ -257,16 +592,17 @@ rl_io_open(struct inode *inode, struct file *f)
     }
 
     rio->max_sdu_size = ~0U; /* Hack disabled by default */
+    mutex_init(&rio->rings_lock);
     f->private_data = rio;
 
     return 0;
 }
 
-static ssize_t rl_io_write(struct file *f, const char __user *ubuf,
-                           size_t ulen, loff_t *ppos);
+static ssize_t rl_io_write_sdu(struct rl_io *rio, const char __user *ubuf,
+                               size_t ulen, bool blocking);
 static ssize_t
-splitted_sdu_write(struct file *f, const char __user *ubuf, size_t ulen,
-                     loff_t *ppos, size_t max_sdu_size)
+splitted_sdu_write(struct rl_io *rio, const char __user *ubuf, size_t ulen,
+                   bool blocking, size_t max_sdu_size)
 {
         ssize_t tot = 0;
 
@@ -274,7 +610,7 @@ splitted_sdu_write(struct file *f, const char __user *ubuf, size_t ulen,
             size_t fraglen = min(max_sdu_size, ulen);
             ssize_t ret;
 
-            ret = rl_io_write(f, ubuf, fraglen, ppos);
+            ret = rl_io_write_sdu(rio, ubuf, fraglen, blocking);
             if (ret < 0) {
                 break;
             }
@@ -288,15 +624,14 @@ splitted_sdu_write(struct file *f, const char __user *ubuf, size_t ulen,
 }
 
 static ssize_t
-rl_io_write(struct file *f, const char __user *ubuf, size_t ulen, loff_t *ppos)
+rl_io_write_sdu(struct rl_io *rio, const char __user *ubuf, size_t ulen,
+                bool blocking)
 {
-    struct rl_io *rio = (struct rl_io *)f->private_data;
     struct flow_entry *flow;
     struct ipcp_entry *ipcp;
     struct rl_buf *rb;
     struct rl_mgmt_hdr mhdr;
     size_t orig_len = ulen;
-    bool blocking = !(f->f_flags & O_NONBLOCK);
     DECLARE_WAITQUEUE(wait, current);
     ssize_t ret;
 
@@ -321,7 +656,8 @@ rl_io_write(struct file *f, const char __user *ubuf, size_t ulen, loff_t *ppos)
     } else if (unlikely(ulen > rio->max_sdu_size)) {
         /* Temporary, partial hack, it will go away once
          * EFCP implements fragmentation and reassembly. */
-        return splitted_sdu_write(f, ubuf, ulen, ppos, rio->max_sdu_size);
+        return splitted_sdu_write(rio, ubuf, ulen, blocking,
+                                  rio->max_sdu_size);
     }
 
     rb = rl_buf_alloc(ulen, ipcp->depth, GFP_KERNEL);
@@ -402,6 +738,11 @@ rl_io_write(struct file *f, const char __user *ubuf, size_t ulen, loff_t *ppos)
         remove_wait_queue(flow->txrx.tx_wqh, &wait);
     }
 
+    if (unlikely(rio->mode == RLITE_IO_MODE_IPCP_MGMT)) {
+        /* Release the N-1 flow taken by mgmt_sdu_build(). */
+        flow_put(flow);
+    }
+
     if (unlikely(ret < 0)) {
         return ret;
     }
@@ -410,10 +751,17 @@ rl_io_write(struct file *f, const char __user *ubuf, size_t ulen, loff_t *ppos)
 }
 
 static ssize_t
-rl_io_read(struct file *f, char __user *ubuf, size_t ulen, loff_t *ppos)
+rl_io_write(struct file *f, const char __user *ubuf, size_t ulen, loff_t *ppos)
 {
     struct rl_io *rio = (struct rl_io *)f->private_data;
-    bool blocking = !(f->f_flags & O_NONBLOCK);
+
+    return rl_io_write_sdu(rio, ubuf, ulen, !(f->f_flags & O_NONBLOCK));
+}
+
+static ssize_t
+rl_io_read_sdu(struct rl_io *rio, char __user *ubuf, size_t ulen,
+               bool blocking)
+{
     struct txrx *txrx = rio->txrx;
     DECLARE_WAITQUEUE(wait, current);
     ssize_t ret = 0;
@@ -507,6 +855,319 @@ rl_io_read(struct file *f, char __user *ubuf, size_t ulen, loff_t *ppos)
     return ret;
 }
 
+static ssize_t
+rl_io_read(struct file *f, char __user *ubuf, size_t ulen, loff_t *ppos)
+{
+    struct rl_io *rio = (struct rl_io *)f->private_data;
+
+    return rl_io_read_sdu(rio, ubuf, ulen, !(f->f_flags & O_NONBLOCK));
+}
+
+static void
+rl_io_rings_free(struct rl_io *rio)
+{
+    if (rio->rings) {
+        vfree(rio->rings->hdr);
+        kfree(rio->rings);
+        rio->rings = NULL;
+    }
+}
+
+static long
+rl_io_ioctl_rings_setup(struct rl_io *rio, struct rl_ioctl_rings __user *uarg)
+{
+    struct rl_ioctl_rings req;
+    struct rl_io_rings *rings;
+    size_t mem_size;
+    long ret = 0;
+
+    if (copy_from_user(&req, uarg, sizeof(req))) {
+        return -EFAULT;
+    }
+
+    if (rio->mode != RLITE_IO_MODE_APPL_BIND) {
+        PE("Error: rings are only supported on flows\n");
+        return -EINVAL;
+    }
+
+    if (req.num_slots == 0 || req.num_slots > RLITE_RINGS_MAX_SLOTS ||
+            (req.num_slots & (req.num_slots - 1)) ||
+            req.slot_size == 0 || req.slot_size > 65535) {
+        return -EINVAL;
+    }
+
+    rings = kzalloc(sizeof(*rings), GFP_KERNEL);
+    if (!rings) {
+        PE("Out of memory\n");
+        return -ENOMEM;
+    }
+
+    rings->num_slots = req.num_slots;
+    rings->slot_size = req.slot_size;
+    rings->slot_stride = ALIGN(sizeof(struct rl_ring_slot) + req.slot_size,
+                               RLITE_RINGS_ALIGN);
+    rings->tx_ofs = ALIGN(sizeof(struct rl_rings_hdr), RLITE_RINGS_ALIGN);
+    rings->rx_ofs = rings->tx_ofs + rings->num_slots * rings->slot_stride;
+    mem_size = PAGE_ALIGN(rings->rx_ofs +
+                          rings->num_slots * rings->slot_stride);
+    rings->mem_size = mem_size;
+
+    rings->hdr = vmalloc_user(mem_size);
+    if (!rings->hdr) {
+        kfree(rings);
+        PE("Out of memory\n");
+        return -ENOMEM;
+    }
+
+    rings->hdr->tx.num_slots = rings->hdr->rx.num_slots = rings->num_slots;
+    rings->hdr->tx.slot_size = rings->hdr->rx.slot_size = rings->slot_size;
+    rings->hdr->tx.slot_stride = rings->hdr->rx.slot_stride =
+                                                    rings->slot_stride;
+    rings->hdr->tx.slots_ofs = rings->tx_ofs;
+    rings->hdr->rx.slots_ofs = rings->rx_ofs;
+
+    mutex_lock(&rio->rings_lock);
+    if (rio->rings) {
+        ret = -EBUSY;
+    } else {
+        rio->rings = rings;
+    }
+    mutex_unlock(&rio->rings_lock);
+
+    if (ret) {
+        vfree(rings->hdr);
+        kfree(rings);
+        return ret;
+    }
+
+    if (put_user((uint32_t)mem_size, &uarg->mem_size)) {
+        return -EFAULT;
+    }
+
+    return 0;
+}
+
+#define RINGS_SLOT(_r, _ofs, _idx)                                  \
+    ((struct rl_ring_slot *)((uint8_t *)(_r)->hdr + (_ofs) +        \
+        ((_idx) & ((_r)->num_slots - 1)) * (_r)->slot_stride))
+
+/* Transmit the SDUs produced by userspace in the TX ring, until the flow
+ * can accept them. Slots that cannot be transmitted are dropped, and the
+ * error of the first one is returned. Called under the rings_lock. */
+static int
+rl_io_rings_txsync(struct rl_io *rio)
+{
+    struct rl_io_rings *rings = rio->rings;
+    struct flow_entry *flow = rio->flow;
+    struct ipcp_entry *ipcp;
+    uint32_t cons = rings->tx_cons;
+    uint32_t prod = smp_load_acquire(&rings->hdr->tx.prod);
+    int err = 0;
+
+    /* Same checks as rl_io_write_sdu(): rings are only set up on flows
+     * (not management devices). */
+    if (unlikely(!rio->txrx || !flow ||
+                 rio->mode != RLITE_IO_MODE_APPL_BIND)) {
+        return -ENXIO;
+    }
+    ipcp = flow->txrx.ipcp;
+
+    if (unlikely(prod - cons > rings->num_slots)) {
+        RPD(2, "Invalid TX producer index %u (cons %u)\n", prod, cons);
+        return -EINVAL;
+    }
+
+    for (; cons != prod; cons++) {
+        struct rl_ring_slot *slot = RINGS_SLOT(rings, rings->tx_ofs, cons);
+        uint32_t len = READ_ONCE(slot->len);
+        struct rl_buf *rb;
+        int ret;
+
+        if (unlikely(len > rings->slot_size)) {
+            RPD(2, "Dropping TX slot with invalid length %u\n", len);
+            ret = -EMSGSIZE;
+            goto drop;
+        }
+
+        rb = rl_buf_alloc(len, ipcp->depth, GFP_KERNEL);
+        if (unlikely(!rb)) {
+            /* Keep the slot for the next sync. */
+            if (!err) {
+                err = -ENOMEM;
+            }
+            break;
+        }
+        memcpy(RLITE_BUF_DATA(rb), slot->data, len);
+
+        ret = ipcp->ops.sdu_write(ipcp, flow, rb, false);
+        if (ret == -EAGAIN) {
+            /* Backpressure, keep the slot for the next sync. */
+            rl_buf_free(rb);
+            break;
+        }
+        if (likely(ret >= 0)) {
+            continue;
+        }
+        /* On errors other than -EAGAIN the rb has been consumed. */
+drop:
+        rings->hdr->tx_errors++;
+        if (!err) {
+            err = ret;
+        }
+    }
+
+    rings->tx_cons = cons;
+    smp_store_release(&rings->hdr->tx.cons, cons);
+
+    return err;
+}
+
+/* Move the SDUs from the flow rx queue to the free slots of the RX ring.
+ * Called under the rings_lock. */
+static int
+rl_io_rings_rxsync(struct rl_io *rio)
+{
+    struct rl_io_rings *rings = rio->rings;
+    struct flow_entry *flow = rio->flow;
+    struct txrx *txrx = rio->txrx;
+    uint32_t prod = rings->rx_prod;
+    uint32_t cons = smp_load_acquire(&rings->hdr->rx.cons);
+    bool eof = false;
+
+    if (unlikely(prod - cons > rings->num_slots)) {
+        RPD(2, "Invalid RX consumer index %u (prod %u)\n", cons, prod);
+        return -EINVAL;
+    }
+
+    while (prod - cons < rings->num_slots) {
+        struct rl_ring_slot *slot = RINGS_SLOT(rings, rings->rx_ofs, prod);
+        struct rina_pci *pci;
+        struct rl_buf *rb;
+        uint32_t len;
+
+        spin_lock_bh(&txrx->rx_lock);
+        if (list_empty(&txrx->rx_q)) {
+            eof = (txrx->state == FLOW_STATE_DEALLOCATED);
+            spin_unlock_bh(&txrx->rx_lock);
+            break;
+        }
+        rb = list_first_entry(&txrx->rx_q, struct rl_buf, node);
+        list_del(&rb->node);
+        txrx->rx_qlen--;
+        pci = txrx->rx_cur_pci ? txrx->rx_cur_pci : rb->pci - 1;
+        txrx->rx_cur_pci = NULL;
+        spin_unlock_bh(&txrx->rx_lock);
+
+        len = min_t(uint32_t, rb->len, rings->slot_size);
+        if (unlikely(len < rb->len)) {
+            RPD(2, "SDU truncated to %u bytes\n", len);
+        }
+        memcpy(slot->data, RLITE_BUF_DATA(rb), len);
+        slot->len = len;
+        prod++;
+
+        if (flow->sdu_rx_consumed) {
+            flow->sdu_rx_consumed(flow, pci);
+        }
+        rl_buf_free(rb);
+    }
+
+    rings->rx_prod = prod;
+    smp_store_release(&rings->hdr->rx.prod, prod);
+    if (eof) {
+        rings->hdr->flags |= RLITE_RINGS_F_EOF;
+    }
+
+    return 0;
+}
+
+static long
+rl_io_ioctl_rings_sync(struct rl_io *rio)
+{
+    long ret = -ENXIO;
+
+    mutex_lock(&rio->rings_lock);
+    if (rio->rings) {
+        /* Receive even if some TX slots failed, but report the
+         * TX error first. */
+        ret = rl_io_rings_txsync(rio);
+        if (rl_io_rings_rxsync(rio) && !ret) {
+            ret = -EINVAL;
+        }
+    }
+    mutex_unlock(&rio->rings_lock);
+
+    return ret;
+}
+
+static long
+rl_io_ioctl_rings_free(struct rl_io *rio)
+{
+    long ret = -ENXIO;
+
+    mutex_lock(&rio->rings_lock);
+    if (rio->rings) {
+        rl_io_rings_free(rio);
+        ret = 0;
+    }
+    mutex_unlock(&rio->rings_lock);
+
+    return ret;
+}
+
+static unsigned int
+rl_io_rings_poll(struct file *f, struct rl_io *rio, poll_table *wait)
+{
+    struct rl_io_rings *rings;
+    unsigned int mask = 0;
+
+    poll_wait(f, rio->flow->txrx.tx_wqh, wait);
+
+    mutex_lock(&rio->rings_lock);
+    rings = rio->rings;
+    if (unlikely(!rings)) {
+        mutex_unlock(&rio->rings_lock);
+        return 0;
+    }
+    if (rl_io_rings_txsync(rio)) {
+        mask |= POLLERR;
+    }
+    if (rl_io_rings_rxsync(rio)) {
+        mask |= POLLERR;
+    }
+    if (rings->rx_prod != READ_ONCE(rings->hdr->rx.cons) ||
+            (rings->hdr->flags & RLITE_RINGS_F_EOF)) {
+        mask |= POLLIN | POLLRDNORM;
+    }
+    if (rings->tx_cons + rings->num_slots !=
+            READ_ONCE(rings->hdr->tx.prod)) {
+        mask |= POLLOUT | POLLWRNORM;
+    }
+    mutex_unlock(&rio->rings_lock);
+
+    return mask;
+}
+
+static int
+rl_io_mmap(struct file *f, struct vm_area_struct *vma)
+{
+    struct rl_io *rio = (struct rl_io *)f->private_data;
+    unsigned long size = vma->vm_end - vma->vm_start;
+    int ret;
+
+    mutex_lock(&rio->rings_lock);
+    if (!rio->rings) {
+        ret = -ENXIO;
+    } else if (vma->vm_pgoff || size > rio->rings->mem_size) {
+        ret = -EINVAL;
+    } else {
+        ret = remap_vmalloc_range(vma, rio->rings->hdr, 0);
+    }
+    mutex_unlock(&rio->rings_lock);
+
+    return ret;
+}
+
 static unsigned int
 rl_io_poll(struct file *f, poll_table *wait)
 {
@@ -521,6 +1182,11 @@ rl_io_poll(struct file *f, poll_table *wait)
 
     poll_wait(f, &txrx->rx_wqh, wait);
 
+    if (rio->rings) {
+        /* With shared-memory rings, readiness refers to the rings. */
+        return rl_io_rings_poll(f, rio, wait);
+    }
+
     spin_lock_bh(&txrx->rx_lock);
     if (!list_empty(&txrx->rx_q) ||
             txrx->state == FLOW_STATE_DEALLOCATED) {
@@ -633,6 +1299,71 @@ rl_io_release_internal(struct rl_io *rio)
     return 0;
 }
 
+/* Batched version of rl_io_write() and rl_io_read(), in the style of
+ * sendmmsg() and recvmmsg(). Only the first SDU transfer may block,
+ * so that the call returns as soon as the flow cannot move more SDUs
+ * without waiting. An error is reported only if no SDU was transferred. */
+static long
+rl_io_ioctl_mmsg(struct file *f, struct rl_io *rio, unsigned int cmd,
+                 struct rl_ioctl_mmsg __user *umsg)
+{
+    bool blocking = !(f->f_flags & O_NONBLOCK);
+    struct rl_sdu_vec __user *uvec;
+    struct rl_ioctl_mmsg mmsg;
+    struct rl_sdu_vec vec;
+    ssize_t ret = 0;
+    uint32_t i;
+
+    if (unlikely(!rio->txrx)) {
+        return -ENXIO;
+    }
+
+    if (copy_from_user(&mmsg, umsg, sizeof(mmsg))) {
+        return -EFAULT;
+    }
+
+    if (mmsg.num > RLITE_MMSG_MAX) {
+        mmsg.num = RLITE_MMSG_MAX;
+    }
+    uvec = (struct rl_sdu_vec __user *)mmsg.vec;
+
+    for (i = 0; i < mmsg.num; i++) {
+        if (copy_from_user(&vec, uvec + i, sizeof(vec))) {
+            ret = -EFAULT;
+            break;
+        }
+
+        if (cmd == RLITE_IOCTL_MMSG_WRITE) {
+            ret = rl_io_write_sdu(rio, (const char __user *)vec.buf,
+                                  vec.len, blocking && i == 0);
+        } else {
+            ret = rl_io_read_sdu(rio, (char __user *)vec.buf,
+                                 vec.len, blocking && i == 0);
+            if (ret == 0) {
+                /* EOF, the flow has been deallocated. */
+                break;
+            }
+            if (ret > 0 && put_user((uint32_t)ret, &uvec[i].len)) {
+                ret = -EFAULT;
+            }
+        }
+
+        if (ret < 0) {
+            break;
+        }
+    }
+
+    if (i == 0 && ret < 0) {
+        return ret;
+    }
+
+    if (put_user(i, &umsg->num)) {
+        return -EFAULT;
+    }
+
+    return 0;
+}
+
 static long
 rl_io_ioctl(struct file *f, unsigned int cmd, unsigned long arg)
 {
@@ -641,8 +1372,20 @@ rl_io_ioctl(struct file *f, unsigned int cmd, unsigned long arg)
     struct rl_ioctl_info info;
     long ret = -EINVAL;
 
-    /* We have only one command. This should be used and checked. */
-    (void) cmd;
+    switch (cmd) {
+        case RLITE_IOCTL_MMSG_WRITE:
+        case RLITE_IOCTL_MMSG_READ:
+            return rl_io_ioctl_mmsg(f, rio, cmd, argp);
+
+        case RLITE_IOCTL_RINGS_SETUP:
+            return rl_io_ioctl_rings_setup(rio, argp);
+
+        case RLITE_IOCTL_RINGS_SYNC:
+            return rl_io_ioctl_rings_sync(rio);
+
+        case RLITE_IOCTL_RINGS_FREE:
+            return rl_io_ioctl_rings_free(rio);
+    }
 
     if (copy_from_user(&info, argp, sizeof(info))) {
         return -EFAULT;
@@ -654,6 +1397,10 @@ rl_io_ioctl(struct file *f, unsigned int cmd, unsigned long arg)
         return 0;
     }
 
+    /* Rings are bound to the current flow, free them first. */
+    mutex_lock(&rio->rings_lock);
+    rl_io_rings_free(rio);
+    mutex_unlock(&rio->rings_lock);
     rl_io_release_internal(rio);
 
     switch (info.mode) {
@@ -683,6 +1430,7 @@ rl_io_release(struct inode *inode, struct file *f)
 {
     struct rl_io *rio = (struct rl_io *)f->private_data;
 
+    rl_io_rings_free(rio);
     rl_io_release_internal(rio);
 
     kfree(rio);
@@ -697,6 +1445,7 @@ static const struct file_operations rl_io_fops = {
     .write          = rl_io_write,
     .read           = rl_io_read,
     .poll           = rl_io_poll,
+    .mmap           = rl_io_mmap,
     .unlocked_ioctl = rl_io_ioctl,
     .llseek         = noop_llseek,
 };
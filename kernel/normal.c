@@ -20,6 +20,7 @@
 
 #include <linux/types.h>
 #include "rlite/utils.h"
+#include "rlite/kernel-msg.h"
 #include "rlite-kernel.h"
 
 #include <linux/module.h>
@@ -32,35 +33,121 @@
 #include <linux/sched.h>
 #include <linux/workqueue.h>
 #include <linux/hashtable.h>
+#include <linux/jhash.h>
+#include <linux/rcupdate.h>
 #include <linux/ktime.h>
 #include <linux/spinlock.h>
 #include <linux/delay.h>
-
-
-#define PDUFT_HASHTABLE_BITS    3
+#include <linux/math64.h>
+
+
+#define PDUFT_HASHTABLE_BITS        3
+#define PDUFT_HASHTABLE_MAX_BITS    14
+
+/* DTCP window defaults. Congestion control windows are in PDUs. */
+#define DTP_CWND_MIN                2
+#define DTP_CWND_INIT               4
+
+/* Minimum auto-tuned receive window (in PDUs), and default per-flow
+ * memory limit for the receive window. */
+#define DTP_RWIN_MIN                8
+#define RL_RWIN_MAX_BYTES_DFLT      (4 << 20)
+
+/* A PDUFT instance. Lookups walk the table under RCU, while all the updates
+ * are serialized by the pduft_lock mutex. Batch updates build a complete
+ * new table off-line and publish it with a single pointer assignment, so
+ * that the datapath never sees an intermediate (e.g. empty) table.
+ * A destination may have up to RLITE_PDUFT_ECMP_MAX primary entries (one
+ * for each equal-cost lower flow) plus a backup entry, which all live in
+ * the same bucket. */
+struct pduft_table {
+    unsigned int        bits;
+    struct rcu_head     rcu;
+    struct hlist_head   heads[0];
+};
 
 struct rl_normal {
     struct ipcp_entry *ipcp;
 
+    /* Per-flow limit (bytes) for the auto-tuned receive window, 0 if
+     * the window is fixed to the initial credit. */
+    unsigned int rwin_max_bytes;
+
     /* Implementation of the PDU Forwarding Table (PDUFT). */
-    DECLARE_HASHTABLE(pdu_ft, PDUFT_HASHTABLE_BITS);
+    struct pduft_table __rcu *pduft;
+    unsigned int pduft_entries;
 
-    rwlock_t pduft_lock;
+    struct mutex pduft_lock;
 };
 
+static struct pduft_table *
+pduft_table_alloc(unsigned int num_entries)
+{
+    unsigned int bits = PDUFT_HASHTABLE_BITS;
+    struct pduft_table *tbl;
+    unsigned int i;
+
+    while (bits < PDUFT_HASHTABLE_MAX_BITS && (1U << bits) < num_entries) {
+        bits++;
+    }
+
+    tbl = kmalloc(sizeof(*tbl) + (sizeof(struct hlist_head) << bits),
+                  GFP_KERNEL);
+    if (!tbl) {
+        return NULL;
+    }
+
+    tbl->bits = bits;
+    for (i = 0; i < (1U << bits); i++) {
+        INIT_HLIST_HEAD(&tbl->heads[i]);
+    }
+
+    return tbl;
+}
+
+static void
+pduft_table_free(struct pduft_table *tbl)
+{
+    struct pduft_entry *entry;
+    struct hlist_node *tmp;
+    unsigned int i;
+
+    for (i = 0; i < (1U << tbl->bits); i++) {
+        hlist_for_each_entry_safe(entry, tmp, &tbl->heads[i], node) {
+            kfree(entry);
+        }
+    }
+
+    kfree(tbl);
+}
+
+static void
+pduft_table_free_rcu(struct rcu_head *rcu)
+{
+    pduft_table_free(container_of(rcu, struct pduft_table, rcu));
+}
+
 static void *
 rl_normal_create(struct ipcp_entry *ipcp)
 {
     struct rl_normal *priv;
+    struct pduft_table *tbl;
 
     priv = kzalloc(sizeof(*priv), GFP_KERNEL);
     if (!priv) {
         return NULL;
     }
 
+    tbl = pduft_table_alloc(0);
+    if (!tbl) {
+        kfree(priv);
+        return NULL;
+    }
+
     priv->ipcp = ipcp;
-    hash_init(priv->pdu_ft);
-    rwlock_init(&priv->pduft_lock);
+    priv->rwin_max_bytes = RL_RWIN_MAX_BYTES_DFLT;
+    RCU_INIT_POINTER(priv->pduft, tbl);
+    mutex_init(&priv->pduft_lock);
 
     PD("New IPC created [%p]\n", priv);
 
@@ -72,11 +159,201 @@ rl_normal_destroy(struct ipcp_entry *ipcp)
 {
     struct rl_normal *priv = ipcp->priv;
 
+    /* No flows are using this IPCP anymore, so nobody can be looking
+     * up the PDUFT. */
+    pduft_table_free(rcu_dereference_protected(priv->pduft, 1));
     kfree(priv);
 
     PD("IPC [%p] destroyed\n", priv);
 }
 
+/* CUBIC multiplicative decrease factor (beta = 7/10), and maximum
+ * distance from K (ms) considered by the window function. */
+#define CUBIC_BETA_NUM      7
+#define CUBIC_BETA_DEN      10
+#define CUBIC_T_MAX         (1 << 20)
+
+static inline bool
+dtp_cc_enabled(struct flow_entry *flow)
+{
+    struct fc_config *fc = &flow->cfg.dtcp.fc;
+
+    return fc->fc_type == RLITE_FC_T_WIN && fc->cfg.w.cong_ctrl != RL_CC_NONE;
+}
+
+/* Integer cube root, for arguments up to 2^60. */
+static u32
+cubic_root(u64 a)
+{
+    u32 x = 0;
+    int b;
+
+    if (a > (1ULL << 60)) {
+        a = 1ULL << 60;
+    }
+
+    for (b = 20; b >= 0; b--) {
+        u64 y = x | (1U << b);
+
+        if (y * y * y <= a) {
+            x = y;
+        }
+    }
+
+    return x;
+}
+
+/* Number of PDUs to be acknowledged for the window to grow by one PDU,
+ * following the CUBIC window function W(t) = C (t - K)^3 + w_max, where
+ * C = 0.4 PDUs/s^3, t is the time since the beginning of the epoch and
+ * K the time needed to get back to w_max. As in CUBIC, the target is the
+ * window one RTT from now. */
+static unsigned int
+cubic_cnt(struct dtp *dtp)
+{
+    s64 d, target;
+
+    if (!dtp->cubic_epoch) {
+        dtp->cubic_epoch = jiffies ? jiffies : 1;
+        if (dtp->cwnd < dtp->w_max) {
+            /* K = cbrt((w_max - cwnd) / C), in ms. */
+            dtp->cubic_k = cubic_root((u64)(dtp->w_max - dtp->cwnd) *
+                                      2500000000ULL);
+        } else {
+            dtp->w_max = dtp->cwnd;
+            dtp->cubic_k = 0;
+        }
+    }
+
+    d = (s64)jiffies_to_msecs(jiffies - dtp->cubic_epoch + dtp->rtt) -
+        dtp->cubic_k;
+    d = clamp_t(s64, d, -CUBIC_T_MAX, CUBIC_T_MAX);
+    target = dtp->w_max + div64_s64(4 * d * d * d, 10000000000LL);
+
+    if (target > dtp->cwnd) {
+        /* Grow at most by one PDU per acknowledged PDU. */
+        unsigned int diff = min_t(s64, target - dtp->cwnd, dtp->cwnd);
+
+        return dtp->cwnd / diff;
+    }
+
+    /* Plateau around w_max. */
+    return 100 * dtp->cwnd;
+}
+
+/* To be called under DTP lock. Grow the congestion window for 'acked'
+ * newly acknowledged PDUs: exponentially in slow start, then by one PDU
+ * per window (AIMD) or following the CUBIC window function. */
+static void
+dtp_cwnd_grow(struct flow_entry *flow, rl_seq_t acked)
+{
+    struct dtp *dtp = &flow->dtp;
+    unsigned int cnt;
+
+    if (dtp->cwnd < dtp->ssthresh) {
+        dtp->cwnd = min_t(rl_seq_t, dtp->cwnd + acked, dtp->ssthresh);
+        return;
+    }
+
+    cnt = dtp->cwnd;
+    if (flow->cfg.dtcp.fc.cfg.w.cong_ctrl == RL_CC_CUBIC) {
+        cnt = cubic_cnt(dtp);
+    }
+
+    dtp->cwnd_cnt += acked;
+    if (dtp->cwnd_cnt >= cnt) {
+        dtp->cwnd += dtp->cwnd_cnt / cnt;
+        dtp->cwnd_cnt %= cnt;
+    }
+}
+
+/* To be called under DTP lock. Multiplicative decrease of the congestion
+ * window, on a congestion indication or on a retransmission timeout.
+ * The slow start threshold is cut at most once per window of data, i.e.
+ * about once per RTT. Returns true if it was cut. */
+static bool
+dtp_cwnd_cut(struct flow_entry *flow, bool timeout)
+{
+    struct dtp *dtp = &flow->dtp;
+    unsigned int cwnd = dtp->cwnd;
+    bool cut = dtp->snd_una >= dtp->cg_recover;
+
+    if (!cwnd) {
+        /* Not limiting so far, start from the current window. */
+        cwnd = dtp->snd_rwe > dtp->snd_una ? dtp->snd_rwe - dtp->snd_una
+                                           : DTP_CWND_MIN;
+    }
+
+    if (cut) {
+        if (dtp_cc_enabled(flow) &&
+                flow->cfg.dtcp.fc.cfg.w.cong_ctrl == RL_CC_CUBIC) {
+            /* Fast convergence: release some bandwidth if the window
+             * did not get back to the previous maximum. */
+            dtp->w_max = cwnd < dtp->w_max ?
+                        cwnd * (CUBIC_BETA_DEN + CUBIC_BETA_NUM) /
+                        (2 * CUBIC_BETA_DEN) : cwnd;
+            dtp->ssthresh = cwnd * CUBIC_BETA_NUM / CUBIC_BETA_DEN;
+            dtp->cubic_epoch = 0;
+        } else {
+            dtp->ssthresh = cwnd >> 1;
+        }
+        dtp->ssthresh = max_t(unsigned int, dtp->ssthresh, DTP_CWND_MIN);
+        dtp->cg_recover = dtp->snd_lwe;
+        dtp->cwnd = dtp->ssthresh;
+        dtp->cwnd_cnt = 0;
+    }
+
+    if (timeout) {
+        /* Start again from slow start. */
+        dtp->cwnd = DTP_CWND_MIN;
+        dtp->cwnd_cnt = 0;
+        dtp->cubic_epoch = 0;
+    }
+
+    return cut;
+}
+
+/* To be called under DTP lock, on each flow control PDU. Update the
+ * congestion window from the acknowledged PDUs and the congestion
+ * indication echoed by the receiver, and return the right window edge
+ * to be used by the sender. Flows without congestion control only
+ * react to congestion indications, and go back to the receiver credit
+ * once the window has grown enough. */
+static rl_seq_t
+dtp_cwnd_update(struct flow_entry *flow, struct rina_pci_ctrl *pcic)
+{
+    struct dtp *dtp = &flow->dtp;
+    rl_seq_t credit = pcic->new_rwe - pcic->new_lwe;
+    rl_seq_t acked = 0;
+
+    if (pcic->new_lwe > dtp->snd_una) {
+        acked = pcic->new_lwe - dtp->snd_una;
+        dtp->snd_una = pcic->new_lwe;
+    }
+
+    if (pcic->base.pdu_flags & PDU_F_ECN) {
+        if (dtp_cwnd_cut(flow, false)) {
+            flow->stats.ecn_cuts++;
+            RPD(2, "Congestion echoed, cwnd --> %u\n", dtp->cwnd);
+        }
+
+    } else if (dtp->cwnd && acked) {
+        /* Only grow when the window is what limits the sender. */
+        if (dtp->cwnd < credit) {
+            dtp_cwnd_grow(flow, acked);
+        }
+        if (dtp->cwnd >= credit && !dtp_cc_enabled(flow)) {
+            dtp->cwnd = 0;
+        }
+    }
+
+    if (dtp->cwnd && dtp->cwnd < credit) {
+        return pcic->new_lwe + dtp->cwnd;
+    }
+
+    return pcic->new_rwe;
+}
+
 /* To be called under DTP lock */
 static void
 dtp_snd_reset(struct flow_entry *flow)
@@ -90,8 +367,19 @@ dtp_snd_reset(struct flow_entry *flow)
     dtp->snd_lwe = dtp->snd_rwe = dtp->next_seq_num_to_send;
     dtp->last_seq_num_sent = -1;
     dtp->last_ctrl_seq_num_rcvd = 0;
+    dtp->cwnd = dtp->cwnd_cnt = dtp->w_max = 0;
+    dtp->ssthresh = ~0U;
+    dtp->snd_una = dtp->cg_recover = 0;
+    dtp->cubic_epoch = 0;
     if (fc->fc_type == RLITE_FC_T_WIN) {
-        dtp->snd_rwe += fc->cfg.w.initial_credit;
+        rl_seq_t win = fc->cfg.w.initial_credit;
+
+        if (dtp_cc_enabled(flow)) {
+            /* Start in slow start. */
+            dtp->cwnd = DTP_CWND_INIT;
+            win = min_t(rl_seq_t, win, dtp->cwnd);
+        }
+        dtp->snd_rwe += win;
     }
 }
 
@@ -103,6 +391,7 @@ dtp_rcv_reset(struct flow_entry *flow)
     struct dtp *dtp = &flow->dtp;
 
     dtp->flags |= DTP_F_DRF_EXPECTED;
+    dtp->flags &= ~DTP_F_ECN_RCVD;
     dtp->rcv_lwe = dtp->rcv_lwe_priv = dtp->rcv_rwe = 0;
     dtp->max_seq_num_rcvd = -1;
     dtp->last_snd_data_ack = 0;
@@ -110,8 +399,11 @@ dtp_rcv_reset(struct flow_entry *flow)
     /* This is reset in the receive datapath (see rl_normal_sdu_rx) */
     dtp->next_snd_ctl_seq = 0;
 #endif
+    dtp->rcv_win = dtp->rcv_pdu_len = dtp->rcv_rtt = 0;
+    dtp->rcv_rtt_stamp = dtp->rcv_tune_stamp = 0;
     if (fc->fc_type == RLITE_FC_T_WIN) {
-        dtp->rcv_rwe += fc->cfg.w.initial_credit;
+        dtp->rcv_win = fc->cfg.w.initial_credit;
+        dtp->rcv_rwe += dtp->rcv_win;
     }
     dtp->last_lwe_sent = 0;
 }
@@ -224,6 +516,30 @@ rtt_to_rtx(struct dtp *dtp)
     return x > RL_A_MSECS_DFLT ? x : RL_A_MSECS_DFLT;
 }
 
+/* To be called under DTP lock. Queue a copy of a PDU in the rtxq into
+ * 'rrbq', to be retransmitted after releasing the lock, and postpone its
+ * retransmission timeout. We also invalidate rb->tx_jiffies, so that RTT
+ * is not updated on retransmitted packets. */
+static void
+rtxq_retransmit(struct flow_entry *flow, struct rl_buf *rb,
+                struct list_head *rrbq)
+{
+    struct dtp *dtp = &flow->dtp;
+    struct rl_buf *crb;
+
+    rb->rtx_jiffies = jiffies + rtt_to_rtx(dtp);
+    rb->tx_jiffies = 0;
+
+    crb = rl_buf_clone(rb, GFP_ATOMIC);
+    if (unlikely(!crb)) {
+        RPD(1, "OOM\n");
+        return;
+    }
+
+    list_add_tail(&crb->node, rrbq);
+    flow->stats.rtx_pkt++;
+}
+
 static void
 rtx_tmr_cb(long unsigned arg)
 {
@@ -247,21 +563,26 @@ rtx_tmr_cb(long unsigned arg)
     /* We scan all the retransmission list, since it is order by
      * ascending sequence number, not by ascending expiration time. */
     list_for_each_entry(rb, &dtp->rtxq, node) {
-        if (jiffies >= rb->rtx_jiffies) {
-            /* This rb should be retransmitted. We also invalidate
-             * rb->tx_jiffies, so that RTT is not updated on
-             * retransmitted packets. */
-            rb->rtx_jiffies += rtt_to_rtx(dtp);
-            rb->tx_jiffies = 0;
-
-            crb = rl_buf_clone(rb, GFP_ATOMIC);
-            if (unlikely(!crb)) {
-                RPD(1, "OOM\n");
-            } else {
-                list_add_tail(&crb->node, &rrbq);
-            }
+        if (jiffies < rb->rtx_jiffies) {
+            /* Not expired yet. */
+
+        } else if ((rb->flags & RL_BUF_F_SACKED) &&
+                        rb != list_first_entry(&dtp->rtxq, struct rl_buf,
+                                               node)) {
+            /* Already received by the peer, waiting for the cumulative
+             * ACK: keep the timer running, since the SACK information
+             * is advisory (the receiver may discard these PDUs). */
+            rb->rtx_jiffies = jiffies + rtt_to_rtx(dtp);
+
+        } else {
+            /* This rb should be retransmitted. The head is always
+             * retransmitted, even if SACKed, as the cumulative ACK
+             * that would have released it may have been lost. */
+            rb->flags &= ~RL_BUF_F_SACKED;
+            rtxq_retransmit(flow, rb, &rrbq);
+        }
 
-        } else if (rb->rtx_jiffies < next_exp) {
+        if (rb->rtx_jiffies < next_exp) {
             next_exp = rb->rtx_jiffies;
         }
     }
@@ -271,6 +592,11 @@ rtx_tmr_cb(long unsigned arg)
         mod_timer(&dtp->rtx_tmr, next_exp);
     }
 
+    if (!list_empty(&rrbq) && dtp_cc_enabled(flow)) {
+        /* Retransmission timeout, take it as a loss. */
+        dtp_cwnd_cut(flow, true);
+    }
+
     spin_unlock_bh(&dtp->lock);
 
     /* Send PDUs popped out from RTX queue. Note that the rrbq list
@@ -388,13 +714,13 @@ rl_normal_flow_init(struct ipcp_entry *ipcp, struct flow_entry *flow)
 }
 
 static struct pduft_entry *
-pduft_lookup_internal(struct rl_normal *priv, rl_addr_t dst_addr)
+pduft_lookup_internal(struct pduft_table *tbl, rl_addr_t dst_addr)
 {
     struct pduft_entry *entry;
     struct hlist_head *head;
 
-    head = &priv->pdu_ft[hash_min(dst_addr, HASH_BITS(priv->pdu_ft))];
-    hlist_for_each_entry(entry, head, node) {
+    head = &tbl->heads[hash_min(dst_addr, tbl->bits)];
+    hlist_for_each_entry_rcu(entry, head, node) {
         if (entry->address == dst_addr) {
             return entry;
         }
@@ -403,19 +729,74 @@ pduft_lookup_internal(struct rl_normal *priv, rl_addr_t dst_addr)
     return NULL;
 }
 
+/* Select a lower flow towards 'dst_addr'. When multiple equal-cost lower
+ * flows are available, the one with the highest hash of ('hash', port-id)
+ * is selected (rendezvous hashing). This keeps all the PDUs with the same
+ * 'hash' on the same lower flow independently of the order of the
+ * entries, and only moves the PDUs of the affected flows when the
+ * multipath set changes. Lower flows that are going down are skipped,
+ * and the backup entry is used if no primary flow is left, so that
+ * failover does not need to wait for the uipcp. A reference to the
+ * returned flow is taken, and the caller must release it. */
 static struct flow_entry *
-pduft_lookup(struct rl_normal *priv, rl_addr_t dst_addr)
+pduft_lookup(struct rl_normal *priv, rl_addr_t dst_addr, u32 hash)
 {
     struct pduft_entry *entry;
+    struct flow_entry *flow = NULL;
+    struct flow_entry *backup = NULL;
+    struct pduft_table *tbl;
+    u32 best = 0;
+
+    rcu_read_lock();
+    tbl = rcu_dereference(priv->pduft);
+    hlist_for_each_entry_rcu(entry, &tbl->heads[hash_min(dst_addr, tbl->bits)],
+                             node) {
+        struct flow_entry *cand;
+        u32 weight;
+
+        if (entry->address != dst_addr) {
+            continue;
+        }
 
-    read_lock_bh(&priv->pduft_lock);
-    entry = pduft_lookup_internal(priv, dst_addr);
-    read_unlock_bh(&priv->pduft_lock);
+        cand = READ_ONCE(entry->flow);
+        if (unlikely(READ_ONCE(cand->down))) {
+            continue;
+        }
+
+        if (entry->backup) {
+            backup = cand;
+            continue;
+        }
+
+        weight = jhash_2words(hash, cand->local_port, 0);
+        if (!flow || weight > best) {
+            flow = cand;
+            best = weight;
+        }
+    }
 
-    return entry ? entry->flow : NULL;
+    if (!flow) {
+        flow = backup;
+    }
+    if (flow && !atomic_inc_not_zero(&flow->refcnt)) {
+        /* The flow is being destroyed. */
+        flow = NULL;
+    }
+    rcu_read_unlock();
+
+    return flow;
 }
 
-#define RMTQ_MAX_LEN    64
+/* Hash of the fields that identify the EFCP connection of a PDU, used
+ * to keep all the PDUs of a connection on the same path, so that
+ * multipath forwarding does not reorder them. */
+static inline u32
+pdu_flow_hash(const struct rina_pci *pci)
+{
+    return jhash_3words(pci->src_addr, pci->dst_addr,
+                        pci->conn_id.src_cep ^ (pci->conn_id.dst_cep << 16),
+                        pci->conn_id.qos_id);
+}
 
 static int
 rmt_tx(struct ipcp_entry *ipcp, rl_addr_t remote_addr, struct rl_buf *rb,
@@ -427,7 +808,7 @@ rmt_tx(struct ipcp_entry *ipcp, rl_addr_t remote_addr, struct rl_buf *rb,
     int ret;
 
     lower_flow = pduft_lookup((struct rl_normal *)ipcp->priv,
-                              remote_addr);
+                              remote_addr, pdu_flow_hash(RLITE_BUF_PCI(rb)));
     if (unlikely(!lower_flow && remote_addr != ipcp->addr)) {
         RPD(2, "No route to IPCP %lu, dropping packet\n",
             (long unsigned)remote_addr);
@@ -446,6 +827,17 @@ rmt_tx(struct ipcp_entry *ipcp, rl_addr_t remote_addr, struct rl_buf *rb,
     lower_ipcp = lower_flow->txrx.ipcp;
     BUG_ON(!lower_ipcp);
 
+    if (!maysleep && READ_ONCE(lower_flow->rmtq.len)) {
+        /* Other PDUs are waiting for the N-1 flow: queue behind them,
+         * so that the RMT scheduler decides the transmission order. */
+        ret = rl_rmtq_enqueue(lower_ipcp, lower_flow, rb);
+        /* The queues may have been drained in the meanwhile. */
+        tasklet_schedule(&lower_ipcp->tx_completion);
+        flow_put(lower_flow);
+
+        return ret;
+    }
+
     if (maysleep) {
         add_wait_queue(lower_flow->txrx.tx_wqh, &wait);
     }
@@ -453,9 +845,16 @@ rmt_tx(struct ipcp_entry *ipcp, rl_addr_t remote_addr, struct rl_buf *rb,
     for (;;) {
         current->state = TASK_INTERRUPTIBLE;
 
-        /* Push down to the underlying IPCP. */
-        ret = lower_ipcp->ops.sdu_write(lower_ipcp, lower_flow,
-                                        rb, maysleep);
+        if (maysleep && READ_ONCE(lower_flow->rmtq.len)) {
+            /* Do not overtake the PDUs queued on the N-1 flow: wait
+             * for the tx completion tasklet to drain them. */
+            tasklet_schedule(&lower_ipcp->tx_completion);
+            ret = -EAGAIN;
+        } else {
+            /* Push down to the underlying IPCP. */
+            ret = lower_ipcp->ops.sdu_write(lower_ipcp, lower_flow,
+                                            rb, maysleep);
+        }
 
         if (ret == -EAGAIN) {
 
@@ -472,18 +871,10 @@ rmt_tx(struct ipcp_entry *ipcp, rl_addr_t remote_addr, struct rl_buf *rb,
                 continue;
 
             } else {
-                /* Enqueue in the RMT queue, if possible. */
-
-                spin_lock_bh(&lower_ipcp->rmtq_lock);
-                if (lower_ipcp->rmtq_len < RMTQ_MAX_LEN) {
-                    rb->tx_compl_flow = lower_flow;
-                    list_add_tail(&rb->node, &lower_ipcp->rmtq);
-                    lower_ipcp->rmtq_len++;
-                } else {
-                    RPD(2, "rmtq overrun: dropping PDU\n");
-                    rl_buf_free(rb);
-                }
-                spin_unlock_bh(&lower_ipcp->rmtq_lock);
+                /* Enqueue in the RMT queues of the N-1 flow, if
+                 * possible. Either way the PDU is not owned by the
+                 * caller anymore, so -EAGAIN must not be returned. */
+                ret = rl_rmtq_enqueue(lower_ipcp, lower_flow, rb);
             }
         }
 
@@ -494,6 +885,7 @@ rmt_tx(struct ipcp_entry *ipcp, rl_addr_t remote_addr, struct rl_buf *rb,
     if (maysleep) {
         remove_wait_queue(lower_flow->txrx.tx_wqh, &wait);
     }
+    flow_put(lower_flow);
 
     return ret;
 }
@@ -613,7 +1005,7 @@ rl_normal_sdu_write(struct ipcp_entry *ipcp,
     pci = RLITE_BUF_PCI(rb);
     pci->dst_addr = flow->remote_addr;
     pci->src_addr = ipcp->addr;
-    pci->conn_id.qos_id = 0;
+    pci->conn_id.qos_id = flow->cfg.qos_id;
     pci->conn_id.dst_cep = flow->remote_cep;
     pci->conn_id.src_cep = flow->local_cep;
     pci->pdu_type = PDU_T_DT;
@@ -684,7 +1076,8 @@ rl_normal_sdu_write(struct ipcp_entry *ipcp,
 
 /* Get N-1 flow and N-1 IPCP where the mgmt PDU should be
  * written and prepare the mgmt SDU. This does not take ownership
- * of the PDU, since it's not a transmission routine. */
+ * of the PDU, since it's not a transmission routine. On success a
+ * reference to the N-1 flow is held, which the caller must release. */
 static int
 rl_normal_mgmt_sdu_build(struct ipcp_entry *ipcp,
                            const struct rl_mgmt_hdr *mhdr,
@@ -697,7 +1090,10 @@ rl_normal_mgmt_sdu_build(struct ipcp_entry *ipcp,
     rl_addr_t dst_addr = 0; /* Not valid. */
 
     if (mhdr->type == RLITE_MGMT_HDR_T_OUT_DST_ADDR) {
-        *lower_flow = pduft_lookup(priv, mhdr->remote_addr);
+        /* Management PDUs are not associated to an EFCP connection,
+         * so they are spread by destination only. */
+        *lower_flow = pduft_lookup(priv, mhdr->remote_addr,
+                                   mhdr->remote_addr);
         if (unlikely(!(*lower_flow))) {
             RPD(2, "No route to IPCP %lu, dropping packet\n",
                     (long unsigned)mhdr->remote_addr);
@@ -719,7 +1115,6 @@ rl_normal_mgmt_sdu_build(struct ipcp_entry *ipcp,
 
             return -EINVAL;
         }
-        flow_put(*lower_flow);
 
     } else {
         return -EINVAL;
@@ -728,6 +1123,7 @@ rl_normal_mgmt_sdu_build(struct ipcp_entry *ipcp,
     BUG_ON(!(*lower_ipcp));
 
     if (unlikely(rl_buf_pci_push(rb))) {
+        flow_put(*lower_flow);
 
         return -ENOSPC;
     }
@@ -763,9 +1159,17 @@ rl_normal_config(struct ipcp_entry *ipcp, const char *param_name,
                (long unsigned)address);
             ipcp->addr = address;
         }
-    }
 
-    (void)priv;
+    } else if (strcmp(param_name, "rwin-max") == 0) {
+        unsigned int max_bytes;
+
+        /* Per-flow memory limit of the receive window, in bytes. Zero
+         * disables the auto-tuning. */
+        ret = kstrtouint(param_value, 10, &max_bytes);
+        if (ret == 0) {
+            priv->rwin_max_bytes = max_bytes;
+        }
+    }
 
     return ret;
 }
@@ -775,30 +1179,60 @@ rl_normal_pduft_set(struct ipcp_entry *ipcp, rl_addr_t dst_addr,
                       struct flow_entry *flow)
 {
     struct rl_normal *priv = (struct rl_normal *)ipcp->priv;
-    struct pduft_entry *entry;
+    struct pduft_table *tbl;
+    struct pduft_entry *entry, *cur;
+    struct hlist_node *tmp;
+
+    mutex_lock(&priv->pduft_lock);
 
-    write_lock_bh(&priv->pduft_lock);
+    if (READ_ONCE(flow->down)) {
+        /* The flow is being deallocated, its entries are going to be
+         * removed (or have been already). */
+        mutex_unlock(&priv->pduft_lock);
+        return -ENXIO;
+    }
 
-    entry = pduft_lookup_internal(priv, dst_addr);
+    tbl = rcu_dereference_protected(priv->pduft,
+                                    lockdep_is_held(&priv->pduft_lock));
+    entry = pduft_lookup_internal(tbl, dst_addr);
+
+    /* A single entry replaces the whole multipath set of 'dst_addr':
+     * reuse the first entry and remove the other ones. */
+    if (entry) {
+        hlist_for_each_entry_safe(cur, tmp,
+                        &tbl->heads[hash_min(dst_addr, tbl->bits)], node) {
+            if (cur != entry && cur->address == dst_addr) {
+                list_del(&cur->fnode);
+                hlist_del_rcu(&cur->node);
+                kfree_rcu(cur, rcu);
+                priv->pduft_entries--;
+            }
+        }
+    }
 
     if (!entry) {
-        entry = kmalloc(sizeof(*entry), GFP_ATOMIC);
+        entry = kmalloc(sizeof(*entry), GFP_KERNEL);
         if (!entry) {
+            mutex_unlock(&priv->pduft_lock);
             return -ENOMEM;
         }
 
-        hash_add(priv->pdu_ft, &entry->node, dst_addr);
+        entry->flow = flow;
+        entry->address = dst_addr;
+        entry->backup = false;
+        hlist_add_head_rcu(&entry->node,
+                           &tbl->heads[hash_min(dst_addr, tbl->bits)]);
         list_add_tail(&entry->fnode, &flow->pduft_entries);
+        priv->pduft_entries++;
     } else {
         /* Move from the old list to the new one. */
         list_del(&entry->fnode);
         list_add_tail(&entry->fnode, &flow->pduft_entries);
+        WRITE_ONCE(entry->flow, flow);
+        WRITE_ONCE(entry->backup, false);
     }
 
-    entry->flow = flow;
-    entry->address = dst_addr;
-
-    write_unlock_bh(&priv->pduft_lock);
+    mutex_unlock(&priv->pduft_lock);
 
     return 0;
 }
@@ -807,67 +1241,358 @@ static int
 rl_normal_pduft_flush(struct ipcp_entry *ipcp)
 {
     struct rl_normal *priv = (struct rl_normal *)ipcp->priv;
+    struct pduft_table *tbl;
     struct pduft_entry *entry;
     struct hlist_node *tmp;
-    int bucket;
+    unsigned int i;
 
-    write_lock_bh(&priv->pduft_lock);
+    mutex_lock(&priv->pduft_lock);
 
-    hash_for_each_safe(priv->pdu_ft, bucket, tmp, entry, node) {
-        list_del(&entry->fnode);
-        hash_del(&entry->node);
-        kfree(entry);
+    tbl = rcu_dereference_protected(priv->pduft,
+                                    lockdep_is_held(&priv->pduft_lock));
+    for (i = 0; i < (1U << tbl->bits); i++) {
+        hlist_for_each_entry_safe(entry, tmp, &tbl->heads[i], node) {
+            list_del(&entry->fnode);
+            hlist_del_rcu(&entry->node);
+            kfree_rcu(entry, rcu);
+        }
+    }
+    priv->pduft_entries = 0;
+
+    mutex_unlock(&priv->pduft_lock);
+
+    return 0;
+}
+
+/* Add a (dst_addr, flow) entry to a table that is not visible to the
+ * datapath yet, unless it is already there. */
+static int
+pduft_table_add(struct pduft_table *tbl, rl_addr_t dst_addr,
+                struct flow_entry *flow, bool backup,
+                unsigned int *num_entries)
+{
+    struct hlist_head *head = &tbl->heads[hash_min(dst_addr, tbl->bits)];
+    struct pduft_entry *entry;
+    unsigned int paths = 0;
+    bool has_backup = false;
+
+    hlist_for_each_entry(entry, head, node) {
+        if (entry->address == dst_addr) {
+            if (entry->flow == flow) {
+                return entry->backup == backup ? 0 : -EINVAL;
+            }
+            if (entry->backup) {
+                has_backup = true;
+            } else {
+                paths++;
+            }
+        }
     }
 
-    write_unlock_bh(&priv->pduft_lock);
+    if (backup ? has_backup : paths >= RLITE_PDUFT_ECMP_MAX) {
+        return -E2BIG;
+    }
+
+    entry = kmalloc(sizeof(*entry), GFP_KERNEL);
+    if (!entry) {
+        return -ENOMEM;
+    }
+    entry->address = dst_addr;
+    entry->flow = flow;
+    entry->backup = backup;
+    hlist_add_head(&entry->node, head);
+    (*num_entries)++;
 
     return 0;
 }
 
+/* Remove all the entries for 'dst_addr' from a table that is not
+ * visible to the datapath yet. */
+static void
+pduft_table_del(struct pduft_table *tbl, rl_addr_t dst_addr,
+                unsigned int *num_entries)
+{
+    struct pduft_entry *entry;
+    struct hlist_node *tmp;
+
+    hlist_for_each_entry_safe(entry, tmp,
+                              &tbl->heads[hash_min(dst_addr, tbl->bits)],
+                              node) {
+        if (entry->address == dst_addr) {
+            hlist_del(&entry->node);
+            kfree(entry);
+            (*num_entries)--;
+        }
+    }
+}
+
 static int
-rl_normal_pduft_del(struct ipcp_entry *ipcp, struct pduft_entry *entry)
+rl_normal_pduft_mod(struct ipcp_entry *ipcp, bool replace,
+                    const struct rl_pduft_mod_entry *set,
+                    struct flow_entry **flows, unsigned int num_set,
+                    const rl_addr_t *del, unsigned int num_del)
 {
     struct rl_normal *priv = (struct rl_normal *)ipcp->priv;
+    unsigned int num_entries = 0;
+    struct pduft_table *old, *tbl;
+    struct pduft_entry *entry;
+    struct hlist_node *tmp;
+    unsigned int i;
+    int ret = 0;
+
+    mutex_lock(&priv->pduft_lock);
+
+    old = rcu_dereference_protected(priv->pduft,
+                                    lockdep_is_held(&priv->pduft_lock));
+    tbl = pduft_table_alloc(replace ? num_set : priv->pduft_entries + num_set);
+    if (!tbl) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    /* Build the new table. When applying a delta, start from a copy
+     * of the current table, and drop the multipath sets of all the
+     * destinations that are removed or updated. Flows that are being
+     * deallocated are skipped, since their entries are going to be
+     * removed (see rl_normal_pduft_flow_del()). */
+    if (!replace) {
+        for (i = 0; i < (1U << old->bits) && !ret; i++) {
+            hlist_for_each_entry(entry, &old->heads[i], node) {
+                if (READ_ONCE(entry->flow->down)) {
+                    continue;
+                }
+                ret = pduft_table_add(tbl, entry->address, entry->flow,
+                                      entry->backup, &num_entries);
+                if (ret) {
+                    break;
+                }
+            }
+        }
+
+        for (i = 0; i < num_del && !ret; i++) {
+            pduft_table_del(tbl, del[i], &num_entries);
+        }
+        for (i = 0; i < num_set && !ret; i++) {
+            pduft_table_del(tbl, set[i].dst_addr, &num_entries);
+        }
+    }
+
+    for (i = 0; i < num_set && !ret; i++) {
+        if (READ_ONCE(flows[i]->down)) {
+            continue;
+        }
+        ret = pduft_table_add(tbl, set[i].dst_addr, flows[i],
+                              set[i].flags & RL_PDUFT_F_BACKUP, &num_entries);
+    }
+
+    if (ret) {
+        pduft_table_free(tbl);
+        goto out;
+    }
+
+    /* Move the flows' references from the old entries to the new ones
+     * and publish the new table. */
+    for (i = 0; i < (1U << old->bits); i++) {
+        hlist_for_each_entry_safe(entry, tmp, &old->heads[i], node) {
+            list_del(&entry->fnode);
+        }
+    }
+    for (i = 0; i < (1U << tbl->bits); i++) {
+        hlist_for_each_entry(entry, &tbl->heads[i], node) {
+            list_add_tail(&entry->fnode, &entry->flow->pduft_entries);
+        }
+    }
+    rcu_assign_pointer(priv->pduft, tbl);
+    priv->pduft_entries = num_entries;
+
+    call_rcu(&old->rcu, pduft_table_free_rcu);
+out:
+    mutex_unlock(&priv->pduft_lock);
+
+    return ret;
+}
 
-    write_lock_bh(&priv->pduft_lock);
-    list_del(&entry->fnode);
-    hash_del(&entry->node);
-    write_unlock_bh(&priv->pduft_lock);
+static int
+rl_normal_pduft_flow_del(struct ipcp_entry *ipcp, struct flow_entry *flow)
+{
+    struct rl_normal *priv = (struct rl_normal *)ipcp->priv;
+    struct pduft_entry *entry, *tmp;
 
-    kfree(entry);
+    mutex_lock(&priv->pduft_lock);
+    list_for_each_entry_safe(entry, tmp, &flow->pduft_entries, fnode) {
+        PD("Removed IPC process %u PDUFT entry: %llu --> %u\n",
+           ipcp->id, (unsigned long long)entry->address, flow->local_port);
+        list_del(&entry->fnode);
+        hlist_del_rcu(&entry->node);
+        priv->pduft_entries--;
+        kfree_rcu(entry, rcu);
+    }
+    mutex_unlock(&priv->pduft_lock);
 
     return 0;
 }
 
+/* To be called under DTP lock. Describe the PDUs received beyond
+ * rcv_lwe as SACK blocks: first the ones delivered but not consumed yet,
+ * then the ones waiting in the seqq (which is sorted by seqnum). */
+static void
+sack_blocks_fill(struct dtp *dtp, struct rina_pci_sack *pcis)
+{
+    struct rl_buf *cur;
+    unsigned int n = 0;
+
+    if (dtp->rcv_lwe_priv > dtp->rcv_lwe) {
+        pcis->blocks[n].start = dtp->rcv_lwe;
+        pcis->blocks[n].end = dtp->rcv_lwe_priv;
+        n++;
+    }
+
+    list_for_each_entry(cur, &dtp->seqq, node) {
+        rl_seq_t seqnum = RLITE_BUF_PCI(cur)->seqnum;
+
+        if (n && seqnum == pcis->blocks[n - 1].end) {
+            pcis->blocks[n - 1].end++;
+            continue;
+        }
+
+        if (n == RL_SACK_BLOCKS_MAX) {
+            break;
+        }
+        pcis->blocks[n].start = seqnum;
+        pcis->blocks[n].end = seqnum + 1;
+        n++;
+    }
+
+    pcis->num_blocks = n;
+}
+
 static struct rl_buf *
 ctrl_pdu_alloc(struct ipcp_entry *ipcp, struct flow_entry *flow,
                 uint8_t pdu_type, rl_seq_t ack_nack_seq_num)
 {
-    struct rl_buf *rb = rl_buf_alloc_ctrl(ipcp->depth, GFP_ATOMIC);
+    bool sack = (pdu_type & PDU_T_ACK_BIT) &&
+                (pdu_type & PDU_T_ACK_MASK) == PDU_T_SACK;
+    struct rl_buf *rb;
     struct rina_pci_ctrl *pcic;
 
+    if (sack) {
+        rb = rl_buf_alloc(sizeof(struct rina_pci_sack), ipcp->depth,
+                          GFP_ATOMIC);
+    } else {
+        rb = rl_buf_alloc_ctrl(ipcp->depth, GFP_ATOMIC);
+    }
+
     if (rb) {
         pcic = (struct rina_pci_ctrl *)RLITE_BUF_DATA(rb);
         pcic->base.dst_addr = flow->remote_addr;
         pcic->base.src_addr = ipcp->addr;
-        pcic->base.conn_id.qos_id = 0;
+        pcic->base.conn_id.qos_id = flow->cfg.qos_id;
         pcic->base.conn_id.dst_cep = flow->remote_cep;
         pcic->base.conn_id.src_cep = flow->local_cep;
         pcic->base.pdu_type = pdu_type;
         pcic->base.pdu_flags = 0;
+        if (flow->dtp.flags & DTP_F_ECN_RCVD) {
+            /* Echo the congestion indication to the sender. */
+            pcic->base.pdu_flags |= PDU_F_ECN;
+            flow->dtp.flags &= ~DTP_F_ECN_RCVD;
+        }
         pcic->base.pdu_len = rb->len;
         pcic->base.seqnum = flow->dtp.next_snd_ctl_seq++;
         pcic->last_ctrl_seq_num_rcvd = flow->dtp.last_ctrl_seq_num_rcvd;
         pcic->ack_nack_seq_num = ack_nack_seq_num;
         pcic->new_rwe = flow->dtp.rcv_rwe;
         pcic->new_lwe = flow->dtp.last_lwe_sent = flow->dtp.rcv_lwe;
+        if (!flow->dtp.rcv_rtt_stamp) {
+            /* Measure the time needed by the sender to use the credit
+             * we are advertising. */
+            flow->dtp.rcv_rtt_seq = flow->dtp.rcv_rwe;
+            flow->dtp.rcv_rtt_stamp = jiffies ? jiffies : 1;
+        }
         pcic->my_rwe = flow->dtp.snd_rwe;
         pcic->my_lwe = flow->dtp.snd_lwe;
+        if (sack) {
+            sack_blocks_fill(&flow->dtp, (struct rina_pci_sack *)pcic);
+        }
     }
 
     return rb;
 }
 
+/* To be called under DTP lock, when a PDU reaches the right window edge
+ * advertised at time rcv_rtt_stamp. Smaller samples are taken as they
+ * are, since the sender may not have used the credit immediately. */
+static void
+rcv_rtt_sample(struct dtp *dtp)
+{
+    unsigned int sample = jiffies - dtp->rcv_rtt_stamp;
+
+    if (!sample) {
+        sample = 1;
+    }
+
+    if (!dtp->rcv_rtt || sample < dtp->rcv_rtt) {
+        dtp->rcv_rtt = sample;
+    } else {
+        dtp->rcv_rtt = (dtp->rcv_rtt * 7 + sample) >> 3;
+    }
+    dtp->rcv_rtt_stamp = 0;
+}
+
+/* To be called under DTP lock. Receive window auto-tuning: once per
+ * receiver RTT, measure how many PDUs were consumed (by the application,
+ * or delivered to the upper IPCP), and advertise twice as much, so that
+ * a window-limited sender can keep doubling its rate. If the consumption
+ * rate drops below half of the window, the window is shrunk gradually.
+ * The window never grows beyond the per-flow memory limit, and does not
+ * grow while PDUs delivered to the application are not consumed. */
+static void
+rcv_win_tune(struct ipcp_entry *ipcp, struct flow_entry *flow)
+{
+    struct rl_normal *priv = (struct rl_normal *)ipcp->priv;
+    struct dtp *dtp = &flow->dtp;
+    unsigned long now = jiffies;
+    unsigned int win_min, win_max;
+    unsigned long elapsed;
+    rl_seq_t consumed;
+    rl_seq_t target;
+
+    if (!priv->rwin_max_bytes || !dtp->rcv_rtt || !dtp->rcv_pdu_len) {
+        return;
+    }
+
+    if (!dtp->rcv_tune_stamp || dtp->rcv_lwe < dtp->rcv_tune_lwe) {
+        goto restart;
+    }
+
+    elapsed = now - dtp->rcv_tune_stamp;
+    if (elapsed < dtp->rcv_rtt) {
+        return;
+    }
+
+    win_min = min_t(unsigned int, DTP_RWIN_MIN,
+                    flow->cfg.dtcp.fc.cfg.w.initial_credit);
+    win_max = max_t(unsigned int, win_min,
+                    priv->rwin_max_bytes / dtp->rcv_pdu_len);
+
+    /* PDUs consumed in one RTT. */
+    consumed = min_t(rl_seq_t, dtp->rcv_lwe - dtp->rcv_tune_lwe, win_max);
+    target = div64_u64(2 * consumed * dtp->rcv_rtt, elapsed);
+
+    if (target > dtp->rcv_win) {
+        if (dtp->rcv_lwe_priv - dtp->rcv_lwe < (dtp->rcv_win >> 1)) {
+            dtp->rcv_win = min_t(rl_seq_t, target, win_max);
+        }
+    } else if (target < (dtp->rcv_win >> 1)) {
+        dtp->rcv_win = max_t(rl_seq_t, dtp->rcv_win - (dtp->rcv_win >> 2),
+                             max_t(rl_seq_t, target, win_min));
+    }
+    dtp->rcv_win = min(dtp->rcv_win, win_max);
+
+restart:
+    dtp->rcv_tune_stamp = now ? now : 1;
+    dtp->rcv_tune_lwe = dtp->rcv_lwe;
+}
+
 /* This must be called under DTP lock and after rcv_lwe has been
  * updated.
  */
@@ -883,15 +1608,24 @@ sdu_rx_sv_update(struct ipcp_entry *ipcp, struct flow_entry *flow,
     if (cfg->flow_control) {
         /* POL: RcvrFlowControl */
         if (cfg->fc.fc_type == RLITE_FC_T_WIN) {
-            rl_seq_t win_size = cfg->fc.cfg.w.initial_credit;
+            rl_seq_t win_size;
+
+            rcv_win_tune(ipcp, flow);
+            win_size = flow->dtp.rcv_win;
 
             NPD("rcv_rwe [%lu] --> [%lu]\n",
                     (long unsigned)flow->dtp.rcv_rwe,
                     (long unsigned)(flow->dtp.rcv_lwe + win_size));
-            flow->dtp.rcv_rwe = flow->dtp.rcv_lwe + win_size;
+            /* A smaller window takes effect as rcv_lwe advances, the
+             * right edge cannot go backward. */
+            if (flow->dtp.rcv_lwe + win_size > flow->dtp.rcv_rwe) {
+                flow->dtp.rcv_rwe = flow->dtp.rcv_lwe + win_size;
+            }
 
+            /* Congestion indications are echoed without delay. */
             if ((flow->dtp.rcv_lwe < flow->dtp.last_lwe_sent +
-                                (win_size >> 1)) && !ack_immediate && a) {
+                                (win_size >> 1)) && !ack_immediate && a &&
+                    !(flow->dtp.flags & DTP_F_ECN_RCVD)) {
                 NPD("ACK delayed %lu %lu %lu\n", (long unsigned)flow->dtp.last_lwe_sent,
                    (long unsigned)flow->dtp.rcv_lwe, (long unsigned)(flow->dtp.last_lwe_sent + (win_size >> 1)));
                 goto no_ack;
@@ -995,14 +1729,90 @@ seqq_pop_many(struct dtp *dtp, rl_seq_t max_sdu_gap, struct list_head *qrbs)
     }
 }
 
+/* Number of PDUs selectively acknowledged beyond a missing PDU which
+ * make the sender consider it lost, so that some reordering is
+ * tolerated. */
+#define DTP_DUPTHRESH   3
+
+/* To be called under DTP lock. Mark the PDUs in the rtxq covered by the
+ * SACK blocks, so that the rtx timer does not retransmit them, and
+ * retransmit right away (once) the PDUs that are missing below at least
+ * DTP_DUPTHRESH selectively acknowledged PDUs. Returns the number of
+ * PDUs retransmitted. */
+static unsigned int
+rtxq_sack(struct flow_entry *flow, const struct rina_pci_sack *pcis,
+          struct list_head *rrbq)
+{
+    struct dtp *dtp = &flow->dtp;
+    unsigned int sacked = 0;
+    unsigned int lost = 0;
+    struct rl_buf *cur;
+    unsigned int i;
+
+    /* Scan by descending seqnum, to count the PDUs received beyond
+     * each missing one. */
+    list_for_each_entry_reverse(cur, &dtp->rtxq, node) {
+        rl_seq_t seqnum = RLITE_BUF_PCI(cur)->seqnum;
+
+        for (i = 0; i < pcis->num_blocks; i++) {
+            if (seqnum >= pcis->blocks[i].start &&
+                    seqnum < pcis->blocks[i].end) {
+                cur->flags |= RL_BUF_F_SACKED;
+                break;
+            }
+        }
+
+        if (cur->flags & RL_BUF_F_SACKED) {
+            sacked++;
+
+        } else if (sacked >= DTP_DUPTHRESH && cur->tx_jiffies) {
+            RPD(2, "fast retransmit [%lu]\n", (long unsigned)seqnum);
+            rtxq_retransmit(flow, cur, rrbq);
+            lost++;
+        }
+    }
+
+    return lost;
+}
+
+/* To be called under DTP lock. Retransmit right away the PDUs in
+ * [start, end) requested by the receiver, unless they have been
+ * selectively acknowledged. Returns the number of PDUs retransmitted. */
+static unsigned int
+rtxq_nack(struct flow_entry *flow, rl_seq_t start, rl_seq_t end,
+          struct list_head *rrbq)
+{
+    struct dtp *dtp = &flow->dtp;
+    unsigned int lost = 0;
+    struct rl_buf *cur;
+
+    list_for_each_entry(cur, &dtp->rtxq, node) {
+        rl_seq_t seqnum = RLITE_BUF_PCI(cur)->seqnum;
+
+        if (seqnum >= end) {
+            break;
+        }
+
+        if (seqnum >= start && !(cur->flags & RL_BUF_F_SACKED)) {
+            RPD(2, "retransmit [%lu] on NACK\n", (long unsigned)seqnum);
+            rtxq_retransmit(flow, cur, rrbq);
+            lost++;
+        }
+    }
+
+    return lost;
+}
+
 static int
 sdu_rx_ctrl(struct ipcp_entry *ipcp, struct flow_entry *flow,
             struct rl_buf *rb)
 {
     struct rina_pci_ctrl *pcic = RLITE_BUF_PCI_CTRL(rb);
+    struct rina_pci_sack *pcis = NULL;
     struct dtp *dtp = &flow->dtp;
-    struct list_head qrbs;
+    struct list_head qrbs, rrbq;
     struct rl_buf *qrb, *tmp;
+    unsigned int lost = 0;
 
     if (unlikely((pcic->base.pdu_type & PDU_T_CTRL)
                 != PDU_T_CTRL)) {
@@ -1011,7 +1821,19 @@ sdu_rx_ctrl(struct ipcp_entry *ipcp, struct flow_entry *flow,
         return 0;
     }
 
+    if ((pcic->base.pdu_type & PDU_T_ACK_BIT) &&
+            (pcic->base.pdu_type & PDU_T_ACK_MASK) >= PDU_T_SACK) {
+        /* Selective ACK or NACK, with blocks. */
+        pcis = (struct rina_pci_sack *)pcic;
+        if (unlikely(rb->len < sizeof(*pcis) ||
+                     pcis->num_blocks > RL_SACK_BLOCKS_MAX)) {
+            RPD(2, "Invalid selective ACK/NACK PDU, ignoring blocks\n");
+            pcis = NULL;
+        }
+    }
+
     INIT_LIST_HEAD(&qrbs);
+    INIT_LIST_HEAD(&rrbq);
 
     spin_lock_bh(&dtp->lock);
 
@@ -1047,12 +1869,17 @@ sdu_rx_ctrl(struct ipcp_entry *ipcp, struct flow_entry *flow,
                     (long unsigned)pcic->new_rwe);
 
         } else {
+            rl_seq_t new_rwe = dtp_cwnd_update(flow, pcic);
+
             NPD("snd_rwe [%lu] --> [%lu]\n",
                     (long unsigned)dtp->snd_rwe,
-                    (long unsigned)pcic->new_rwe);
+                    (long unsigned)new_rwe);
 
-            /* Update snd_rwe. */
-            dtp->snd_rwe = pcic->new_rwe;
+            /* Update snd_rwe. The congestion window can only stop
+             * the window from growing, not shrink it. */
+            if (new_rwe > dtp->snd_rwe) {
+                dtp->snd_rwe = new_rwe;
+            }
 
             /* The update may have unblocked PDU in the cwq,
              * let's pop them out. */
@@ -1081,6 +1908,7 @@ sdu_rx_ctrl(struct ipcp_entry *ipcp, struct flow_entry *flow,
 
         switch (pcic->base.pdu_type & PDU_T_ACK_MASK) {
             case PDU_T_ACK:
+            case PDU_T_SACK:
                 list_for_each_entry_safe(cur, tmp, &dtp->rtxq, node) {
                     struct rina_pci *pci = RLITE_BUF_PCI(cur);
 
@@ -1126,17 +1954,38 @@ sdu_rx_ctrl(struct ipcp_entry *ipcp, struct flow_entry *flow,
                 if (list_empty(&dtp->rtxq)) {
                     /* Everything has been acked, we can stop the rtx timer. */
                     del_timer(&dtp->rtx_tmr);
+
+                } else if (pcis) {
+                    lost = rtxq_sack(flow, pcis, &rrbq);
                 }
 
                 break;
 
             case PDU_T_NACK:
-            case PDU_T_SACK:
+                /* Fast retransmit of the PDU the receiver is missing. */
+                lost = rtxq_nack(flow, pcic->ack_nack_seq_num,
+                                 pcic->ack_nack_seq_num + 1, &rrbq);
+                break;
+
             case PDU_T_SNACK:
-                PI("Missing support for PDU type [%X]\n",
-                        pcic->base.pdu_type);
+                if (pcis) {
+                    unsigned int i;
+
+                    for (i = 0; i < pcis->num_blocks; i++) {
+                        lost += rtxq_nack(flow, pcis->blocks[i].start,
+                                          pcis->blocks[i].end, &rrbq);
+                    }
+                }
                 break;
         }
+
+        if (lost) {
+            flow->stats.rtx_fast += lost;
+            if (dtp_cc_enabled(flow)) {
+                /* Take it as a congestion indication. */
+                dtp_cwnd_cut(flow, false);
+            }
+        }
     }
 
 out:
@@ -1144,6 +1993,13 @@ out:
 
     rl_buf_free(rb);
 
+    /* Send retransmissions first. */
+    list_for_each_entry_safe(qrb, tmp, &rrbq, node) {
+        struct rina_pci *pci = RLITE_BUF_PCI(qrb);
+
+        rmt_tx(ipcp, pci->dst_addr, qrb, false);
+    }
+
     /* Send PDUs popped out from cwq, if any. Note that the qrbs list
      * is not emptied and must not be used after the scan.*/
     list_for_each_entry_safe(qrb, tmp, &qrbs, node) {
@@ -1211,6 +2067,16 @@ rl_normal_sdu_rx(struct ipcp_entry *ipcp, struct rl_buf *rb)
 
     if (flow->cfg.dtcp_present) {
         mod_timer(&dtp->rcv_inact_tmr, jiffies + 2 * dtp->mpl_r_a);
+        if (unlikely(pci->pdu_flags & PDU_F_ECN)) {
+            /* Some RMT queue along the path is congested: let the
+             * next control PDU tell the sender. */
+            dtp->flags |= DTP_F_ECN_RCVD;
+        }
+        if (dtp->rcv_rtt_stamp && seqnum >= dtp->rcv_rtt_seq) {
+            rcv_rtt_sample(dtp);
+        }
+        dtp->rcv_pdu_len = dtp->rcv_pdu_len ?
+                    (dtp->rcv_pdu_len * 7 + rb->len) >> 3 : rb->len;
     }
 
     if (unlikely((dtp->flags & DTP_F_DRF_EXPECTED) ||
@@ -1228,6 +2094,7 @@ rl_normal_sdu_rx(struct ipcp_entry *ipcp, struct rl_buf *rb)
 	 * first time sdu_rx_sv_update is called. */
         dtp->last_lwe_sent = dtp->rcv_lwe = dtp->rcv_lwe_priv = seqnum + 1;
         dtp->max_seq_num_rcvd = seqnum;
+        dtp->rcv_rtt_stamp = dtp->rcv_tune_stamp = 0;
 
 	if (flow->upper.ipcp) {
 		crb = sdu_rx_sv_update(ipcp, flow, false);
@@ -1394,11 +2261,22 @@ rl_normal_sdu_rx(struct ipcp_entry *ipcp, struct rl_buf *rb)
 
     } else {
         /* What is not dropped nor delivered goes in the sequencing queue.
-         * Don't ack here, we have to wait for the gap to be filled. */
-        seqq_push(dtp, rb);
-
+         * The cumulative ACK cannot move until the gap is filled, but
+         * with retransmission control we tell the sender what we got
+         * beyond the gap, so that it retransmits only what is missing. */
         flow->stats.rx_pkt++;
         flow->stats.rx_byte += rb->len;
+
+        seqq_push(dtp, rb);
+
+        if (flow->cfg.dtcp.rtx_control) {
+            uint8_t pdu_type = PDU_T_CTRL | PDU_T_ACK_BIT | PDU_T_SACK;
+
+            if (flow->cfg.dtcp.flow_control) {
+                pdu_type |= PDU_T_FC_BIT;
+            }
+            crb = ctrl_pdu_alloc(ipcp, flow, pdu_type, dtp->rcv_lwe - 1);
+        }
     }
 
     spin_unlock_bh(&dtp->lock);
@@ -1443,6 +2321,8 @@ rl_normal_flow_get_stats(struct flow_entry *flow,
 
     spin_lock_bh(&dtp->lock);
     *stats = flow->stats;
+    stats->cwnd = dtp->cwnd;
+    stats->rcv_win = dtp->rcv_win;
     spin_unlock_bh(&dtp->lock);
 
     return 0;
@@ -1463,7 +2343,8 @@ static struct ipcp_factory normal_factory = {
     .ops.config = rl_normal_config,
     .ops.pduft_set = rl_normal_pduft_set,
     .ops.pduft_flush = rl_normal_pduft_flush,
-    .ops.pduft_del = rl_normal_pduft_del,
+    .ops.pduft_flow_del = rl_normal_pduft_flow_del,
+    .ops.pduft_mod = rl_normal_pduft_mod,
     .ops.mgmt_sdu_build = rl_normal_mgmt_sdu_build,
     .ops.sdu_rx = rl_normal_sdu_rx,
     .ops.flow_get_stats = rl_normal_flow_get_stats,
@@ -35,6 +35,8 @@
 #include <linux/timer.h>
 #include <linux/types.h>
 #include <linux/list.h>
+#include <linux/skbuff.h>
+#include <linux/version.h>
 #include <asm/atomic.h>
 
 
@@ -120,17 +122,55 @@ struct rina_pci_ctrl {
     rl_seq_t last_ctrl_seq_num_rcvd;
     rl_seq_t ack_nack_seq_num;
     rl_seq_t new_rwe;
-    rl_seq_t new_lwe; /* sent but unused */
+    rl_seq_t new_lwe;
     rl_seq_t my_lwe;  /* sent but unused */
     rl_seq_t my_rwe;  /* sent but unused */
 } __attribute__((packed));
 
+/* Control PDU with selective ACK (PDU_T_SACK) or selective NACK
+ * (PDU_T_SNACK) blocks. Each block is a range [start, end) of sequence
+ * numbers, received beyond ack_nack_seq_num for SACK, or missing for
+ * SNACK. */
+#define RL_SACK_BLOCKS_MAX  4
+
+struct rina_sack_block {
+    rl_seq_t start;
+    rl_seq_t end;
+} __attribute__((packed));
+
+struct rina_pci_sack {
+    struct rina_pci_ctrl ctrl;
+    uint8_t num_blocks;
+    struct rina_sack_block blocks[RL_SACK_BLOCKS_MAX];
+} __attribute__((packed));
+
+/* Zero-copy transmission of the rawbuf data as an skb page fragment,
+ * using the ubuf_info interface available up to Linux 5.12. */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 10, 0) && \
+    LINUX_VERSION_CODE < KERNEL_VERSION(5, 13, 0)
+#define RL_HAVE_ZCOPY_TX
+#endif
+
+/* Pool index of the rawbufs whose data is a page fragment. */
+#define RL_BUF_POOL_FRAG    0xfe
+
 struct rl_rawbuf {
     size_t size;
     atomic_t refcnt;
+    /* Index of the buffer pool this rawbuf has been allocated from. */
+    uint8_t pool;
+    /* Lower bound for PCI push operations. This is 'buf', unless the
+     * data is owned by 'skb' (zero-copy receive) or is a page fragment
+     * (RL_BUF_POOL_FRAG). */
+    uint8_t *head;
+    struct sk_buff *skb;
     uint8_t buf[0];
 };
 
+/* A rl_buf returned by rl_buf_alloc() lives in the same memory object
+ * of its rl_rawbuf (header first, then rawbuf). Clones get their own
+ * header, which is released on rl_buf_free(), while the shared object
+ * is released when the rawbuf reference counter drops to zero. */
 struct rl_buf {
     struct rl_rawbuf    *raw;
     struct rina_pci     *pci;
@@ -139,18 +179,41 @@ struct rl_buf {
     unsigned            rtx_jiffies;
     unsigned            tx_jiffies;
 
-    struct flow_entry   *tx_compl_flow;
+#define RL_BUF_F_CLONE      (1<<0)
+#define RL_BUF_F_SACKED     (1<<1)  /* selectively acked (rtxq) */
+    uint8_t             flags;
+
     struct list_head    node;
+
+#ifdef RL_HAVE_ZCOPY_TX
+    /* Used by shims that transmit the rawbuf data as an skb fragment,
+     * to be notified when the skb releases it (zero-copy transmit). */
+    struct ubuf_info    uarg;
+#endif
 };
 
+int rl_bufs_init(void);
+
+void rl_bufs_fini(void);
+
 struct rl_buf *rl_buf_alloc(size_t size, size_t num_pci, gfp_t gfp);
 
 struct rl_buf * rl_buf_alloc_ctrl(size_t num_pci, gfp_t gfp);
 
 struct rl_buf * rl_buf_clone(struct rl_buf *rb, gfp_t gfp);
 
+struct rl_buf * rl_buf_alloc_skb(struct sk_buff *skb, gfp_t gfp);
+
 void rl_buf_free(struct rl_buf *rb);
 
+/* True if the rawbuf data lives in a page fragment, and can therefore
+ * be attached to an skb without copying it. */
+static inline bool
+rl_buf_page_backed(const struct rl_buf *rb)
+{
+    return rb->raw->pool == RL_BUF_POOL_FRAG;
+}
+
 static inline int
 rl_buf_pci_pop(struct rl_buf *rb)
 {
@@ -168,7 +231,7 @@ rl_buf_pci_pop(struct rl_buf *rb)
 static inline int
 rl_buf_pci_push(struct rl_buf *rb)
 {
-    if (unlikely((uint8_t *)(rb->pci-1) < &rb->raw->buf[0])) {
+    if (unlikely((uint8_t *)(rb->pci-1) < rb->raw->head)) {
         RPD(2, "No space to push another PCI\n");
         return -1;
     }
@@ -196,7 +259,7 @@ rl_buf_custom_pop(struct rl_buf *rb, size_t len)
 static inline int
 rl_buf_custom_push(struct rl_buf *rb, size_t len)
 {
-    if (unlikely((uint8_t *)(rb->pci) - len < &rb->raw->buf[0])) {
+    if (unlikely((uint8_t *)(rb->pci) - len < rb->raw->head)) {
         RPD(2, "No space to push %d bytes\n", (int)len);
         return -1;
     }
@@ -222,6 +285,7 @@ struct ipcp_entry;
 struct flow_entry;
 struct rl_ctrl;
 struct pduft_entry;
+struct rl_pduft_mod_entry;
 
 struct ipcp_ops {
     bool (*flow_writeable)(struct flow_entry *flow);
@@ -255,8 +319,18 @@ struct ipcp_ops {
                   const char *param_value);
     int (*pduft_set)(struct ipcp_entry *ipcp, rl_addr_t dst_addr,
                      struct flow_entry *flow);
-    int (*pduft_del)(struct ipcp_entry *ipcp, struct pduft_entry *entry);
+    /* Remove all the PDUFT entries that point to @flow, which is being
+     * deallocated. */
+    int (*pduft_flow_del)(struct ipcp_entry *ipcp, struct flow_entry *flow);
     int (*pduft_flush)(struct ipcp_entry *ipcp);
+    /* Atomically apply a batch of PDUFT changes: if @replace is true the
+     * table is replaced by the @num_set entries, otherwise the @num_del
+     * addresses are removed and the @num_set entries are added. The
+     * flow for @set[i] is @flows[i]. */
+    int (*pduft_mod)(struct ipcp_entry *ipcp, bool replace,
+                     const struct rl_pduft_mod_entry *set,
+                     struct flow_entry **flows, unsigned int num_set,
+                     const rl_addr_t *del, unsigned int num_del);
     int (*mgmt_sdu_build)(struct ipcp_entry *ipcp,
                           const struct rl_mgmt_hdr *hdr,
                           struct rl_buf *rb, struct ipcp_entry **lower_ipcp,
@@ -289,6 +363,45 @@ struct dif {
     struct list_head node;
 };
 
+/* Output classes of the RMT queues, in decreasing priority order. */
+#define RL_RMTQ_CLASS_CTRL          0   /* Management and EFCP control */
+#define RL_RMTQ_CLASS_LOW_LATENCY   1
+#define RL_RMTQ_CLASS_BEST_EFFORT   2
+
+/* RMT output queues of an N-1 flow, one for each class, used when
+ * the N-1 IPCP cannot accept more PDUs. The queues are protected by
+ * the rmtq_lock of the N-1 IPCP. */
+struct rmtq {
+    struct list_head    queues[RL_RMTQ_CLASSES];
+    unsigned int        bytes[RL_RMTQ_CLASSES];
+    uint64_t            drops[RL_RMTQ_CLASSES];
+    uint64_t            ecn_marks;
+    unsigned int        len;
+
+    /* Deficit round robin state: deficit counters, class being served
+     * and whether it has already received its quantum. */
+    unsigned int        deficit[RL_RMTQ_CLASSES];
+    unsigned int        drr_cur;
+    bool                drr_turn;
+
+    /* Entry in the list of N-1 flows of the N-1 IPCP with PDUs
+     * queued. Empty when the queues are empty. */
+    struct list_head    node;
+};
+
+struct ipcp_entry;
+
+/* An RMT output scheduler, which picks the next PDU to transmit among
+ * the (non empty) queues of an N-1 flow. The optional requeue method
+ * is called when a PDU returned by dequeue could not be transmitted and
+ * has been pushed back to the head of its queue. */
+struct rmt_sched {
+    const char *name;
+    struct rl_buf *(*dequeue)(struct ipcp_entry *ipcp, struct rmtq *q);
+    void (*requeue)(struct ipcp_entry *ipcp, struct rmtq *q,
+                    unsigned int cls, struct rl_buf *rb);
+};
+
 struct ipcp_entry {
     rl_ipcp_id_t        id;    /* Key */
     struct rina_name    name;
@@ -311,10 +424,17 @@ struct ipcp_entry {
     struct rl_ctrl      *uipcp;
     struct txrx         *mgmt_txrx;
 
-    /* TX completion structures. */
+    /* TX completion structures: the N-1 flows of this IPCP with PDUs in
+     * their RMT queues (served in round robin order), the total number
+     * of queued PDUs, and the scheduler and limits used for the RMT
+     * queues. */
     struct list_head    rmtq;
     unsigned int        rmtq_len;
     spinlock_t          rmtq_lock;
+    const struct rmt_sched *rmt_sched;
+    unsigned int        rmtq_max_bytes;
+    unsigned int        rmtq_ecn_bytes;
+    unsigned int        rmt_quantum[RL_RMTQ_CLASSES];
     struct tasklet_struct   tx_completion;
     wait_queue_head_t   tx_wqh;
 
@@ -379,6 +499,22 @@ struct dtp {
     unsigned rtt; /* estimated round trip time, in jiffies. */
     unsigned rtt_stddev;
     struct tkbk tkbk;
+    /* Congestion control: congestion window, slow start threshold
+     * and acknowledged PDUs not yet accounted to window growth, in
+     * PDUs. The window limits the receiver credit, 0 if not limiting.
+     * The window is not cut again until cg_recover is acknowledged,
+     * and snd_una is the highest left window edge of the receiver. */
+    unsigned int cwnd;
+    unsigned int ssthresh;
+    unsigned int cwnd_cnt;
+    rl_seq_t snd_una;
+    rl_seq_t cg_recover;
+    /* CUBIC: window before the last cut, start of the growth epoch
+     * (jiffies, 0 if not started) and time to get back to w_max
+     * (ms). */
+    unsigned int w_max;
+    unsigned long cubic_epoch;
+    unsigned int cubic_k;
 
     /* Receiver state. */
     rl_seq_t rcv_lwe;
@@ -392,17 +528,30 @@ struct dtp {
     struct list_head seqq;
     unsigned int seqq_len;
     struct timer_list a_tmr;
+    /* Receive window auto-tuning: advertised credit (PDUs), average
+     * PDU length, receiver RTT estimate (jiffies) and the pending RTT
+     * measurement, i.e. the right window edge advertised at time
+     * rcv_rtt_stamp (0 if no measurement is pending), and the start of
+     * the current tuning interval with the rcv_lwe at that time. */
+    unsigned int rcv_win;
+    unsigned int rcv_pdu_len;
+    unsigned int rcv_rtt;
+    rl_seq_t rcv_rtt_seq;
+    unsigned long rcv_rtt_stamp;
+    unsigned long rcv_tune_stamp;
+    rl_seq_t rcv_tune_lwe;
 
 #define DTP_F_DRF_SET		(1<<0)
 #define DTP_F_DRF_EXPECTED	(1<<1)
+#define DTP_F_ECN_RCVD		(1<<2)
     uint8_t flags;
 };
 
 struct flow_entry {
-    uint16_t            local_port;  /* flow table key */
-    uint16_t            remote_port;
-    uint16_t            local_cep;
-    uint16_t            remote_cep;
+    rl_port_t           local_port;  /* flow table key */
+    rl_port_t           remote_port;
+    uint32_t            local_cep;
+    uint32_t            remote_cep;
     rl_addr_t           remote_addr;
     struct rina_name    local_appl;
     struct rina_name    remote_appl;
@@ -420,11 +569,14 @@ struct flow_entry {
     void                *priv;
 
     struct rl_flow_stats stats;
+    struct rmtq         rmtq;
     struct delayed_work remove;
-    unsigned int        refcnt;
+    atomic_t            refcnt;
     bool                never_bound;
-    struct hlist_node   node;
-    struct hlist_node   node_cep;
+    /* The flow is being deallocated and must not be used to
+     * forward PDUs anymore. */
+    bool                down;
+    struct rcu_head     rcu;
 };
 
 struct pduft_entry {
@@ -432,6 +584,8 @@ struct pduft_entry {
     struct flow_entry   *flow;
     struct hlist_node   node;       /* for the pdu_ft hash table */
     struct list_head    fnode;      /* for the flow->pduft_entries list */
+    bool                backup;     /* loop-free alternate */
+    struct rcu_head     rcu;
 };
 
 int __ipcp_put(struct ipcp_entry *entry);
@@ -484,6 +638,21 @@ void rl_write_restart_flows(struct ipcp_entry *ipcp);
 
 void rl_flow_share_tx_wqh(struct flow_entry *flow);
 
+void rl_rmtq_ipcp_init(struct ipcp_entry *ipcp);
+
+void rl_rmtq_init(struct rmtq *q);
+
+int rl_rmtq_enqueue(struct ipcp_entry *ipcp, struct flow_entry *flow,
+                    struct rl_buf *rb);
+
+void rl_rmtq_flush(struct ipcp_entry *ipcp, struct flow_entry *flow);
+
+int rl_rmtq_config(struct ipcp_entry *ipcp, const char *param_name,
+                   const char *param_value);
+
+void rl_rmtq_get_stats(struct ipcp_entry *ipcp, struct flow_entry *flow,
+                       struct rl_flow_stats *stats);
+
 struct flow_entry *flow_put(struct flow_entry *flow);
 
 struct flow_entry *flow_lookup(rl_port_t port_id);
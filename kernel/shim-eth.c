@@ -661,11 +661,10 @@ out:
 static void
 shim_eth_pdu_rx(struct rl_shim_eth *priv, struct sk_buff *skb)
 {
-    struct rl_buf *rb = rl_buf_alloc(skb->len, priv->ipcp->depth,
-                                           GFP_ATOMIC);
     struct ethhdr *hh = eth_hdr(skb);
     struct arpt_entry *entry;
     struct flow_entry *flow = NULL;
+    struct rl_buf *rb;
     bool match = false;
 
     NPD("SHIM ETH PDU from %02X:%02X:%02X:%02X:%02X:%02X [%d]\n",
@@ -673,12 +672,26 @@ shim_eth_pdu_rx(struct rl_shim_eth *priv, struct sk_buff *skb)
             hh->h_source[3], hh->h_source[4], hh->h_source[5],
             skb->len);
 
-    if (unlikely(!rb)) {
-        PD("Out of memory\n");
-        return;
-    }
+    if (likely(!skb_is_nonlinear(skb) && !skb_cloned(skb))) {
+        /* Zero-copy receive: the rl_buf references the skb data, and
+         * holds the skb until it is freed. We need the data not to be
+         * shared (e.g. with packet sockets), since upper layers may
+         * write into it (e.g. to push the management header). */
+        rb = rl_buf_alloc_skb(skb, GFP_ATOMIC);
+        if (unlikely(!rb)) {
+            PD("Out of memory\n");
+            return;
+        }
+
+    } else {
+        rb = rl_buf_alloc(skb->len, priv->ipcp->depth, GFP_ATOMIC);
+        if (unlikely(!rb)) {
+            PD("Out of memory\n");
+            return;
+        }
 
-    skb_copy_bits(skb, 0, RLITE_BUF_DATA(rb), skb->len);
+        skb_copy_bits(skb, 0, RLITE_BUF_DATA(rb), skb->len);
+    }
 
     /* Try to shortcut the packet to the upper IPCP. */
     if (!rl_sdu_rx_shortcut(priv->ipcp, rb)) {
@@ -809,18 +822,16 @@ shim_eth_rx_handler(struct sk_buff **skbp)
         return RX_HANDLER_PASS;
     }
 
-    /* Steal the skb from the Linux stack. */
+    /* Steal the skb from the Linux stack. If the PDU has been received
+     * in zero-copy mode, the rl_buf still holds a reference to the skb. */
     dev_consume_skb_any(skb);
 
     return RX_HANDLER_CONSUMED;
 }
 
 static void
-shim_eth_skb_destructor(struct sk_buff *skb)
+shim_eth_tx_completed(struct ipcp_entry *ipcp)
 {
-    struct flow_entry *flow = (struct flow_entry *)
-                              (skb_shinfo(skb)->destructor_arg);
-    struct ipcp_entry *ipcp = flow->txrx.ipcp;
     struct rl_shim_eth *priv = ipcp->priv;
     bool notify;
 
@@ -834,6 +845,29 @@ shim_eth_skb_destructor(struct sk_buff *skb)
     }
 }
 
+static void
+shim_eth_skb_destructor(struct sk_buff *skb)
+{
+    struct flow_entry *flow = (struct flow_entry *)
+                              (skb_shinfo(skb)->destructor_arg);
+
+    shim_eth_tx_completed(flow->txrx.ipcp);
+}
+
+#ifdef RL_HAVE_ZCOPY_TX
+/* Invoked when a zero-copy skb releases the rawbuf data (transmission
+ * completed, or the kernel copied the fragments). */
+static void
+shim_eth_zcopy_complete(struct ubuf_info *uarg, bool zerocopy_success)
+{
+    struct rl_buf *rb = container_of(uarg, struct rl_buf, uarg);
+    struct flow_entry *flow = (struct flow_entry *)uarg->ctx;
+
+    shim_eth_tx_completed(flow->txrx.ipcp);
+    rl_buf_free(rb);
+}
+#endif /* RL_HAVE_ZCOPY_TX */
+
 #define flow_can_write(_p)  ((_p)->ntu != (_p)->ntp)
 
 static bool
@@ -849,6 +883,54 @@ rl_shim_eth_flow_writeable(struct flow_entry *flow)
     return ret;
 }
 
+#ifdef RL_HAVE_ZCOPY_TX
+/* Build an skb that contains the link header in its linear area and
+ * references the rawbuf data as a page fragment, so that the PDU is
+ * not copied. The rawbuf must be page backed (rl_buf_page_backed()),
+ * since slab memory cannot be attached to an skb. The rb is owned by
+ * the skb, and it is freed by shim_eth_zcopy_complete(). Note that we
+ * cannot build the skb directly around the rawbuf (build_skb()), since
+ * the same rawbuf may be shared by concurrent transmissions (e.g.
+ * retransmission clones), and each skb needs its own skb_shared_info. */
+static struct sk_buff *
+shim_eth_zcopy_skb(struct net_device *netdev, struct flow_entry *flow,
+                   struct rl_buf *rb)
+{
+    int hhlen = LL_RESERVED_SPACE(netdev); /* Hardware header length */
+    uint8_t *data = RLITE_BUF_DATA(rb);
+    struct page *page = virt_to_head_page(data);
+    struct sk_buff *skb;
+
+    skb = alloc_skb(hhlen, GFP_ATOMIC);
+    if (unlikely(!skb)) {
+        return NULL;
+    }
+
+    skb_reserve(skb, hhlen);
+    skb_reset_network_header(skb);
+    skb->dev = netdev;
+    skb->protocol = htons(ETH_P_RLITE);
+
+    get_page(page);
+    skb_fill_page_desc(skb, 0, page, data - (uint8_t *)page_address(page),
+                       rb->len);
+    skb->len += rb->len;
+    skb->data_len += rb->len;
+    skb->truesize += rb->len;
+
+    rb->uarg.callback = shim_eth_zcopy_complete;
+    rb->uarg.ctx = flow;
+    rb->uarg.desc = 0;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 14, 0)
+    refcount_set(&rb->uarg.refcnt, 1);
+#endif
+    skb_shinfo(skb)->destructor_arg = &rb->uarg;
+    skb_shinfo(skb)->tx_flags |= SKBTX_DEV_ZEROCOPY;
+
+    return skb;
+}
+#endif /* RL_HAVE_ZCOPY_TX */
+
 static int
 rl_shim_eth_sdu_write(struct ipcp_entry *ipcp,
                       struct flow_entry *flow,
@@ -860,6 +942,7 @@ rl_shim_eth_sdu_write(struct ipcp_entry *ipcp,
     int hhlen = LL_RESERVED_SPACE(netdev); /* Hardware header length */
     struct sk_buff *skb = NULL;
     struct arpt_entry *entry = flow->priv;
+    size_t len = rb->len;
     int ret;
 
     if (unlikely(!entry)) {
@@ -891,17 +974,37 @@ rl_shim_eth_sdu_write(struct ipcp_entry *ipcp,
 
     spin_unlock_bh(&priv->tx_lock);
 
-    skb = alloc_skb(hhlen + rb->len + netdev->needed_tailroom,
-                    GFP_KERNEL);
-    if (!skb) {
-        PD("Out of memory\n");
-        return -ENOMEM;
+#ifdef RL_HAVE_ZCOPY_TX
+    if (likely((netdev->features & NETIF_F_SG) && rl_buf_page_backed(rb))) {
+        /* Zero-copy transmission. From now on the rb is owned by the skb,
+         * and the transmission slot is released when the skb releases
+         * the rb, also in case of errors. */
+        skb = shim_eth_zcopy_skb(netdev, flow, rb);
+        if (unlikely(!skb)) {
+            PD("Out of memory\n");
+            shim_eth_tx_completed(ipcp);
+            rl_buf_free(rb);
+            return -ENOMEM;
+        }
+        rb = NULL;
     }
+#endif /* RL_HAVE_ZCOPY_TX */
 
-    skb_reserve(skb, hhlen);
-    skb_reset_network_header(skb);
-    skb->dev = netdev;
-    skb->protocol = htons(ETH_P_RLITE);
+    if (!skb) {
+        skb = alloc_skb(hhlen + rb->len + netdev->needed_tailroom,
+                        GFP_KERNEL);
+        if (!skb) {
+            PD("Out of memory\n");
+            return -ENOMEM;
+        }
+
+        skb_reserve(skb, hhlen);
+        skb_reset_network_header(skb);
+        skb->dev = netdev;
+        skb->protocol = htons(ETH_P_RLITE);
+        skb->destructor = &shim_eth_skb_destructor;
+        skb_shinfo(skb)->destructor_arg = (void *)flow;
+    }
 
     ret = dev_hard_header(skb, skb->dev, ETH_P_RLITE, entry->tha,
                           netdev->dev_addr, skb->len);
@@ -911,11 +1014,11 @@ rl_shim_eth_sdu_write(struct ipcp_entry *ipcp,
         return ret;
     }
 
-    skb->destructor = &shim_eth_skb_destructor;
-    skb_shinfo(skb)->destructor_arg = (void *)flow;
-
-    /* Copy data into the skb. */
-    memcpy(skb_put(skb, rb->len), RLITE_BUF_DATA(rb), rb->len);
+    if (rb) {
+        /* Copy data into the skb. */
+        memcpy(skb_put(skb, rb->len), RLITE_BUF_DATA(rb), rb->len);
+        rl_buf_free(rb);
+    }
 
     /* Send the skb to the device for transmission. */
     ret = dev_queue_xmit(skb);
@@ -924,13 +1027,11 @@ rl_shim_eth_sdu_write(struct ipcp_entry *ipcp,
 
         spin_lock_bh(&priv->tx_lock);
         entry->stats.tx_pkt--;
-        entry->stats.tx_byte -= rb->len;
+        entry->stats.tx_byte -= len;
         entry->stats.tx_err++;
         spin_unlock_bh(&priv->tx_lock);
     }
 
-    rl_buf_free(rb);
-
     return 0;
 }
 
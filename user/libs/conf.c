@@ -287,9 +287,17 @@ rl_conf_flows_print(struct rl_ctrl *ctrl, struct list_head *flows)
         ret = rl_conf_flow_get_stats(ctrl, rl_flow->local_port, &stats);
         if (!ret) {
             PI_S("      tx_pkt: %lu, tx_byte: %lu, tx_err: %lu\n"
-                 "      rx_pkt: %lu, rx_byte: %lu, rx_err: %lu\n\n",
+                 "      rx_pkt: %lu, rx_byte: %lu, rx_err: %lu\n"
+                 "      rmtq_bytes: %lu/%lu/%lu, rmtq_drop: %lu/%lu/%lu\n"
+                 "      rmtq_ecn: %lu, ecn_cuts: %lu, cwnd: %lu, "
+                 "rcv_win: %lu\n"
+                 "      rtx_pkt: %lu, rtx_fast: %lu\n\n",
                  stats.tx_pkt, stats.tx_byte, stats.tx_err, stats.rx_pkt,
-                 stats.rx_byte, stats.rx_err);
+                 stats.rx_byte, stats.rx_err, stats.rmtq_bytes[0],
+                 stats.rmtq_bytes[1], stats.rmtq_bytes[2],
+                 stats.rmtq_drop[0], stats.rmtq_drop[1], stats.rmtq_drop[2],
+                 stats.rmtq_ecn, stats.ecn_cuts, stats.cwnd, stats.rcv_win,
+                 stats.rtx_pkt, stats.rtx_fast);
         }
     }
 
@@ -37,6 +37,7 @@
 #include <assert.h>
 #include <time.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/eventfd.h>
 #include "rlite/kernel-msg.h"
 #include "rlite/uipcps-msg.h"
@@ -97,17 +98,21 @@ read_next_msg(int rfd)
 int
 rl_write_msg(int rfd, struct rl_msg_base *msg)
 {
-    char serbuf[4096];
+    char stackbuf[4096];
+    char *serbuf = stackbuf;
     unsigned int serlen;
     int ret;
 
-    /* Serialize the message. */
+    /* Serialize the message. Messages carrying buffers (e.g. a whole
+     * PDUFT) may not fit the stack buffer. */
     serlen = rl_msg_serlen(rl_ker_numtables, RLITE_KER_MSG_MAX, msg);
-    if (serlen > sizeof(serbuf)) {
-        PE("Serialized message would be too long [%u]\n",
-                    serlen);
-        errno = EINVAL;
-        return -1;
+    if (serlen > sizeof(stackbuf)) {
+        serbuf = malloc(serlen);
+        if (!serbuf) {
+            PE("Out of memory\n");
+            errno = ENOMEM;
+            return -1;
+        }
     }
     serlen = serialize_rlite_msg(rl_ker_numtables, RLITE_KER_MSG_MAX,
                                  serbuf, msg);
@@ -130,6 +135,10 @@ rl_write_msg(int rfd, struct rl_msg_base *msg)
         ret = 0;
     }
 
+    if (serbuf != stackbuf) {
+        free(serbuf);
+    }
+
     return ret;
 }
 
@@ -175,7 +184,7 @@ open_port_common(rl_port_t port_id, unsigned int mode, rl_ipcp_id_t ipcp_id)
     info.ipcp_id = ipcp_id;
     info.mode = mode;
 
-    ret = ioctl(fd, 73, &info);
+    ret = ioctl(fd, RLITE_IOCTL_INFO, &info);
     if (ret) {
         perror("ioctl(/dev/rlite-io)");
         return -1;
@@ -766,3 +775,160 @@ out:
 
     return ffd;
 }
+
+static int
+rl_flow_mmsg_common(int fd, unsigned long cmd, struct rl_sdu_vec *vec,
+                    unsigned int num)
+{
+    struct rl_ioctl_mmsg mmsg;
+    int ret;
+
+    mmsg.vec = vec;
+    mmsg.num = num;
+
+    ret = ioctl(fd, cmd, &mmsg);
+    if (ret < 0) {
+        return ret;
+    }
+
+    return mmsg.num;
+}
+
+int
+rl_flow_write_mmsg(int fd, struct rl_sdu_vec *vec, unsigned int num)
+{
+    return rl_flow_mmsg_common(fd, RLITE_IOCTL_MMSG_WRITE, vec, num);
+}
+
+int
+rl_flow_read_mmsg(int fd, struct rl_sdu_vec *vec, unsigned int num)
+{
+    return rl_flow_mmsg_common(fd, RLITE_IOCTL_MMSG_READ, vec, num);
+}
+
+struct rl_rings {
+    int fd;
+    struct rl_rings_hdr *hdr;
+    size_t mem_size;
+};
+
+struct rl_rings *
+rl_rings_open(int fd, unsigned int num_slots, unsigned int slot_size)
+{
+    struct rl_ioctl_rings req;
+    struct rl_rings *rings;
+    void *mem;
+    int ret;
+
+    req.num_slots = num_slots;
+    req.slot_size = slot_size;
+    req.mem_size = 0;
+
+    ret = ioctl(fd, RLITE_IOCTL_RINGS_SETUP, &req);
+    if (ret) {
+        return NULL;
+    }
+
+    mem = mmap(NULL, req.mem_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+               fd, 0);
+    if (mem == MAP_FAILED) {
+        int err = errno;
+
+        /* Release the kernel rings, so that the setup can be retried. */
+        ioctl(fd, RLITE_IOCTL_RINGS_FREE);
+        errno = err;
+        return NULL;
+    }
+
+    rings = malloc(sizeof(*rings));
+    if (!rings) {
+        munmap(mem, req.mem_size);
+        ioctl(fd, RLITE_IOCTL_RINGS_FREE);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    rings->fd = fd;
+    rings->hdr = mem;
+    rings->mem_size = req.mem_size;
+
+    return rings;
+}
+
+void
+rl_rings_close(struct rl_rings *rings)
+{
+    munmap(rings->hdr, rings->mem_size);
+    ioctl(rings->fd, RLITE_IOCTL_RINGS_FREE);
+    free(rings);
+}
+
+void *
+rl_rings_tx_slot(struct rl_rings *rings)
+{
+    struct rl_ring *ring = &rings->hdr->tx;
+    uint32_t cons = __atomic_load_n(&ring->cons, __ATOMIC_ACQUIRE);
+
+    if (ring->prod - cons >= ring->num_slots) {
+        return NULL;
+    }
+
+    return RLITE_RING_SLOT(rings->hdr, ring, ring->prod)->data;
+}
+
+void
+rl_rings_tx_push(struct rl_rings *rings, unsigned int len)
+{
+    struct rl_ring *ring = &rings->hdr->tx;
+
+    RLITE_RING_SLOT(rings->hdr, ring, ring->prod)->len = len;
+    __atomic_store_n(&ring->prod, ring->prod + 1, __ATOMIC_RELEASE);
+}
+
+unsigned int
+rl_rings_tx_pending(struct rl_rings *rings)
+{
+    struct rl_ring *ring = &rings->hdr->tx;
+
+    return ring->prod - __atomic_load_n(&ring->cons, __ATOMIC_ACQUIRE);
+}
+
+const void *
+rl_rings_rx_slot(struct rl_rings *rings, unsigned int *len)
+{
+    struct rl_ring *ring = &rings->hdr->rx;
+    uint32_t prod = __atomic_load_n(&ring->prod, __ATOMIC_ACQUIRE);
+    struct rl_ring_slot *slot;
+
+    if (ring->cons == prod) {
+        return NULL;
+    }
+
+    slot = RLITE_RING_SLOT(rings->hdr, ring, ring->cons);
+    *len = slot->len;
+
+    return slot->data;
+}
+
+void
+rl_rings_rx_pop(struct rl_rings *rings)
+{
+    struct rl_ring *ring = &rings->hdr->rx;
+
+    __atomic_store_n(&ring->cons, ring->cons + 1, __ATOMIC_RELEASE);
+}
+
+int
+rl_rings_eof(struct rl_rings *rings)
+{
+    struct rl_ring *ring = &rings->hdr->rx;
+
+    return (rings->hdr->flags & RLITE_RINGS_F_EOF) &&
+            ring->cons == __atomic_load_n(&ring->prod, __ATOMIC_ACQUIRE);
+}
+
+int
+rl_rings_sync(struct rl_rings *rings)
+{
+    return ioctl(rings->fd, RLITE_IOCTL_RINGS_SYNC);
+}
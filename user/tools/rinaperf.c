@@ -43,6 +43,7 @@
 
 
 #define SDU_SIZE_MAX    65535
+#define MMSG_MAX        256
 
 static int stop = 0; /* Used to stop client on SIGINT. */
 static int cli_flow_allocated = 0; /* Avoid to get stuck in rl_flow_alloc(). */
@@ -61,6 +62,8 @@ struct rinaperf {
 
     unsigned int interval;
     unsigned int burst;
+    unsigned int mmsg; /* SDUs per batched I/O call, 0 to disable */
+    unsigned int rings; /* slots per shared-memory ring, 0 to disable */
     int ping;
 
     struct rinaperf_test_config test_config;
@@ -314,8 +317,12 @@ perf_client(struct rinaperf *rp)
     struct timeval t_start, t_end;
     struct timeval w1, w2;
     char buf[SDU_SIZE_MAX];
+    struct rl_sdu_vec vec[MMSG_MAX];
+    struct rl_rings *rings = NULL;
+    struct pollfd pfd;
     unsigned long us;
     unsigned int i = 0;
+    unsigned int j;
     int ret;
 
     if (size > sizeof(buf)) {
@@ -332,21 +339,83 @@ perf_client(struct rinaperf *rp)
     }
 
     memset(buf, 'x', size);
+    for (j = 0; j < rp->mmsg; j++) {
+        vec[j].buf = buf;
+        vec[j].len = size;
+    }
+
+    if (rp->rings) {
+        rings = rl_rings_open(rp->dfd, rp->rings, size);
+        if (!rings) {
+            perror("rl_rings_open()");
+            return -1;
+        }
+    }
+    pfd.fd = rp->dfd;
+    pfd.events = POLLOUT;
 
     gettimeofday(&t_start, NULL);
 
-    for (i = 0; !stop && (!limit || i < limit); i++) {
-        ret = write(rp->dfd, buf, size);
-        if (ret != size) {
-            if (ret < 0) {
-                perror("write(buf)");
-            } else {
-                printf("Partial write %d/%d\n", ret, size);
+    while (!stop && (!limit || i < limit)) {
+        unsigned int sent = 1;
+
+        if (rings) {
+            void *slot = rl_rings_tx_slot(rings);
+
+            if (!slot) {
+                /* TX ring is full: poll() kicks the kernel and waits
+                 * for free slots. */
+                ret = poll(&pfd, 1, 3000);
+                if (ret <= 0) {
+                    if (ret < 0) {
+                        perror("poll(flow)");
+                    } else {
+                        printf("Timeout occurred\n");
+                    }
+                    break;
+                }
+                continue;
             }
-            break;
+
+            memcpy(slot, buf, size);
+            rl_rings_tx_push(rings, size);
+            i++;
+
+        } else if (rp->mmsg) {
+            unsigned int num = rp->mmsg;
+
+            if (limit && limit - i < num) {
+                num = limit - i;
+            }
+            if (interval && cdown < num) {
+                /* Do not send more than the rest of the burst. */
+                num = cdown;
+            }
+
+            ret = rl_flow_write_mmsg(rp->dfd, vec, num);
+            if (ret <= 0) {
+                if (ret < 0) {
+                    perror("rl_flow_write_mmsg()");
+                }
+                break;
+            }
+            i += ret;
+            sent = ret;
+
+        } else {
+            ret = write(rp->dfd, buf, size);
+            if (ret != size) {
+                if (ret < 0) {
+                    perror("write(buf)");
+                } else {
+                    printf("Partial write %d/%d\n", ret, size);
+                }
+                break;
+            }
+            i++;
         }
 
-        if (interval && --cdown == 0) {
+        if (interval && (cdown -= sent) == 0) {
             if (interval > 50) { /* slack default is 50 us*/
                 usleep(interval);
             } else {
@@ -364,6 +433,13 @@ perf_client(struct rinaperf *rp)
         }
     }
 
+    if (rings) {
+        /* Flush the TX ring. */
+        while (rl_rings_tx_pending(rings) && poll(&pfd, 1, 3000) > 0) {
+        }
+        rl_rings_close(rings);
+    }
+
     gettimeofday(&t_end, NULL);
     us = 1000000 * (t_end.tv_sec - t_start.tv_sec) +
             (t_end.tv_usec - t_start.tv_usec);
@@ -423,16 +499,27 @@ perf_server(struct rinaperf *rp)
     unsigned long long rate_bytes = 0;
     struct timespec rate_ts;
     char buf[SDU_SIZE_MAX];
+    struct rl_sdu_vec vec[MMSG_MAX];
+    struct rl_rings *rings = NULL;
     struct pollfd pfd;
-    unsigned int i;
+    unsigned int i = 0;
+    unsigned int j;
     int n;
 
     pfd.fd = rp->dfd;
     pfd.events = POLLIN;
 
+    if (rp->rings) {
+        rings = rl_rings_open(rp->dfd, rp->rings, rp->test_config.size);
+        if (!rings) {
+            perror("rl_rings_open()");
+            return -1;
+        }
+    }
+
     clock_gettime(CLOCK_MONOTONIC, &rate_ts);
 
-    for (i = 0; !limit || i < limit; i++) {
+    while (!limit || i < limit) {
         n = poll(&pfd, 1, 3000);
         if (n < 0) {
             perror("poll(flow)");
@@ -444,24 +531,72 @@ perf_server(struct rinaperf *rp)
         }
 
         /* Ready to read. */
-        n = read(rp->dfd, buf, sizeof(buf));
-        if (n < 0) {
-            perror("read(flow)");
-            return -1;
+        if (rings) {
+            const void *slot;
+            unsigned int len;
+
+            /* poll() already filled the RX ring. */
+            while ((slot = rl_rings_rx_slot(rings, &len))) {
+                rl_rings_rx_pop(rings);
+                i++;
+                rate_cnt++;
+                rate_bytes += len;
+            }
 
-        } else if (n == 0) {
-            printf("Flow deallocated remotely\n");
-            break;
-        }
+            if (rl_rings_eof(rings)) {
+                printf("Flow deallocated remotely\n");
+                break;
+            }
+
+        } else if (rp->mmsg) {
+            /* All the SDUs are received in the same buffer, we
+             * don't look at their content. */
+            for (j = 0; j < rp->mmsg; j++) {
+                vec[j].buf = buf;
+                vec[j].len = sizeof(buf);
+            }
+
+            n = rl_flow_read_mmsg(rp->dfd, vec, rp->mmsg);
+            if (n < 0) {
+                perror("rl_flow_read_mmsg()");
+                return -1;
+
+            } else if (n == 0) {
+                printf("Flow deallocated remotely\n");
+                break;
+            }
+
+            i += n;
+            rate_cnt += n;
+            for (j = 0; j < n; j++) {
+                rate_bytes += vec[j].len;
+            }
+
+        } else {
+            n = read(rp->dfd, buf, sizeof(buf));
+            if (n < 0) {
+                perror("read(flow)");
+                return -1;
 
-        rate_bytes += n;
-        rate_cnt++;
+            } else if (n == 0) {
+                printf("Flow deallocated remotely\n");
+                break;
+            }
+
+            i++;
+            rate_bytes += n;
+            rate_cnt++;
+        }
 
         if (rate_bytes >= rate_bytes_limit) {
             rate_print(&rate_bytes, &rate_cnt, &rate_bytes_limit, &rate_ts);
         }
     }
 
+    if (rings) {
+        rl_rings_close(rings);
+    }
+
     printf("Received %u PDUs out of %u\n", i, limit);
 
     return 0;
@@ -594,7 +729,11 @@ usage(void)
         "   -a APNAME : application process name/instance of the rinaperf client\n"
         "   -z APNAME : application process name/instance of the rinaperf server\n"
         "   -x : use a separate control connection\n"
-          );
+        "   -M NUM : in perf tests, move up to NUM SDUs per batched I/O "
+                "call (max %d, default 0 = disabled)\n"
+        "   -R NUM : in perf tests, use shared-memory rings with NUM slots "
+                "(power of two, default 0 = disabled)\n"
+          , MMSG_MAX);
 }
 
 int
@@ -612,6 +751,8 @@ main(int argc, char **argv)
     int size = sizeof(uint16_t);
     int interval = 0;
     int burst = 1;
+    int mmsg = 0;
+    int rings = 0;
     int have_ctrl = 0;
     int ret;
     int opt;
@@ -623,7 +764,7 @@ main(int argc, char **argv)
     /* Start with a default flow configuration (unreliable flow). */
     rl_flow_spec_default(&flowspec);
 
-    while ((opt = getopt(argc, argv, "hlt:d:c:s:p:P:i:B:g:fb:a:A:z:Z:x")) != -1) {
+    while ((opt = getopt(argc, argv, "hlt:d:c:s:p:P:i:B:g:fb:a:A:z:Z:xM:R:")) != -1) {
         switch (opt) {
             case 'h':
                 usage();
@@ -699,6 +840,22 @@ main(int argc, char **argv)
                 printf("Warning: Control connection support is incomplete\n");
                 break;
 
+            case 'M':
+                mmsg = atoi(optarg);
+                if (mmsg < 0 || mmsg > MMSG_MAX) {
+                    printf("    Invalid 'mmsg' %d\n", mmsg);
+                    return -1;
+                }
+                break;
+
+            case 'R':
+                rings = atoi(optarg);
+                if (rings < 0 || (rings & (rings - 1))) {
+                    printf("    Invalid 'rings' %d\n", rings);
+                    return -1;
+                }
+                break;
+
             default:
                 printf("    Unrecognized option %c\n", opt);
                 usage();
@@ -726,6 +883,8 @@ main(int argc, char **argv)
     /* Set defaults. */
     rp.interval = interval;
     rp.burst = burst;
+    rp.mmsg = mmsg;
+    rp.rings = rings;
 
     /* Function selection. */
     if (!listen) {
@@ -0,0 +1,272 @@
+/*
+ * Flow allocation/deallocation benchmark for the rlite stack.
+ *
+ * Copyright (C) 2026 rlite contributors
+ *
+ * This file is part of rlite.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Allocates N concurrent flows between a client and a server application
+ * living in this process, and then deallocates all of them, reporting the
+ * latency of each operation. This exercises the kernel port-id and cep-id
+ * tables with a large number of flows. Each flow takes two file
+ * descriptors, so the RLIMIT_NOFILE limit is raised as needed.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/resource.h>
+
+#include "rlite/api.h"
+
+
+#define CLI_APPL_NAME   "rlite-flow-bench/client"
+#define SRV_APPL_NAME   "rlite-flow-bench/server"
+
+struct bench {
+    const char *dif_name;
+    unsigned int num_flows;
+    int cfd;
+    int *cli_fds;
+    int *srv_fds;
+    unsigned long *alloc_ns;
+    unsigned long *dealloc_ns;
+};
+
+static unsigned long
+ns_since(const struct timespec *t1)
+{
+    struct timespec t2;
+
+    clock_gettime(CLOCK_MONOTONIC, &t2);
+
+    return (t2.tv_sec - t1->tv_sec) * 1000000000UL +
+            t2.tv_nsec - t1->tv_nsec;
+}
+
+static int
+ulcmp(const void *a, const void *b)
+{
+    unsigned long x = *(const unsigned long *)a;
+    unsigned long y = *(const unsigned long *)b;
+
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+static void
+report(const char *op, unsigned long *samples, unsigned int n)
+{
+    unsigned long long sum = 0;
+    unsigned int i;
+
+    if (n == 0) {
+        return;
+    }
+
+    for (i = 0; i < n; i++) {
+        sum += samples[i];
+    }
+    qsort(samples, n, sizeof(samples[0]), ulcmp);
+
+    printf("%-8s %8u ops, avg %8.2f us, min %8.2f us, p50 %8.2f us, "
+           "p99 %8.2f us, max %8.2f us\n", op, n,
+           (double)sum / n / 1000.0, samples[0] / 1000.0,
+           samples[n / 2] / 1000.0, samples[(n * 99ULL) / 100] / 1000.0,
+           samples[n - 1] / 1000.0);
+}
+
+static void *
+server_worker(void *opaque)
+{
+    struct bench *b = opaque;
+    unsigned int i;
+
+    for (i = 0; i < b->num_flows; i++) {
+        b->srv_fds[i] = rl_flow_accept(b->cfd, NULL);
+        if (b->srv_fds[i] < 0) {
+            perror("rl_flow_accept()");
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+static int
+raise_nofile_limit(unsigned int num_fds)
+{
+    struct rlimit rl;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl)) {
+        perror("getrlimit()");
+        return -1;
+    }
+
+    if (rl.rlim_cur >= num_fds) {
+        return 0;
+    }
+
+    rl.rlim_cur = num_fds;
+    if (rl.rlim_max < num_fds) {
+        rl.rlim_max = num_fds;
+    }
+
+    if (setrlimit(RLIMIT_NOFILE, &rl)) {
+        perror("setrlimit(RLIMIT_NOFILE)");
+        return -1;
+    }
+
+    return 0;
+}
+
+static void
+usage(void)
+{
+    printf("rlite-flow-bench [OPTIONS]\n"
+        "   -h : show this help\n"
+        "   -d DIF : name of the DIF where flows are allocated\n"
+        "   -n NUM : number of concurrent flows (default 100000)\n"
+          );
+}
+
+int
+main(int argc, char **argv)
+{
+    struct bench b;
+    struct timespec t;
+    pthread_t srv_th;
+    unsigned int allocated = 0;
+    unsigned int i;
+    int opt;
+    int ret;
+
+    memset(&b, 0, sizeof(b));
+    b.num_flows = 100000;
+
+    while ((opt = getopt(argc, argv, "hd:n:")) != -1) {
+        switch (opt) {
+            case 'h':
+                usage();
+                return 0;
+
+            case 'd':
+                b.dif_name = optarg;
+                break;
+
+            case 'n':
+                b.num_flows = strtoul(optarg, NULL, 10);
+                if (b.num_flows == 0) {
+                    printf("    Invalid 'num' %s\n", optarg);
+                    return -1;
+                }
+                break;
+
+            default:
+                printf("    Unrecognized option %c\n", opt);
+                usage();
+                return -1;
+        }
+    }
+
+    if (raise_nofile_limit(2 * b.num_flows + 64)) {
+        return -1;
+    }
+
+    b.cli_fds = calloc(b.num_flows, sizeof(int));
+    b.srv_fds = calloc(b.num_flows, sizeof(int));
+    b.alloc_ns = calloc(b.num_flows, sizeof(unsigned long));
+    b.dealloc_ns = calloc(b.num_flows, sizeof(unsigned long));
+    if (!b.cli_fds || !b.srv_fds || !b.alloc_ns || !b.dealloc_ns) {
+        printf("Out of memory\n");
+        return -1;
+    }
+    for (i = 0; i < b.num_flows; i++) {
+        b.cli_fds[i] = b.srv_fds[i] = -1;
+    }
+
+    b.cfd = rl_open();
+    if (b.cfd < 0) {
+        perror("rl_open()");
+        return -1;
+    }
+
+    ret = rl_register(b.cfd, b.dif_name, SRV_APPL_NAME);
+    if (ret) {
+        perror("rl_register()");
+        return -1;
+    }
+
+    ret = pthread_create(&srv_th, NULL, server_worker, &b);
+    if (ret) {
+        printf("pthread_create() failed [%d]\n", ret);
+        return -1;
+    }
+
+    for (i = 0; i < b.num_flows; i++) {
+        clock_gettime(CLOCK_MONOTONIC, &t);
+        b.cli_fds[i] = rl_flow_alloc(b.dif_name, CLI_APPL_NAME,
+                                     SRV_APPL_NAME, NULL);
+        b.alloc_ns[i] = ns_since(&t);
+        if (b.cli_fds[i] < 0) {
+            perror("rl_flow_alloc()");
+            break;
+        }
+        allocated++;
+    }
+
+    if (allocated < b.num_flows) {
+        /* Unblock the server worker. */
+        pthread_cancel(srv_th);
+    }
+    pthread_join(srv_th, NULL);
+
+    for (i = 0; i < allocated; i++) {
+        clock_gettime(CLOCK_MONOTONIC, &t);
+        close(b.cli_fds[i]);
+        if (b.srv_fds[i] >= 0) {
+            close(b.srv_fds[i]);
+        }
+        b.dealloc_ns[i] = ns_since(&t);
+    }
+
+    report("alloc", b.alloc_ns, allocated);
+    report("dealloc", b.dealloc_ns, allocated);
+
+    rl_unregister(b.cfd, b.dif_name, SRV_APPL_NAME);
+    close(b.cfd);
+
+    free(b.cli_fds);
+    free(b.srv_fds);
+    free(b.alloc_ns);
+    free(b.dealloc_ns);
+
+    return allocated == b.num_flows ? 0 : -1;
+}
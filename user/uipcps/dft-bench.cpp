@@ -0,0 +1,266 @@
+/*
+ * Microbenchmark for the Directory Forwarding Table of normal uipcps.
+ *
+ * Copyright (C) 2026 rlite contributors
+ *
+ * This file is part of rlite.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * Loads a DFT with a large number of application registrations, named
+ * like instances of microservices, and reports the rate of insertions,
+ * lookups (of registered and unregistered names), updates and removals.
+ * The same operations are run on a std::map keyed by the string form of
+ * the names, for comparison, and the results of the lookups are checked
+ * against each other.
+ */
+
+#include <iostream>
+#include <vector>
+#include <map>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <unistd.h>
+
+#include "uipcp-normal.hpp"
+
+using namespace std;
+
+typedef map<string, DFTEntry> DftMap;
+
+static RinaName
+appl_name(unsigned int i)
+{
+    char apn[32], api[16];
+
+    snprintf(apn, sizeof(apn), "svc-%u.app", i % 1000);
+    snprintf(api, sizeof(api), "%u", i / 1000);
+
+    return RinaName(apn, api, string(), string());
+}
+
+static void
+report(const char *op, unsigned int n, double dft_ms, double map_ms)
+{
+    printf("    %-8s %10.0f ops/s  (map %10.0f ops/s)\n", op,
+           n / dft_ms * 1000.0, n / map_ms * 1000.0);
+}
+
+static int
+bench(unsigned int num, unsigned int lookups)
+{
+    vector<DFTEntry> entries(num);
+    vector<unsigned int> keys(lookups);
+    struct timespec t;
+    double dft_ms, map_ms;
+    unsigned long found = 0, map_found = 0;
+    DFT dft;
+    DftMap dmap;
+    unsigned int i;
+
+    for (i = 0; i < num; i++) {
+        entries[i].appl_name = appl_name(i);
+        entries[i].address = 1 + i % 4096;
+        entries[i].timestamp = i;
+    }
+    for (i = 0; i < lookups; i++) {
+        keys[i] = rand() % num;
+    }
+
+    printf("%9u registrations\n", num);
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    for (i = 0; i < num; i++) {
+        dft.set(entries[i]);
+    }
+    dft_ms = ms_since(&t);
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    for (i = 0; i < num; i++) {
+        dmap[static_cast<string>(entries[i].appl_name)] = entries[i];
+    }
+    map_ms = ms_since(&t);
+    report("insert", num, dft_ms, map_ms);
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    for (i = 0; i < lookups; i++) {
+        const DFTRecord *r = dft.find(entries[keys[i]].appl_name);
+
+        found += r && r->address == entries[keys[i]].address;
+    }
+    dft_ms = ms_since(&t);
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    for (i = 0; i < lookups; i++) {
+        DftMap::iterator mit = dmap.find(
+                        static_cast<string>(entries[keys[i]].appl_name));
+
+        map_found += mit != dmap.end() &&
+                        mit->second.address == entries[keys[i]].address;
+    }
+    map_ms = ms_since(&t);
+    report("lookup", lookups, dft_ms, map_ms);
+
+    if (found != lookups || map_found != lookups) {
+        printf("    Lookup mismatch: %lu/%lu found (map %lu)\n", found,
+               (unsigned long)lookups, map_found);
+        return -1;
+    }
+
+    /* Names that are not registered. */
+    for (i = 0; i < num && i < lookups; i++) {
+        entries[i].appl_name.aen = "miss";
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    for (i = 0; i < lookups; i++) {
+        found += dft.find(entries[i % num].appl_name) != NULL;
+    }
+    dft_ms = ms_since(&t);
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    for (i = 0; i < lookups; i++) {
+        map_found += dmap.count(
+                        static_cast<string>(entries[i % num].appl_name));
+    }
+    map_ms = ms_since(&t);
+    report("miss", lookups, dft_ms, map_ms);
+    for (i = 0; i < num && i < lookups; i++) {
+        entries[i].appl_name.aen = string();
+    }
+
+    if (found != lookups || map_found != lookups) {
+        printf("    Unexpected hits: %lu (map %lu)\n", found - lookups,
+               map_found - lookups);
+        return -1;
+    }
+
+    /* Registrations moving to a different IPCP. */
+    for (i = 0; i < lookups; i++) {
+        entries[keys[i]].address++;
+        entries[keys[i]].timestamp += num;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    for (i = 0; i < lookups; i++) {
+        dft.set(entries[keys[i]]);
+    }
+    dft_ms = ms_since(&t);
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    for (i = 0; i < lookups; i++) {
+        dmap[static_cast<string>(entries[keys[i]].appl_name)] =
+                                                    entries[keys[i]];
+    }
+    map_ms = ms_since(&t);
+    report("update", lookups, dft_ms, map_ms);
+
+    for (i = 0; i < num; i++) {
+        const DFTRecord *r = dft.find(entries[i].appl_name);
+
+        if (!r || r->address != entries[i].address ||
+                r->address != dmap[static_cast<string>(
+                                    entries[i].appl_name)].address) {
+            printf("    Mismatch on %s\n",
+                   static_cast<string>(entries[i].appl_name).c_str());
+            return -1;
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    for (i = 0; i < num; i++) {
+        dft.erase(entries[i].appl_name);
+    }
+    dft_ms = ms_since(&t);
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    for (i = 0; i < num; i++) {
+        dmap.erase(static_cast<string>(entries[i].appl_name));
+    }
+    map_ms = ms_since(&t);
+    report("erase", num, dft_ms, map_ms);
+
+    if (dft.size() || dmap.size()) {
+        printf("    %u entries left (map %u)\n", (unsigned int)dft.size(),
+               (unsigned int)dmap.size());
+        return -1;
+    }
+
+    return 0;
+}
+
+static void
+usage(void)
+{
+    printf("rlite-dft-bench [OPTIONS]\n"
+        "   -h : show this help\n"
+        "   -n NUM : number of registrations (default: 100000, 1000000)\n"
+        "   -l NUM : number of lookups and updates (default 1000000)\n"
+        "   -s NUM : random seed (default 1)\n"
+          );
+}
+
+int
+main(int argc, char **argv)
+{
+    vector<unsigned int> sizes;
+    unsigned int lookups = 1000000;
+    unsigned int seed = 1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "hn:l:s:")) != -1) {
+        switch (opt) {
+            case 'h':
+                usage();
+                return 0;
+
+            case 'n':
+                sizes.push_back(strtoul(optarg, NULL, 10));
+                if (sizes.back() == 0) {
+                    printf("    Invalid 'num' %s\n", optarg);
+                    return -1;
+                }
+                break;
+
+            case 'l':
+                lookups = strtoul(optarg, NULL, 10);
+                if (lookups == 0) {
+                    printf("    Invalid 'lookups' %s\n", optarg);
+                    return -1;
+                }
+                break;
+
+            case 's':
+                seed = strtoul(optarg, NULL, 10);
+                break;
+
+            default:
+                printf("    Unrecognized option %c\n", opt);
+                usage();
+                return -1;
+        }
+    }
+
+    if (sizes.empty()) {
+        sizes.push_back(100000);
+        sizes.push_back(1000000);
+    }
+
+    srand(seed);
+
+    for (unsigned int i = 0; i < sizes.size(); i++) {
+        if (bench(sizes[i], lookups)) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
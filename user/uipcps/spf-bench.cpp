@@ -0,0 +1,300 @@
+/*
+ * Microbenchmark for the routing engine of normal uipcps.
+ *
+ * Copyright (C) 2026 rlite contributors
+ *
+ * This file is part of rlite.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * Runs SPEngine on synthetic Lower Flow Databases and reports the time
+ * taken by full routing table computations, by incremental updates
+ * after a single link cost change and by the computation of the
+ * loop-free alternates. Each synthetic DIF is a ring (to make
+ * sure it is connected) plus random chords, with symmetric random link
+ * costs. In verify mode, the result of each incremental update is
+ * compared with a full computation on a separate engine.
+ */
+
+#include <iostream>
+#include <vector>
+#include <iterator>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <unistd.h>
+
+#include "uipcp-normal.hpp"
+
+using namespace std;
+
+typedef map<rl_addr_t, map<rl_addr_t, LowerFlow> > Lfdb;
+
+static void
+add_link(Lfdb& lfdb, rl_addr_t a, rl_addr_t b, unsigned int cost)
+{
+    LowerFlow lf;
+
+    lf.local_addr = a;
+    lf.remote_addr = b;
+    lf.cost = cost;
+    lf.seqnum = 1;
+    lf.state = true;
+    lf.age = 0;
+    lfdb[a][b] = lf;
+
+    lf.local_addr = b;
+    lf.remote_addr = a;
+    lfdb[b][a] = lf;
+}
+
+static void
+build_lfdb(Lfdb& lfdb, unsigned int num_nodes, unsigned int degree)
+{
+    unsigned int num_chords = num_nodes * degree / 2;
+    unsigned int i;
+
+    lfdb.clear();
+
+    /* Addresses start from 1, as 0 is not a valid address. */
+    for (i = 0; i < num_nodes; i++) {
+        add_link(lfdb, i + 1, (i + 1) % num_nodes + 1, 1 + rand() % 10);
+    }
+
+    for (i = num_nodes; i < num_chords; i++) {
+        rl_addr_t a = 1 + rand() % num_nodes;
+        rl_addr_t b = 1 + rand() % num_nodes;
+
+        if (a != b) {
+            add_link(lfdb, a, b, 1 + rand() % 10);
+        }
+    }
+}
+
+struct stats {
+    double min, max, sum;
+    unsigned int n;
+
+    stats() : min(0.0), max(0.0), sum(0.0), n(0) { }
+
+    void add(double ms) {
+        if (n == 0 || ms < min) {
+            min = ms;
+        }
+        if (ms > max) {
+            max = ms;
+        }
+        sum += ms;
+        n++;
+    }
+};
+
+/* Compare the routing state of 'spe' with a full computation from
+ * scratch. Returns the number of destinations that differ. */
+static unsigned int
+verify(const SPEngine& spe, rl_addr_t local_addr, const Lfdb& lfdb)
+{
+    unsigned int mismatches = 0;
+    SPEngine ref;
+
+    ref.compute(local_addr, lfdb);
+    ref.compute_backups();
+
+    for (Lfdb::const_iterator it = lfdb.begin(); it != lfdb.end(); it++) {
+        rl_addr_t dst = it->first;
+        map<rl_addr_t, vector<rl_addr_t> >::const_iterator n1, n2;
+        map<rl_addr_t, rl_addr_t>::const_iterator b1, b2;
+        bool ok;
+
+        n1 = spe.next_hops.find(dst);
+        n2 = ref.next_hops.find(dst);
+        b1 = spe.backup_hops.find(dst);
+        b2 = ref.backup_hops.find(dst);
+        ok = spe.distance(dst) == ref.distance(dst);
+        ok = ok && (n1 == spe.next_hops.end()) ==
+                                    (n2 == ref.next_hops.end());
+        ok = ok && (n1 == spe.next_hops.end() || n1->second == n2->second);
+        ok = ok && (b1 == spe.backup_hops.end()) ==
+                                    (b2 == ref.backup_hops.end());
+        ok = ok && (b1 == spe.backup_hops.end() || b1->second == b2->second);
+        if (!ok) {
+            printf("    mismatch for destination %lu: distance %u vs %u\n",
+                   (long unsigned)dst, spe.distance(dst), ref.distance(dst));
+            mismatches++;
+        }
+    }
+
+    return mismatches;
+}
+
+static unsigned int
+bench(unsigned int num_nodes, unsigned int degree, unsigned int runs,
+      bool check)
+{
+    unsigned int mismatches = 0;
+    rl_addr_t local_addr = 1 + rand() % num_nodes;
+    struct stats full, incr, lfa;
+    SPEngine spe;
+    Lfdb lfdb;
+    unsigned int edges = 0;
+    unsigned int i;
+
+    build_lfdb(lfdb, num_nodes, degree);
+    for (Lfdb::iterator it = lfdb.begin(); it != lfdb.end(); it++) {
+        edges += it->second.size();
+    }
+
+    for (i = 0; i < runs; i++) {
+        struct timespec t;
+
+        clock_gettime(CLOCK_MONOTONIC, &t);
+        spe.compute(local_addr, lfdb);
+        full.add(ms_since(&t));
+    }
+
+    /* Change the cost of a random link, as a single LFDB update would
+     * do, and update the routing table incrementally. */
+    for (i = 0; i < runs; i++) {
+        rl_addr_t a = 1 + rand() % num_nodes;
+        map<rl_addr_t, LowerFlow>::iterator jt = lfdb[a].begin();
+        unsigned int cost = 1 + rand() % 10;
+        struct timespec t;
+
+        advance(jt, rand() % lfdb[a].size());
+        jt->second.cost = cost;
+        lfdb[jt->first][a].cost = cost;
+        spe.lfdb_changed(a, jt->first);
+        spe.lfdb_changed(jt->first, a);
+
+        clock_gettime(CLOCK_MONOTONIC, &t);
+        spe.update(local_addr, lfdb);
+        incr.add(ms_since(&t));
+
+        clock_gettime(CLOCK_MONOTONIC, &t);
+        spe.compute_backups();
+        lfa.add(ms_since(&t));
+
+        if (check) {
+            mismatches += verify(spe, local_addr, lfdb);
+        }
+    }
+
+    printf("%8u nodes %9u edges, %u routes, %u backups\n", num_nodes,
+           edges, (unsigned int)spe.next_hops.size(),
+           (unsigned int)spe.backup_hops.size());
+    printf("    full: avg %9.3f ms, min %9.3f ms, max %9.3f ms\n",
+           full.sum / full.n, full.min, full.max);
+    printf("    incr: avg %9.3f ms, min %9.3f ms, max %9.3f ms "
+           "[%lu incremental, %lu full]\n", incr.sum / incr.n, incr.min,
+           incr.max, spe.incr_runs, spe.full_runs - runs);
+    printf("    lfa:  avg %9.3f ms, min %9.3f ms, max %9.3f ms "
+           "[%lu neighbor trees]\n", lfa.sum / lfa.n, lfa.min, lfa.max,
+           spe.lfa_runs);
+    if (check) {
+        printf("    verify: %u mismatches\n", mismatches);
+    }
+
+    return mismatches;
+}
+
+static void
+usage(void)
+{
+    printf("rlite-spf-bench [OPTIONS]\n"
+        "   -h : show this help\n"
+        "   -n NUM : number of nodes (default: 1000, 5000, 10000, "
+                "50000)\n"
+        "   -d NUM : average node degree (default 4)\n"
+        "   -r NUM : number of SPF runs per graph (default 10)\n"
+        "   -s NUM : random seed (default 1)\n"
+        "   -v : verify incremental updates against full computations\n"
+          );
+}
+
+int
+main(int argc, char **argv)
+{
+    vector<unsigned int> sizes;
+    unsigned int degree = 4;
+    unsigned int runs = 10;
+    unsigned int seed = 1;
+    unsigned int mismatches = 0;
+    bool check = false;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "hn:d:r:s:v")) != -1) {
+        switch (opt) {
+            case 'h':
+                usage();
+                return 0;
+
+            case 'n':
+                sizes.push_back(strtoul(optarg, NULL, 10));
+                if (sizes.back() < 2) {
+                    printf("    Invalid 'num' %s\n", optarg);
+                    return -1;
+                }
+                break;
+
+            case 'd':
+                degree = strtoul(optarg, NULL, 10);
+                if (degree < 2) {
+                    printf("    Invalid 'degree' %s\n", optarg);
+                    return -1;
+                }
+                break;
+
+            case 'r':
+                runs = strtoul(optarg, NULL, 10);
+                if (runs == 0) {
+                    printf("    Invalid 'runs' %s\n", optarg);
+                    return -1;
+                }
+                break;
+
+            case 's':
+                seed = strtoul(optarg, NULL, 10);
+                break;
+
+            case 'v':
+                check = true;
+                break;
+
+            default:
+                printf("    Unrecognized option %c\n", opt);
+                usage();
+                return -1;
+        }
+    }
+
+    if (sizes.empty()) {
+        sizes.push_back(1000);
+        sizes.push_back(5000);
+        sizes.push_back(10000);
+        sizes.push_back(50000);
+    }
+
+    /* Keep the routing engine quiet. */
+    rl_verbosity = RL_VERB_QUIET;
+    srand(seed);
+
+    for (unsigned int i = 0; i < sizes.size(); i++) {
+        mismatches += bench(sizes[i], degree, runs, check);
+    }
+
+    return mismatches ? 1 : 0;
+}
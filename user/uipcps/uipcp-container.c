@@ -131,6 +131,93 @@ uipcp_pduft_flush(struct uipcp *uipcp, rl_ipcp_id_t ipcp_id)
     return result;
 }
 
+/* Ask the kernel for the statistics of a flow. The request does not
+ * block: the response is delivered to the flow_stats uipcp op. */
+int
+uipcp_flow_stats_req(struct uipcp *uipcp, rl_port_t port_id)
+{
+    struct rl_kmsg_flow_stats_req *req;
+    struct rl_msg_base *resp;
+    int result;
+
+    /* Allocate and create a request message. */
+    req = malloc(sizeof(*req));
+    if (!req) {
+        UPE(uipcp, "Out of memory\n");
+        return ENOMEM;
+    }
+
+    memset(req, 0, sizeof(*req));
+    req->msg_type = RLITE_KER_FLOW_STATS_REQ;
+    req->event_id = rl_ctrl_get_id(&uipcp->loop.ctrl);
+    req->port_id = port_id;
+
+    UPV(uipcp, "Requesting flow %u statistics...\n", port_id);
+
+    resp = rl_evloop_issue_request(&uipcp->loop, RLITE_MB(req),
+                                  sizeof(*req), 1, 0, &result);
+    assert(!resp); (void)resp;
+    UPV(uipcp, "result: %d\n", result);
+
+    return result;
+}
+
+/* Apply a batch of PDUFT changes with a single kernel message. The
+ * kernel applies the whole batch atomically. */
+int
+uipcp_pduft_mod(struct uipcp *uipcp, rl_ipcp_id_t ipcp_id, int replace,
+                const struct rl_pduft_mod_entry *set, unsigned int num_set,
+                const rl_addr_t *del, unsigned int num_del)
+{
+    struct rl_kmsg_ipcp_pduft_mod *req;
+    struct rl_msg_base *resp;
+    int result;
+
+    /* Allocate and create a request message. */
+    req = malloc(sizeof(*req));
+    if (!req) {
+        UPE(uipcp, "Out of memory\n");
+        return ENOMEM;
+    }
+
+    memset(req, 0, sizeof(*req));
+    req->msg_type = RLITE_KER_IPCP_PDUFT_MOD;
+    req->event_id = 1;
+    req->ipcp_id = ipcp_id;
+    req->replace = replace ? 1 : 0;
+
+    if (num_set) {
+        req->set.len = num_set * sizeof(*set);
+        req->set.buf = malloc(req->set.len);
+    }
+    if (num_del) {
+        req->del.len = num_del * sizeof(*del);
+        req->del.buf = malloc(req->del.len);
+    }
+    if ((num_set && !req->set.buf) || (num_del && !req->del.buf)) {
+        UPE(uipcp, "Out of memory\n");
+        rl_msg_free(rl_ker_numtables, RLITE_KER_MSG_MAX, RLITE_MB(req));
+        free(req);
+        return ENOMEM;
+    }
+    if (num_set) {
+        memcpy(req->set.buf, set, req->set.len);
+    }
+    if (num_del) {
+        memcpy(req->del.buf, del, req->del.len);
+    }
+
+    UPV(uipcp, "Requesting IPCP pdu forwarding table modification "
+        "[set %u, del %u, replace %d]...\n", num_set, num_del, replace);
+
+    resp = rl_evloop_issue_request(&uipcp->loop, RLITE_MB(req),
+                                  sizeof(*req), 0, 0, &result);
+    assert(!resp); (void)resp;
+    UPV(uipcp, "result: %d\n", result);
+
+    return result;
+}
+
 int
 uipcp_issue_fa_req_arrived(struct uipcp *uipcp, uint32_t kevent_id,
                            rl_port_t remote_port, uint32_t remote_cep,
@@ -479,6 +566,12 @@ uipcp_add(struct uipcps *uipcps, struct rl_kmsg_ipcp_update *upd)
     ret |= rl_evloop_set_handler(&uipcp->loop,
                                     RLITE_KER_FLOW_DEALLOCATED,
                                     uipcp->ops.flow_deallocated);
+
+    if (uipcp->ops.flow_stats) {
+        ret |= rl_evloop_set_handler(&uipcp->loop,
+                                     RLITE_KER_FLOW_STATS_RESP,
+                                     uipcp->ops.flow_stats);
+    }
     if (ret) {
         goto err2;
     }
@@ -98,6 +98,10 @@ struct uipcp_ops {
                             const struct rl_msg_base *b_resp,
                             const struct rl_msg_base *b_req);
 
+    int (*flow_stats)(struct rl_evloop *loop,
+                      const struct rl_msg_base *b_resp,
+                      const struct rl_msg_base *b_req);
+
     int (*get_enrollment_targets)(struct uipcp *, struct list_head *neighs);
 };
 
@@ -175,11 +179,59 @@ int uipcp_appl_register_resp(struct uipcp *uipcp, rl_ipcp_id_t ipcp_id,
                              uint8_t response,
                              const struct rl_kmsg_appl_register *req);
 
+/* SPF scheduling parameters for normal uipcps, in milliseconds: delay
+ * of the first computation after a quiet period, minimum interval
+ * between two computations, and maximum value reached by the
+ * exponential back-off of the latter. */
+struct uipcp_spf_params {
+    unsigned int initial_delay;
+    unsigned int hold;
+    unsigned int max_hold;
+};
+
+extern struct uipcp_spf_params normal_spf_params;
+
+/* Limits and default for the maximum size (in bytes) of the management
+ * SDUs sent on N-1 flows to synchronize the RIB with a new neighbor.
+ * The default fits an Ethernet frame. */
+#define RL_MGMT_SDU_MIN     512
+#define RL_MGMT_SDU_MAX     65536
+#define RL_MGMT_SDU_DFLT    1400
+
+/* RIB synchronization parameters for normal uipcps: maximum size of
+ * the management SDUs and whether to compress them (only supported if
+ * built with zlib). */
+struct uipcp_mgmt_params {
+    unsigned int sdu_max;
+    int compress;
+};
+
+extern struct uipcp_mgmt_params normal_mgmt_params;
+
+/* Directory parameters for normal uipcps. If replicas is zero, the
+ * whole directory is replicated on all the IPCPs of the DIF. Otherwise
+ * each entry is only stored by the given number of home IPCPs, selected
+ * by hashing the application name over the addresses of the DIF, and
+ * looked up on demand. Must be the same for all the IPCPs in a DIF. */
+#define RL_DFT_REPLICAS_MAX     16
+
+struct uipcp_dir_params {
+    unsigned int replicas;
+};
+
+extern struct uipcp_dir_params normal_dir_params;
+
 int uipcp_pduft_set(struct uipcp *uipcs, rl_ipcp_id_t ipcp_id,
                     rl_addr_t dst_addr, rl_port_t local_port);
 
 int uipcp_pduft_flush(struct uipcp *uipcp, rl_ipcp_id_t ipcp_id);
 
+int uipcp_flow_stats_req(struct uipcp *uipcp, rl_port_t port_id);
+
+int uipcp_pduft_mod(struct uipcp *uipcp, rl_ipcp_id_t ipcp_id, int replace,
+                    const struct rl_pduft_mod_entry *set, unsigned int num_set,
+                    const rl_addr_t *del, unsigned int num_del);
+
 int uipcp_issue_fa_req_arrived(struct uipcp *uipcp, uint32_t kevent_id,
                                rl_port_t remote_port, uint32_t remote_cep,
                                rl_addr_t remote_addr,
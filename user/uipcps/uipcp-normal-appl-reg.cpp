@@ -23,12 +23,18 @@
 
 
 #include <ctime>
+#include <algorithm>
+#include <iterator>
 
 #include "uipcp-normal.hpp"
 
 using namespace std;
 
 
+/* Maximum number of DFT entries sent in a single message when
+ * publishing the local registrations. */
+#define RL_DFT_PUBLISH_CHUNK    10
+
 static uint64_t time64()
 {
     struct timespec tv;
@@ -43,35 +49,395 @@ static uint64_t time64()
 }
 
 int
-uipcp_rib::dft_lookup(const RinaName& appl_name,
-                      rl_addr_t& dstaddr) const
+uipcp_rib::dft_lookup(const RinaName& appl_name, rl_addr_t& dstaddr)
 {
-    map< string, DFTEntry >::const_iterator mit
-         = dft.find(static_cast<string>(appl_name));
+    const DFTRecord *r = dft.find(appl_name);
+    map<string, DFTCacheEntry>::iterator c;
+
+    if (r != NULL) {
+        dstaddr = r->address;
+        return 0;
+    }
+
+    if (!normal_dir_params.replicas) {
+        return -1;
+    }
 
-    if (mit == dft.end()) {
+    c = dft_cache.find(static_cast<string>(appl_name));
+    if (c == dft_cache.end() || c->second.expires <= mono_secs()) {
         return -1;
     }
 
-    dstaddr = mit->second.address;
+    dft_stats.hits++;
+    dstaddr = c->second.address;
 
     return 0;
 }
 
+void
+uipcp_rib::dft_cache_del(const RinaName& appl_name)
+{
+    dft_cache.erase(static_cast<string>(appl_name));
+}
+
+/* Weight of an IPCP for a name, for rendezvous hashing. */
+static uint64_t
+dir_weight(uint32_t name_hash, rl_addr_t addr)
+{
+    uint64_t x = (static_cast<uint64_t>(name_hash) << 32) ^ addr;
+
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+
+    return x;
+}
+
+/* The home IPCPs of a name are the ones with the highest weights among
+ * the IPCPs in the LFDB (rendezvous hashing), so that an IPCP joining or
+ * leaving the DIF only moves the entries it is a home for. The homes
+ * are selected among 'cands', and sorted by decreasing weight. */
+static void
+dir_homes(uint32_t h, const vector<rl_addr_t>& cands,
+          vector<rl_addr_t>& homes)
+{
+    vector< pair<uint64_t, rl_addr_t> > w;
+    size_t n;
+
+    w.reserve(cands.size());
+    for (vector<rl_addr_t>::const_iterator it = cands.begin();
+                                            it != cands.end(); it++) {
+        w.push_back(make_pair(dir_weight(h, *it), *it));
+    }
+
+    n = min(static_cast<size_t>(normal_dir_params.replicas), w.size());
+    partial_sort(w.begin(), w.begin() + n, w.end(),
+                 greater< pair<uint64_t, rl_addr_t> >());
+
+    homes.clear();
+    for (size_t i = 0; i < n; i++) {
+        homes.push_back(w[i].second);
+    }
+}
+
+/* The IPCPs in the DIF, sorted by address. */
+static void
+dir_nodes(const uipcp_rib *rib, vector<rl_addr_t>& nodes)
+{
+    nodes.clear();
+    nodes.reserve(rib->lfdb.size() + 1);
+    for (map< rl_addr_t, map< rl_addr_t, LowerFlow > >::const_iterator
+            it = rib->lfdb.begin(); it != rib->lfdb.end(); it++) {
+        nodes.push_back(it->first);
+    }
+    if (rib->lfdb.count(rib->uipcp->addr) == 0) {
+        nodes.insert(lower_bound(nodes.begin(), nodes.end(),
+                                 rib->uipcp->addr), rib->uipcp->addr);
+    }
+}
+
+void
+uipcp_rib::dft_homes(const RinaName& appl_name, vector<rl_addr_t>& homes) const
+{
+    vector<rl_addr_t> nodes;
+
+    dir_nodes(this, nodes);
+    dir_homes(DFT::name_hash(appl_name), nodes, homes);
+}
+
+/* Send a local (un)registration to the home IPCPs of the name. */
+int
+uipcp_rib::dft_publish(bool create, const DFTEntry& entry)
+{
+    vector<rl_addr_t> homes;
+    DFTSlice dft_slice;
+    int ret = 0;
+
+    dft_homes(entry.appl_name, homes);
+    dft_slice.entries.push_back(entry);
+
+    for (vector<rl_addr_t>::iterator h = homes.begin();
+                                        h != homes.end(); h++) {
+        CDAPMessage *m;
+
+        if (*h == uipcp->addr) {
+            continue;
+        }
+
+        m = new CDAPMessage();
+        if (create) {
+            m->m_create(gpb::F_NO_FLAGS, obj_class::dft, obj_name::dft,
+                        0, 0, string());
+        } else {
+            m->m_delete(gpb::F_NO_FLAGS, obj_class::dft, obj_name::dft,
+                        0, 0, string());
+        }
+        ret |= send_to_dst_addr(m, *h, &dft_slice);
+        dft_stats.published++;
+    }
+
+    return ret;
+}
+
+/* Update the homes of the entries after IPCPs joined or left the DIF
+ * ('nodes' being the new set): local registrations are published to
+ * their new homes, and the entries this IPCP is not a home for anymore,
+ * or whose IPCP is not in the DIF anymore, are dropped. Homes only move
+ * if one of them left or a joining IPCP outweighs them, so in most
+ * cases only the joining IPCPs need to be weighed. */
+void
+uipcp_rib::dft_homes_update(const vector<rl_addr_t>& nodes)
+{
+    map<rl_addr_t, DFTSlice> slices;
+    list<RinaName> drop;
+    vector<rl_addr_t> added, removed, cands, homes;
+
+    set_difference(nodes.begin(), nodes.end(), dft_nodes.begin(),
+                   dft_nodes.end(), back_inserter(added));
+    set_difference(dft_nodes.begin(), dft_nodes.end(), nodes.begin(),
+                   nodes.end(), back_inserter(removed));
+
+    for (DFT::const_iterator r = dft.begin(); r != dft.end(); r++) {
+        bool moved = false;
+
+        if (r->homes.empty()) {
+            /* Inserted since the last run, when these were its homes. */
+            dir_homes(r->hash, dft_nodes, r->homes);
+        }
+
+        for (vector<rl_addr_t>::iterator n = removed.begin();
+                                        n != removed.end(); n++) {
+            if (find(r->homes.begin(), r->homes.end(), *n) !=
+                                                    r->homes.end()) {
+                moved = true;
+                break;
+            }
+        }
+
+        if (moved) {
+            dir_homes(r->hash, nodes, homes);
+        } else {
+            cands = r->homes;
+            cands.insert(cands.end(), added.begin(), added.end());
+            dir_homes(r->hash, cands, homes);
+        }
+
+        if (!r->local) {
+            if ((r->address != uipcp->addr &&
+                    !binary_search(nodes.begin(), nodes.end(), r->address)) ||
+                    find(homes.begin(), homes.end(), uipcp->addr) ==
+                                                            homes.end()) {
+                drop.push_back(r->appl_name);
+            }
+            r->homes.swap(homes);
+            continue;
+        }
+
+        for (vector<rl_addr_t>::iterator h = homes.begin();
+                                            h != homes.end(); h++) {
+            if (*h == uipcp->addr || find(r->homes.begin(), r->homes.end(),
+                                          *h) != r->homes.end()) {
+                /* Already published there. */
+                continue;
+            }
+
+            DFTSlice& slice = slices[*h];
+
+            slice.entries.push_back(r->entry());
+            if (slice.entries.size() >= RL_DFT_PUBLISH_CHUNK) {
+                CDAPMessage *m = new CDAPMessage();
+
+                m->m_create(gpb::F_NO_FLAGS, obj_class::dft, obj_name::dft,
+                            0, 0, string());
+                send_to_dst_addr(m, *h, &slice);
+                dft_stats.published += slice.entries.size();
+                slice.entries.clear();
+            }
+        }
+        r->homes.swap(homes);
+    }
+
+    for (map<rl_addr_t, DFTSlice>::iterator sit = slices.begin();
+                                        sit != slices.end(); sit++) {
+        CDAPMessage *m;
+
+        if (sit->second.entries.empty()) {
+            continue;
+        }
+
+        m = new CDAPMessage();
+        m->m_create(gpb::F_NO_FLAGS, obj_class::dft, obj_name::dft,
+                    0, 0, string());
+        send_to_dst_addr(m, sit->first, &sit->second);
+        dft_stats.published += sit->second.entries.size();
+    }
+
+    for (list<RinaName>::iterator n = drop.begin(); n != drop.end(); n++) {
+        UPD(uipcp, "DFT entry %s dropped\n", static_cast<string>(*n).c_str());
+        dft.erase(*n);
+        dft_stats.dropped++;
+    }
+}
+
+/* Periodic maintenance of the distributed directory: move the entries
+ * if the set of IPCPs in the DIF changed since the last run, and purge
+ * the cache. */
+void
+uipcp_rib::dft_refresh()
+{
+    vector<rl_addr_t> nodes;
+    time_t now = mono_secs();
+
+    dir_nodes(this, nodes);
+    if (nodes != dft_nodes) {
+        dft_homes_update(nodes);
+        dft_nodes.swap(nodes);
+    }
+
+    while (!dft_cache_expiry.empty() &&
+                            dft_cache_expiry.begin()->first <= now) {
+        dft_cache_evict();
+    }
+}
+
+/* Remove the cache entry that expires first. */
+void
+uipcp_rib::dft_cache_evict()
+{
+    multimap<time_t, string>::iterator x = dft_cache_expiry.begin();
+    map<string, DFTCacheEntry>::iterator c = dft_cache.find(x->second);
+
+    if (c != dft_cache.end() && c->second.expires == x->first) {
+        dft_cache.erase(c);
+    }
+    dft_cache_expiry.erase(x);
+}
+
+static void
+dft_query_timeout_cb(struct rl_evloop *loop, void *arg)
+{
+    DFTQuery *q = static_cast<DFTQuery *>(arg);
+    uipcp_rib *rib = q->rib;
+    ScopeLock lock_(rib->lock);
+
+    q->tmrid = 0;
+    UPI(rib->uipcp, "Directory query for %s timed out\n",
+        static_cast<string>(q->appl_name).c_str());
+    rib->dft_query_next(q);
+}
+
+/* Look up a name that is not in the local directory, on behalf of a
+ * flow allocation request. Requests for the same name share the same
+ * query. */
+int
+uipcp_rib::dft_query(const FlowRequest& freq)
+{
+    string name_str = static_cast<string>(freq.dst_app);
+    map<string, DFTQuery *>::iterator qit = dft_queries.find(name_str);
+    DFTQuery *q;
+
+    if (qit != dft_queries.end()) {
+        qit->second->reqs.push_back(freq);
+        return 0;
+    }
+
+    q = new DFTQuery();
+    q->rib = this;
+    q->appl_name = freq.dst_app;
+    dft_homes(q->appl_name, q->homes);
+    q->homes.erase(remove(q->homes.begin(), q->homes.end(), uipcp->addr),
+                   q->homes.end());
+    q->next = 0;
+    q->tmrid = 0;
+    q->reqs.push_back(freq);
+    dft_queries[name_str] = q;
+    dft_stats.queries++;
+
+    dft_query_next(q);
+
+    return 0;
+}
+
+/* Send the query to the next home IPCP, or fail the query if they have
+ * all been tried. */
+void
+uipcp_rib::dft_query_next(DFTQuery *q)
+{
+    DFTSlice dft_slice;
+    DFTEntry dft_entry;
+
+    /* The requester address is carried in the entry, so that the
+     * home IPCP knows where to send the answer. */
+    dft_entry.appl_name = q->appl_name;
+    dft_entry.address = uipcp->addr;
+    dft_slice.entries.push_back(dft_entry);
+
+    while (q->next < q->homes.size()) {
+        rl_addr_t home = q->homes[q->next++];
+        CDAPMessage *m = new CDAPMessage();
+
+        m->m_read(gpb::F_NO_FLAGS, obj_class::dft, obj_name::dft,
+                  0, 0, string());
+        if (send_to_dst_addr(m, home, &dft_slice) == 0) {
+            UPD(uipcp, "Directory query for %s sent to %llu\n",
+                static_cast<string>(q->appl_name).c_str(),
+                (long long unsigned)home);
+            q->tmrid = rl_evloop_schedule(&uipcp->loop, RL_DFT_QUERY_TIMEOUT,
+                                          dft_query_timeout_cb, q);
+            return;
+        }
+    }
+
+    UPI(uipcp, "No DFT matching entry for destination %s\n",
+        static_cast<string>(q->appl_name).c_str());
+    dft_stats.failures++;
+    dft_query_done(q, 0);
+}
+
+/* Complete a query, resuming the pending flow allocation requests if
+ * the name has been resolved (address is not zero), or refusing them. */
+void
+uipcp_rib::dft_query_done(DFTQuery *q, rl_addr_t address)
+{
+    if (q->tmrid > 0) {
+        rl_evloop_schedule_canc(&uipcp->loop, q->tmrid);
+        q->tmrid = 0;
+    }
+    dft_queries.erase(static_cast<string>(q->appl_name));
+
+    for (list<FlowRequest>::iterator f = q->reqs.begin();
+                                        f != q->reqs.end(); f++) {
+        if (address) {
+            f->dst_addr = address;
+            fa_req_send(*f);
+        } else {
+            uipcp_issue_fa_resp_arrived(uipcp, f->src_port,
+                                        0 /* don't care */,
+                                        0 /* don't care */,
+                                        0 /* don't care */,
+                                        1, NULL);
+        }
+    }
+
+    delete q;
+}
+
 int
 uipcp_rib::dft_set(const RinaName& appl_name, rl_addr_t remote_addr)
 {
-    string key = static_cast<string>(appl_name);
     DFTEntry entry;
 
     entry.address = remote_addr;
     entry.appl_name = appl_name;
     entry.timestamp = time64();
 
-    dft[key] = entry;
+    dft.set(entry);
 
     UPD(uipcp, "[uipcp %u] setting DFT entry '%s' --> %llu\n", uipcp->id,
-       key.c_str(), (long long unsigned)entry.address);
+       static_cast<string>(appl_name).c_str(),
+       (long long unsigned)entry.address);
 
     return 0;
 }
@@ -80,7 +446,7 @@ int
 uipcp_rib::appl_register(const struct rl_kmsg_appl_register *req)
 {
     RinaName appl_name(&req->appl_name);
-    map< string, DFTEntry >::iterator mit;
+    const DFTRecord *cur;
     string name_str;
     bool create = true;
     DFTSlice dft_slice;
@@ -92,30 +458,30 @@ uipcp_rib::appl_register(const struct rl_kmsg_appl_register *req)
     dft_entry.local = true;
     name_str = static_cast<string>(dft_entry.appl_name);
 
-    mit = dft.find(name_str);
+    cur = dft.find(appl_name);
 
     if (req->reg) {
-        if (mit != dft.end()) {
+        if (cur != NULL) {
             UPE(uipcp, "Application %s already registered on uipcp with address "
                     "[%llu], my address being [%llu]\n", name_str.c_str(),
-                    (long long unsigned)mit->second.address,
+                    (long long unsigned)cur->address,
                     (long long unsigned)uipcp->addr);
             return uipcp_appl_register_resp(uipcp, uipcp->id,
                                             RLITE_ERR, req);
         }
 
         /* Insert the object into the RIB. */
-        dft.insert(make_pair(name_str, dft_entry));
+        dft.set(dft_entry);
 
     } else {
-        if (mit == dft.end()) {
+        if (cur == NULL) {
             UPE(uipcp, "Application %s was not registered here\n",
                 name_str.c_str());
             return 0;
         }
 
         /* Remove the object from the RIB. */
-        dft.erase(mit);
+        dft.erase(appl_name);
         create = false;
     }
 
@@ -125,7 +491,12 @@ uipcp_rib::appl_register(const struct rl_kmsg_appl_register *req)
             name_str.c_str(), req->reg ? "" : "un", req->reg ? "to" : "from",
             uipcp->id);
 
-    remote_sync_obj_all(create, obj_class::dft, obj_name::dft, &dft_slice);
+    if (normal_dir_params.replicas) {
+        dft_publish(create, dft_entry);
+    } else {
+        remote_sync_obj_all(create, obj_class::dft, obj_name::dft,
+                            &dft_slice);
+    }
 
     if (req->reg) {
         /* Registration requires a response, while unregistrations doesn't. */
@@ -143,6 +514,10 @@ uipcp_rib::dft_handler(const CDAPMessage *rm, NeighFlow *nf)
     size_t objlen;
     bool add = true;
 
+    if (rm->op_code == gpb::M_READ || rm->op_code == gpb::M_READ_R) {
+        return dft_handler_query(rm);
+    }
+
     if (rm->op_code != gpb::M_CREATE && rm->op_code != gpb::M_DELETE) {
         UPE(uipcp, "M_CREATE or M_DELETE expected\n");
         return 0;
@@ -164,32 +539,34 @@ uipcp_rib::dft_handler(const CDAPMessage *rm, NeighFlow *nf)
 
     for (list<DFTEntry>::iterator e = dft_slice.entries.begin();
                                 e != dft_slice.entries.end(); e++) {
-        string key = static_cast<string>(e->appl_name);
-        map< string, DFTEntry >::iterator mit = dft.find(key);
+        const DFTRecord *cur = dft.find(e->appl_name);
 
         if (add) {
-            if (mit == dft.end() || e->timestamp > mit->second.timestamp) {
-                dft[key] = *e;
+            if (cur == NULL || e->timestamp > cur->timestamp) {
+                UPD(uipcp, "DFT entry %s %s remotely\n",
+                        static_cast<string>(e->appl_name).c_str(),
+                        (cur != NULL ? "updated" : "added"));
+                dft.set(*e);
                 prop_dft.entries.push_back(*e);
-                UPD(uipcp, "DFT entry %s %s remotely\n", key.c_str(),
-                        (mit != dft.end() ? "updated" : "added"));
             }
 
         } else {
-            if (mit == dft.end()) {
+            if (cur == NULL) {
                 UPI(uipcp, "DFT entry does not exist\n");
             } else {
-                dft.erase(mit);
+                dft.erase(e->appl_name);
                 prop_dft.entries.push_back(*e);
-                UPD(uipcp, "DFT entry %s removed remotely\n", key.c_str());
+                UPD(uipcp, "DFT entry %s removed remotely\n",
+                    static_cast<string>(e->appl_name).c_str());
             }
 
         }
     }
 
-    if (prop_dft.entries.size()) {
+    if (prop_dft.entries.size() && !normal_dir_params.replicas) {
         /* Propagate the DFT entries update to the other neighbors,
-         * except for the one. */
+         * except for the one. With the distributed directory, entries
+         * are sent directly to their home IPCPs. */
         remote_sync_obj_excluding(nf->neigh, add, obj_class::dft,
                               obj_name::dft, &prop_dft);
 
@@ -198,3 +575,87 @@ uipcp_rib::dft_handler(const CDAPMessage *rm, NeighFlow *nf)
     return 0;
 }
 
+
+/* Directory queries: M_READ from the querying IPCP, answered by the
+ * home IPCP with an M_READ_R carrying the entry (negative if the name
+ * is unknown). */
+int
+uipcp_rib::dft_handler_query(const CDAPMessage *rm)
+{
+    const char *objbuf;
+    size_t objlen;
+
+    rm->get_obj_value(objbuf, objlen);
+    if (!objbuf) {
+        UPE(uipcp, "%s does not contain a nested message\n",
+            rm->op_code == gpb::M_READ ? "M_READ" : "M_READ_R");
+        return 0;
+    }
+
+    DFTSlice dft_slice(objbuf, objlen);
+
+    for (list<DFTEntry>::iterator e = dft_slice.entries.begin();
+                                e != dft_slice.entries.end(); e++) {
+        string name_str = static_cast<string>(e->appl_name);
+
+        if (rm->op_code == gpb::M_READ) {
+            const DFTRecord *r = dft.find(e->appl_name);
+            DFTSlice reply;
+            CDAPMessage *m;
+
+            m = new CDAPMessage();
+            m->m_read_r(gpb::F_NO_FLAGS, obj_class::dft, obj_name::dft, 0,
+                        r ? 0 : -1, r ? string() : "No DFT entry");
+            if (r) {
+                reply.entries.push_back(r->entry());
+            } else {
+                DFTEntry none;
+
+                none.appl_name = e->appl_name;
+                reply.entries.push_back(none);
+            }
+            UPD(uipcp, "Directory query for %s from %llu: %s\n",
+                name_str.c_str(), (long long unsigned)e->address,
+                r ? "found" : "not found");
+            send_to_dst_addr(m, e->address, &reply);
+
+        } else {
+            map<string, DFTQuery *>::iterator qit =
+                                        dft_queries.find(name_str);
+            DFTQuery *q;
+
+            if (qit == dft_queries.end()) {
+                UPD(uipcp, "Directory answer for %s does not match any "
+                    "pending query\n", name_str.c_str());
+                continue;
+            }
+            q = qit->second;
+
+            if (rm->result || e->address == 0) {
+                /* Try with the next home. */
+                if (q->tmrid > 0) {
+                    rl_evloop_schedule_canc(&uipcp->loop, q->tmrid);
+                    q->tmrid = 0;
+                }
+                dft_query_next(q);
+                continue;
+            }
+
+            while (dft_cache.size() >= RL_DFT_CACHE_MAX &&
+                        !dft_cache.count(name_str) &&
+                        !dft_cache_expiry.empty()) {
+                dft_cache_evict();
+            }
+            dft_cache[name_str].address = e->address;
+            dft_cache[name_str].expires = mono_secs() + RL_DFT_CACHE_TTL;
+            dft_cache_expiry.insert(make_pair(dft_cache[name_str].expires,
+                                              name_str));
+            dft_stats.answered++;
+            UPD(uipcp, "Directory query for %s resolved to %llu\n",
+                name_str.c_str(), (long long unsigned)e->address);
+            dft_query_done(q, e->address);
+        }
+    }
+
+    return 0;
+}
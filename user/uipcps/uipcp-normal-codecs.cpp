@@ -374,6 +374,7 @@ LowerFlow::operator std::string() const
 }
 
 LowerFlowList::LowerFlowList(const char *buf, unsigned int size)
+                                : summary(false)
 {
     gpb::flowStateObjectGroup_t gm;
 
@@ -396,6 +397,13 @@ LowerFlowList::serialize(char *buf, unsigned int size) const
         int ret;
 
         flow = gm.add_flow_state_objects();
+        if (summary) {
+            flow->set_address(f->local_addr);
+            flow->set_neighbor_address(f->remote_addr);
+            flow->set_sequence_number(f->seqnum);
+            continue;
+        }
+
         ret = LowerFlow2gpb(*f, *flow);
         if (ret) {
             return ret;
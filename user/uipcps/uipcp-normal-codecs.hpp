@@ -27,6 +27,7 @@
 #include <stdint.h>
 #include <list>
 #include <string>
+#include <ctime>
 
 #include "rlite/common.h"
 #include "rlite/cdap.hpp"
@@ -114,6 +115,10 @@ struct LowerFlow : public UipcpObject {
     bool state;
     unsigned int age;
 
+    /* Local, not serialized: last time (monotonic clock, seconds) a
+     * new version of this entry was received. */
+    time_t refreshed;
+
     LowerFlow() { }
     LowerFlow(const char *buf, unsigned int size);
     int serialize(char *buf, unsigned int size) const;
@@ -124,7 +129,11 @@ struct LowerFlow : public UipcpObject {
 struct LowerFlowList : public UipcpObject {
     std::list<LowerFlow> flows;
 
-    LowerFlowList() { }
+    /* Only serialize the keys and the sequence numbers of the entries,
+     * as needed by the LFDB summaries. */
+    bool summary;
+
+    LowerFlowList() : summary(false) { }
     LowerFlowList(const char *buf, unsigned int size);
     int serialize(char *buf, unsigned int size) const;
 };
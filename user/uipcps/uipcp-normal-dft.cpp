@@ -0,0 +1,230 @@
+/*
+ * Directory Forwarding Table for normal uipcps.
+ *
+ * Copyright (C) 2026 rlite contributors
+ *
+ * This file is part of rlite.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <vector>
+#include <string>
+
+#include "uipcp-normal.hpp"
+
+using namespace std;
+
+
+/* Minimum number of slots of the hash table, which is kept between
+ * one eighth and one half full. The number of slots is always a power
+ * of two. */
+#define DFT_SLOTS_MIN   16
+
+static const unsigned int DFT_SLOT_NONE = ~0U;
+
+DFTEntry
+DFTRecord::entry() const
+{
+    DFTEntry e;
+
+    e.appl_name = appl_name;
+    e.address = address;
+    e.timestamp = timestamp;
+    e.local = local;
+
+    return e;
+}
+
+DFT::DFT() : slots(DFT_SLOTS_MIN), mask(DFT_SLOTS_MIN - 1)
+{
+}
+
+static uint32_t
+fnv1a(uint32_t h, const string& s)
+{
+    for (size_t i = 0; i < s.size(); i++) {
+        h ^= static_cast<unsigned char>(s[i]);
+        h *= 16777619U;
+    }
+
+    /* Terminate each component, so that names whose components
+     * concatenate to the same string hash differently. */
+    return h * 16777619U;
+}
+
+/* FNV-1a over the name components, with a final mix to spread the
+ * entropy over the low bits, which select the slot. */
+uint32_t
+DFT::name_hash(const RinaName& appl_name)
+{
+    uint32_t h = 2166136261U;
+
+    h = fnv1a(h, appl_name.apn);
+    h = fnv1a(h, appl_name.api);
+    h = fnv1a(h, appl_name.aen);
+    h = fnv1a(h, appl_name.aei);
+
+    h ^= h >> 16;
+    h *= 0x85ebca6bU;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35U;
+    h ^= h >> 16;
+
+    return h;
+}
+
+unsigned int
+DFT::slot_find(const RinaName& appl_name, uint32_t hash) const
+{
+    unsigned int i = hash & mask;
+
+    for (; slots[i].idx; i = (i + 1) & mask) {
+        if (slots[i].hash == hash &&
+                records[slots[i].idx - 1].appl_name == appl_name) {
+            return i;
+        }
+    }
+
+    return DFT_SLOT_NONE;
+}
+
+void
+DFT::slot_insert(uint32_t idx, uint32_t hash)
+{
+    unsigned int i = hash & mask;
+
+    while (slots[i].idx) {
+        i = (i + 1) & mask;
+    }
+
+    slots[i].idx = idx + 1;
+    slots[i].hash = hash;
+}
+
+/* Backward shift deletion: move back the following slots of the same
+ * cluster that would not be reachable anymore from their home slot. */
+void
+DFT::slot_remove(unsigned int i)
+{
+    unsigned int j = i;
+
+    for (;;) {
+        unsigned int k;
+
+        j = (j + 1) & mask;
+        if (!slots[j].idx) {
+            break;
+        }
+
+        /* Home slot of the item in j. It can be moved to i unless k
+         * is cyclically in (i, j]. */
+        k = slots[j].hash & mask;
+        if ((i <= j) ? (i < k && k <= j) : (i < k || k <= j)) {
+            continue;
+        }
+
+        slots[i] = slots[j];
+        i = j;
+    }
+
+    slots[i].idx = 0;
+}
+
+void
+DFT::rehash(size_t nslots)
+{
+    slots.assign(nslots, Slot());
+    mask = nslots - 1;
+
+    for (size_t idx = 0; idx < records.size(); idx++) {
+        slot_insert(idx, records[idx].hash);
+    }
+}
+
+const DFTRecord *
+DFT::find(const RinaName& appl_name) const
+{
+    unsigned int i = slot_find(appl_name, name_hash(appl_name));
+
+    return i == DFT_SLOT_NONE ? NULL : &records[slots[i].idx - 1];
+}
+
+void
+DFT::set(const DFTEntry& entry)
+{
+    uint32_t hash = name_hash(entry.appl_name);
+    unsigned int i = slot_find(entry.appl_name, hash);
+    DFTRecord *r;
+
+    if (i != DFT_SLOT_NONE) {
+        r = &records[slots[i].idx - 1];
+
+    } else {
+        if ((records.size() + 1) * 2 > slots.size()) {
+            rehash(slots.size() * 2);
+        }
+
+        records.push_back(DFTRecord());
+        r = &records.back();
+        r->appl_name = entry.appl_name;
+        r->hash = hash;
+        slot_insert(records.size() - 1, hash);
+    }
+
+    r->address = entry.address;
+    r->timestamp = entry.timestamp;
+    r->local = entry.local;
+}
+
+bool
+DFT::erase(const RinaName& appl_name)
+{
+    unsigned int i = slot_find(appl_name, name_hash(appl_name));
+    uint32_t idx, last;
+
+    if (i == DFT_SLOT_NONE) {
+        return false;
+    }
+
+    idx = slots[i].idx - 1;
+    last = records.size() - 1;
+    slot_remove(i);
+
+    if (idx != last) {
+        /* Move the last record into the hole, and update the slot
+         * that points to it. */
+        for (i = records[last].hash & mask; slots[i].idx != last + 1;
+                                            i = (i + 1) & mask) {
+        }
+        slots[i].idx = idx + 1;
+        records[idx] = records[last];
+    }
+    records.pop_back();
+
+    if (slots.size() > DFT_SLOTS_MIN && records.size() * 8 < slots.size()) {
+        rehash(slots.size() / 2);
+    }
+
+    return true;
+}
+
+void
+DFT::clear()
+{
+    records.clear();
+    slots.assign(DFT_SLOTS_MIN, Slot());
+    mask = DFT_SLOTS_MIN - 1;
+}
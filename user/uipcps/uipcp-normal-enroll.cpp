@@ -23,7 +23,11 @@
 
 #include <unistd.h>
 #include <cassert>
+#include <ctime>
 #include <pthread.h>
+#ifdef RL_HAVE_ZLIB
+#include <zlib.h>
+#endif /* RL_HAVE_ZLIB */
 
 #include "uipcp-normal.hpp"
 
@@ -33,6 +37,16 @@ using namespace std;
 /* Timeout intervals are expressed in milliseconds. */
 #define NEIGH_KEEPALIVE_INTVAL      5000
 #define NEIGH_KEEPALIVE_THRESH      3
+
+/* Cost of a lower flow: RL_LINK_COST_UNIT for an idle flow with
+ * negligible latency, plus one for each RL_LINK_COST_RTT_US of smoothed
+ * RTT, plus up to RL_LINK_COST_UNIT in proportion to the utilization. */
+#define RL_LINK_COST_UNIT           10
+#define RL_LINK_COST_RTT_US         1000
+/* Peak throughput (bytes per second) below which the utilization is
+ * not taken into account, since the peak is not a meaningful capacity
+ * estimate yet. */
+#define RL_LINK_COST_MIN_PEAK       (1 << 16)
 #define NEIGH_ENROLL_TO             1500
 #define NEIGH_ENROLL_MAX_ATTEMPTS   3
 
@@ -44,8 +58,14 @@ NeighFlow::NeighFlow(Neighbor *n, const string& supdif,
                                   enroll_tmrid(0),
                                   enrollment_state(NEIGH_NONE),
                                   keepalive_tmrid(0),
-                                  pending_keepalive_reqs(0)
+                                  pending_keepalive_reqs(0),
+                                  srtt_us(0), stats_valid(false),
+                                  rate(0), peak_rate(0)
 {
+    memset(&enroll_start, 0, sizeof(enroll_start));
+    memset(&keepalive_sent, 0, sizeof(keepalive_sent));
+    memset(&last_stats, 0, sizeof(last_stats));
+    memset(&last_stats_ts, 0, sizeof(last_stats_ts));
     pthread_cond_init(&enrollment_stopped, NULL);
     assert(neigh);
 }
@@ -76,6 +96,9 @@ NeighFlow::~NeighFlow()
                 flow_fd);
     }
 
+    /* The kernel drops the PDUFT entries pointing to this flow. */
+    neigh->rib->pduft_flow_removed(port_id);
+
     uipcps_lower_flow_removed(neigh->rib->uipcp->uipcps,
                               neigh->rib->uipcp->id,
                               lower_ipcp_id);
@@ -83,11 +106,59 @@ NeighFlow::~NeighFlow()
     pthread_cond_destroy(&enrollment_stopped);
 }
 
+void
+NeighFlow::rtt_sample(unsigned int rtt_us)
+{
+    /* Exponentially weighted moving average, with weight 1/8 for the
+     * new sample as in RFC 6298. */
+    srtt_us = srtt_us ? (7 * srtt_us + rtt_us) / 8 : rtt_us;
+}
+
+void
+NeighFlow::stats_update(const struct rl_flow_stats *stats)
+{
+    struct timespec now;
+    uint64_t us;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    if (stats_valid && stats->tx_byte >= last_stats.tx_byte) {
+        us = (now.tv_sec - last_stats_ts.tv_sec) * 1000000ULL +
+             (now.tv_nsec - last_stats_ts.tv_nsec) / 1000;
+        if (us) {
+            rate = (stats->tx_byte - last_stats.tx_byte) * 1000000ULL / us;
+            /* The peak decays slowly, so that the capacity estimate
+             * follows changes in the lower DIF. */
+            peak_rate -= peak_rate / 16;
+            if (rate > peak_rate) {
+                peak_rate = rate;
+            }
+        }
+    }
+
+    last_stats = *stats;
+    last_stats_ts = now;
+    stats_valid = true;
+}
+
+unsigned int
+NeighFlow::cost() const
+{
+    unsigned int c = RL_LINK_COST_UNIT;
+
+    c += srtt_us / RL_LINK_COST_RTT_US;
+    if (peak_rate >= RL_LINK_COST_MIN_PEAK) {
+        c += (unsigned int)(RL_LINK_COST_UNIT * rate / peak_rate);
+    }
+
+    return c;
+}
+
 int
 NeighFlow::send_to_port_id(CDAPMessage *m, int invoke_id,
                           const UipcpObject *obj) const
 {
-    char objbuf[4096];
+    char objbuf[RL_MGMT_SDU_MAX];
     int objlen;
     char *serbuf = NULL;
     size_t serlen = 0;
@@ -182,8 +253,16 @@ NeighFlow::enrollment_state_set(enroll_state_t st)
 
     enrollment_state = st;
 
+    if (old == NEIGH_NONE && st != NEIGH_NONE) {
+        clock_gettime(CLOCK_MONOTONIC, &enroll_start);
+    }
+
     if (old != NEIGH_ENROLLED && st == NEIGH_ENROLLED) {
         neigh->rib->enrolled ++;
+        neigh->rib->ribsync_stats.enroll_last_ms = ms_since(&enroll_start);
+        UPI(neigh->rib->uipcp, "Enrollment with %s completed in %lu ms\n",
+            static_cast<string>(neigh->ipcp_name).c_str(),
+            neigh->rib->ribsync_stats.enroll_last_ms);
     } else if (old == NEIGH_ENROLLED && st == NEIGH_NONE) {
         neigh->rib->enrolled --;
     }
@@ -213,9 +292,17 @@ keepalive_timeout_cb(struct rl_evloop *loop, void *arg)
         UPE(rib->uipcp, "send_to_port_id() failed\n");
 
     } else {
+        if (nf->pending_keepalive_reqs == 0) {
+            /* Only measure the RTT when a single request is in
+             * flight, so that the response cannot be ambiguous. */
+            clock_gettime(CLOCK_MONOTONIC, &nf->keepalive_sent);
+        }
         nf->pending_keepalive_reqs++;
     }
 
+    /* Refresh the throughput measurements of the flow. */
+    uipcp_flow_stats_req(rib->uipcp, nf->port_id);
+
     if (nf->pending_keepalive_reqs > NEIGH_KEEPALIVE_THRESH) {
         bool delete_neighbor;
         RinaName neigh_name = nf->neigh->ipcp_name;
@@ -228,6 +315,9 @@ keepalive_timeout_cb(struct rl_evloop *loop, void *arg)
             "and therefore will be pruned\n",
             static_cast<string>(neigh_name).c_str(), nf->port_id);
 
+        /* Stop forwarding on this flow right away. */
+        rib->pduft_flow_down(nf->port_id);
+
         nf->neigh->flows.erase(nf->port_id);
 
         if (nf->port_id == nf->neigh->mgmt_port_id && nf->neigh->flows.size())
@@ -306,6 +396,8 @@ Neighbor::Neighbor(struct uipcp_rib *rib_, const struct rina_name *name,
     rib = rib_;
     initiator = initiator_;
     enroll_attempts = 0;
+    adv_cost = 0;
+    memset(&adv_ts, 0, sizeof(adv_ts));
     ipcp_name = RinaName(name);
     memset(enroll_fsm_handlers, 0, sizeof(enroll_fsm_handlers));
     mgmt_port_id = -1;
@@ -386,6 +478,41 @@ Neighbor::mgmt_conn()
     return const_cast<NeighFlow *>(nf);
 }
 
+/* The cost of the lower flow towards this neighbor is the one of its
+ * best N-1 flow. */
+unsigned int
+Neighbor::link_cost() const
+{
+    unsigned int best = 0;
+
+    for (map<rl_port_t, NeighFlow *>::const_iterator mit = flows.begin();
+                                            mit != flows.end(); mit++) {
+        if (mit->second->enrollment_state == NEIGH_ENROLLED) {
+            unsigned int c = mit->second->cost();
+
+            if (!best || c < best) {
+                best = c;
+            }
+        }
+    }
+
+    return best ? best : RL_LINK_COST_UNIT;
+}
+
+/* Port-ids of the N-1 flows towards this neighbor that can be used
+ * to forward PDUs, in ascending order. */
+void
+Neighbor::healthy_ports(vector<rl_port_t>& ports) const
+{
+    ports.clear();
+    for (map<rl_port_t, NeighFlow *>::const_iterator mit = flows.begin();
+                                            mit != flows.end(); mit++) {
+        if (mit->second->enrollment_state == NEIGH_ENROLLED) {
+            ports.push_back(mit->first);
+        }
+    }
+}
+
 int
 Neighbor::none(NeighFlow *nf, const CDAPMessage *rm)
 {
@@ -969,113 +1096,535 @@ int Neighbor::remote_sync_obj(const NeighFlow *nf, bool create,
     return ret;
 }
 
+/* Room (in bytes) reserved for the CDAP header of a RIB synchronization
+ * message, besides object class and name, and for the tag and length of
+ * each entry in the object value. */
+#define RL_RIBSYNC_HDR_ROOM     64
+#define RL_RIBSYNC_ENTRY_ROOM   4
+
+/* Max size of a decompressed batch of RIB synchronization messages. */
+#define RL_RIBSYNC_BATCH_MAX    (16 * RL_MGMT_SDU_MAX)
+
+/* Room (in bytes) for the sync flush marker and the end of a deflated
+ * batch, besides deflateBound(). */
+#define RL_RIBSYNC_ZFLUSH_ROOM  16
+
+#ifdef RL_HAVE_ZLIB
+/* Feed 'in' to the deflate stream 'zs' with the given flush mode
+ * (Z_SYNC_FLUSH or Z_FINISH), appending all the output to 'out'. */
+static int
+zlib_deflate_append(z_stream *zs, const char *in, size_t inlen,
+                    string& out, int flush)
+{
+    char chunk[4096];
+    int ret;
+
+    zs->next_in = reinterpret_cast<Bytef *>(const_cast<char *>(in));
+    zs->avail_in = inlen;
+
+    do {
+        zs->next_out = reinterpret_cast<Bytef *>(chunk);
+        zs->avail_out = sizeof(chunk);
+        ret = deflate(zs, flush);
+        if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+            return -1;
+        }
+        out.append(chunk, sizeof(chunk) - zs->avail_out);
+    } while (zs->avail_out == 0 ||
+             (flush == Z_FINISH && ret != Z_STREAM_END));
+
+    return 0;
+}
+
+static int
+zlib_inflate(const char *in, size_t inlen, string& out, size_t max)
+{
+    char chunk[16384];
+    z_stream zs;
+    int ret;
+
+    memset(&zs, 0, sizeof(zs));
+    if (inflateInit(&zs) != Z_OK) {
+        return -1;
+    }
+
+    zs.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(in));
+    zs.avail_in = inlen;
+    out.clear();
+
+    do {
+        zs.next_out = reinterpret_cast<Bytef *>(chunk);
+        zs.avail_out = sizeof(chunk);
+        ret = inflate(&zs, Z_NO_FLUSH);
+        if (ret != Z_OK && ret != Z_STREAM_END) {
+            break;
+        }
+        out.append(chunk, sizeof(chunk) - zs.avail_out);
+        if (out.size() > max) {
+            ret = Z_BUF_ERROR;
+            break;
+        }
+    } while (ret != Z_STREAM_END);
+
+    inflateEnd(&zs);
+
+    return ret == Z_STREAM_END ? 0 : -1;
+}
+#endif /* RL_HAVE_ZLIB */
+
+/* Packs the RIB entries sent to a neighbor during enrollment into as
+ * few management SDUs as possible. The caller accumulates entries into
+ * a chunk object while fits() is true, and then passes the chunk to
+ * send(). With compression, consecutive chunks are serialized into a
+ * single deflated rib_sync message, as long as it fits an SDU. Each
+ * chunk is fed once to a streaming deflate context (with a sync flush),
+ * so that the compressed size of the batch is always known. */
+struct RibSyncStream {
+    NeighFlow *nf;
+    unsigned int sdu_max;
+    bool compress;
+
+    /* Size and number of entries of the current chunk. */
+    unsigned int chunk_size;
+    unsigned int chunk_entries;
+
+    /* Deflated length-prefixed CDAP messages of the current batch,
+     * their uncompressed size and the size of their object values. */
+    string zbatch;
+    unsigned long batch_len;
+    unsigned int batch_msgs;
+    unsigned long batch_raw;
+#ifdef RL_HAVE_ZLIB
+    z_stream zs;
+    bool zs_ready;
+#endif /* RL_HAVE_ZLIB */
+
+    unsigned int entries;
+    unsigned int msgs;
+    unsigned long bytes;
+    unsigned long raw_bytes;
+
+    vector<char> buf;
+
+    RibSyncStream(NeighFlow *_nf, unsigned int _sdu_max, bool _compress) :
+                        nf(_nf), sdu_max(_sdu_max), compress(_compress),
+                        chunk_size(0), chunk_entries(0), batch_len(0),
+                        batch_msgs(0), batch_raw(0), entries(0), msgs(0),
+                        bytes(0), raw_bytes(0), buf(RL_MGMT_SDU_MAX)
+    {
+#ifdef RL_HAVE_ZLIB
+        memset(&zs, 0, sizeof(zs));
+        zs_ready = compress && deflateInit(&zs, Z_BEST_SPEED) == Z_OK;
+        compress = zs_ready;
+#endif /* RL_HAVE_ZLIB */
+    }
+
+    ~RibSyncStream()
+    {
+#ifdef RL_HAVE_ZLIB
+        if (zs_ready) {
+            deflateEnd(&zs);
+        }
+#endif /* RL_HAVE_ZLIB */
+    }
+
+    unsigned int entry_size(const UipcpObject& obj);
+    bool fits(const string& obj_class, const string& obj_name,
+              unsigned int size) const;
+    void add(unsigned int size);
+    int send(const string& obj_class, const string& obj_name,
+             const UipcpObject *obj);
+    int finish();
+
+private:
+    int send_plain(CDAPMessage *m, unsigned int objlen);
+    int flush_batch();
+};
+
+unsigned int
+RibSyncStream::entry_size(const UipcpObject& obj)
+{
+    int n = obj.serialize(&buf[0], buf.size());
+
+    return n < 0 ? 0 : n + RL_RIBSYNC_ENTRY_ROOM;
+}
+
+bool
+RibSyncStream::fits(const string& obj_class, const string& obj_name,
+                    unsigned int size) const
+{
+    /* A chunk always contains at least one entry. */
+    return chunk_entries == 0 || chunk_size + size + RL_RIBSYNC_HDR_ROOM +
+                    obj_class.size() + obj_name.size() <= sdu_max;
+}
+
+void
+RibSyncStream::add(unsigned int size)
+{
+    chunk_size += size;
+    chunk_entries++;
+    entries++;
+}
+
+int
+RibSyncStream::send_plain(CDAPMessage *m, unsigned int objlen)
+{
+    msgs++;
+    bytes += objlen;
+    raw_bytes += objlen;
+
+    return nf->send_to_port_id(m, 0, NULL);
+}
+
+int
+RibSyncStream::send(const string& obj_class, const string& obj_name,
+                    const UipcpObject *obj)
+{
+    CDAPMessage m;
+    int objlen;
+    int ret = 0;
+
+    chunk_size = chunk_entries = 0;
+
+    objlen = obj->serialize(&buf[0], buf.size());
+    if (objlen < 0) {
+        UPE(nf->neigh->rib->uipcp, "serialization failed\n");
+        return objlen;
+    }
+
+    m.m_create(gpb::F_NO_FLAGS, obj_class, obj_name, 0, 0, "");
+    m.set_obj_value(&buf[0], objlen);
+
+    if (!compress) {
+        return send_plain(&m, objlen);
+    }
+
+#ifdef RL_HAVE_ZLIB
+    {
+        unsigned int room = RL_RIBSYNC_HDR_ROOM + obj_class::ribsync.size() +
+                            obj_name::ribsync.size();
+        char *serbuf = NULL;
+        char lenhdr[4];
+        size_t serlen;
+        size_t len;
+
+        /* Messages inside a batch don't belong to the CDAP session, but
+         * they need an invoke id to be valid. */
+        m.invoke_id = batch_msgs + 1;
+        try {
+            ret = msg_ser_stateless(&m, &serbuf, &serlen);
+        } catch (std::bad_alloc) {
+            ret = -1;
+        }
+        if (ret) {
+            UPE(nf->neigh->rib->uipcp, "message serialization failed\n");
+            if (serbuf) {
+                delete [] serbuf;
+            }
+            return ret;
+        }
+
+        lenhdr[0] = (serlen >> 24) & 0xff;
+        lenhdr[1] = (serlen >> 16) & 0xff;
+        lenhdr[2] = (serlen >> 8) & 0xff;
+        lenhdr[3] = serlen & 0xff;
+        len = sizeof(lenhdr) + serlen;
+
+        if (batch_msgs > 0 && (batch_len + len > RL_RIBSYNC_BATCH_MAX ||
+                    zbatch.size() + deflateBound(&zs, len) +
+                    RL_RIBSYNC_ZFLUSH_ROOM + room > sdu_max)) {
+            /* The message may not fit the current batch: send the
+             * batch and start a new one. */
+            ret |= flush_batch();
+        }
+
+        if (len > RL_RIBSYNC_BATCH_MAX ||
+                zlib_deflate_append(&zs, lenhdr, sizeof(lenhdr), zbatch,
+                                    Z_NO_FLUSH) ||
+                zlib_deflate_append(&zs, serbuf, serlen, zbatch,
+                                    Z_SYNC_FLUSH) ||
+                zbatch.size() + RL_RIBSYNC_ZFLUSH_ROOM + room > sdu_max) {
+            /* Not even the message alone fits (the check above makes
+             * sure this is the first message of the batch), or deflate
+             * failed: send the message as is. */
+            if (batch_msgs > 0) {
+                UPE(nf->neigh->rib->uipcp, "Failed to compress RIB "
+                    "synchronization batch, %u messages lost\n", batch_msgs);
+            }
+            zbatch.clear();
+            batch_len = batch_msgs = batch_raw = 0;
+            deflateReset(&zs);
+            m.invoke_id = 0;
+            ret |= send_plain(&m, objlen);
+        } else {
+            batch_len += len;
+            batch_msgs++;
+            batch_raw += objlen;
+        }
+
+        delete [] serbuf;
+    }
+#endif /* RL_HAVE_ZLIB */
+
+    return ret;
+}
+
+int
+RibSyncStream::flush_batch()
+{
+    CDAPMessage m;
+    int ret;
+
+    if (batch_msgs == 0) {
+        return 0;
+    }
+
+#ifdef RL_HAVE_ZLIB
+    ret = zlib_deflate_append(&zs, NULL, 0, zbatch, Z_FINISH);
+    deflateReset(&zs);
+    if (ret) {
+        UPE(nf->neigh->rib->uipcp, "Failed to compress RIB synchronization "
+            "batch\n");
+    } else
+#endif /* RL_HAVE_ZLIB */
+    {
+        m.m_write(gpb::F_NO_FLAGS, obj_class::ribsync, obj_name::ribsync,
+                  0, 0, "");
+        m.set_obj_value(zbatch.data(), zbatch.size());
+        ret = nf->send_to_port_id(&m, 0, NULL);
+
+        msgs++;
+        bytes += zbatch.size();
+        raw_bytes += batch_raw;
+    }
+
+    zbatch.clear();
+    batch_len = 0;
+    batch_msgs = 0;
+    batch_raw = 0;
+
+    return ret;
+}
+
+int
+RibSyncStream::finish()
+{
+    return flush_batch();
+}
+
 int Neighbor::remote_sync_rib(NeighFlow *nf) const
 {
-    unsigned int limit = 10; /* Hardwired for now, but at least we limit. */
+    RibSyncStream rs(nf, normal_mgmt_params.sdu_max,
+                     normal_mgmt_params.compress);
+    struct timespec t;
     int ret = 0;
 
     UPD(rib->uipcp, "Starting RIB sync with neighbor '%s'\n",
         static_cast<string>(ipcp_name).c_str());
 
+    clock_gettime(CLOCK_MONOTONIC, &t);
+
     {
         /* Synchronize lower flow database. */
-        map< rl_addr_t, map< rl_addr_t, LowerFlow > >::iterator it;
-        map< rl_addr_t, LowerFlow >::iterator jt;
         LowerFlowList lfl;
 
-        it = rib->lfdb.begin();
-        if (it == rib->lfdb.end()) {
-            return 0;
+        for (map< rl_addr_t, map< rl_addr_t, LowerFlow > >::iterator it =
+                rib->lfdb.begin(); it != rib->lfdb.end(); it++) {
+            for (map< rl_addr_t, LowerFlow >::iterator jt =
+                    it->second.begin(); jt != it->second.end(); jt++) {
+                unsigned int size = rs.entry_size(jt->second);
+
+                if (!rs.fits(obj_class::lfdb, obj_name::lfdb, size)) {
+                    ret |= rs.send(obj_class::lfdb, obj_name::lfdb, &lfl);
+                    lfl.flows.clear();
+                }
+                lfl.flows.push_back(jt->second);
+                rs.add(size);
+            }
         }
-        jt = it->second.begin();
-
-        for (;;) {
-                    lfl.flows.push_back(jt->second);
-                    jt ++;
-                    if (jt == it->second.end()) {
-                        if (++it != rib->lfdb.end()) {
-                            jt = it->second.begin();
-                        }
-                    }
-
-                    if (lfl.flows.size() >= limit || it == rib->lfdb.end()) {
-                        ret |= remote_sync_obj(nf, true, obj_class::lfdb,
-                                               obj_name::lfdb, &lfl);
-                        lfl.flows.clear();
-                        if (it == rib->lfdb.end()) {
-                            break;
-                        }
-                    }
+
+        if (!lfl.flows.empty()) {
+            ret |= rs.send(obj_class::lfdb, obj_name::lfdb, &lfl);
         }
     }
 
-    {
-        /* Synchronize Directory Forwarding Table. */
-        for (map< string, DFTEntry >::iterator e = rib->dft.begin();
-                                               e != rib->dft.end();) {
-            DFTSlice dft_slice;
-
-            while (dft_slice.entries.size() < limit && e != rib->dft.end()) {
-                dft_slice.entries.push_back(e->second);
-                e ++;
+    if (!normal_dir_params.replicas) {
+        /* Synchronize Directory Forwarding Table, unless it is
+         * distributed over the home IPCPs. */
+        DFTSlice dft_slice;
+
+        for (DFT::const_iterator e = rib->dft.begin();
+                                        e != rib->dft.end(); e++) {
+            DFTEntry entry = e->entry();
+            unsigned int size = rs.entry_size(entry);
+
+            if (!rs.fits(obj_class::dft, obj_name::dft, size)) {
+                ret |= rs.send(obj_class::dft, obj_name::dft, &dft_slice);
+                dft_slice.entries.clear();
             }
+            dft_slice.entries.push_back(entry);
+            rs.add(size);
+        }
 
-            ret |= remote_sync_obj(nf, true, obj_class::dft, obj_name::dft,
-                                   &dft_slice);
+        if (!dft_slice.entries.empty()) {
+            ret |= rs.send(obj_class::dft, obj_name::dft, &dft_slice);
         }
     }
 
     {
-        bool sent_myself = false;
+        NeighborCandidateList ncl;
+        NeighborCandidate cand;
+        RinaName cand_name;
+
+        /* A neighbor representing myself comes first. */
+        cand_name = RinaName(&rib->uipcp->name);
+        cand.apn = cand_name.apn;
+        cand.api = cand_name.api;
+        cand.address = rib->uipcp->addr;
+        cand.lower_difs = rib->lower_difs;
+        ncl.candidates.push_back(cand);
+        rs.add(rs.entry_size(cand));
 
         /* Scan all the neighbors I know about. */
         for (map<string, NeighborCandidate>::iterator cit =
                 rib->neighbors_seen.begin();
-                cit != rib->neighbors_seen.end();) {
-            NeighborCandidateList ncl;
-
-            if (!sent_myself) {
-                NeighborCandidate cand;
-                RinaName cand_name;
-
-                /* A neighbor representing myself. */
-                cand_name = RinaName(&rib->uipcp->name);
-                cand.apn = cand_name.apn;
-                cand.api = cand_name.api;
-                cand.address = rib->uipcp->addr;
-                cand.lower_difs = rib->lower_difs;
-                ncl.candidates.push_back(cand);
-
-                sent_myself = true;
-            }
+                cit != rib->neighbors_seen.end(); cit++) {
+            unsigned int size = rs.entry_size(cit->second);
 
-            while (ncl.candidates.size() < limit &&
-                            cit != rib->neighbors_seen.end()) {
-                ncl.candidates.push_back(cit->second);
-                cit ++;
+            if (!rs.fits(obj_class::neighbors, obj_name::neighbors, size)) {
+                ret |= rs.send(obj_class::neighbors, obj_name::neighbors,
+                               &ncl);
+                ncl.candidates.clear();
             }
-
-            ret |= remote_sync_obj(nf, true, obj_class::neighbors,
-                                   obj_name::neighbors, &ncl);
+            ncl.candidates.push_back(cit->second);
+            rs.add(size);
         }
+
+        ret |= rs.send(obj_class::neighbors, obj_name::neighbors, &ncl);
     }
 
-    UPD(rib->uipcp, "Finished RIB sync with neighbor '%s'\n",
-        static_cast<string>(ipcp_name).c_str());
+    ret |= rs.finish();
+
+    rib->ribsync_stats.syncs++;
+    rib->ribsync_stats.entries += rs.entries;
+    rib->ribsync_stats.msgs += rs.msgs;
+    rib->ribsync_stats.bytes += rs.bytes;
+    rib->ribsync_stats.raw_bytes += rs.raw_bytes;
+    rib->ribsync_stats.last_ms = ms_since(&t);
+
+    UPD(rib->uipcp, "Finished RIB sync with neighbor '%s': %u entries in "
+        "%u messages, %lu bytes (%lu uncompressed), %lu ms\n",
+        static_cast<string>(ipcp_name).c_str(), rs.entries, rs.msgs,
+        rs.bytes, rs.raw_bytes, rib->ribsync_stats.last_ms);
 
     return ret;
 }
 
+/* A batch of deflated RIB synchronization messages, see RibSyncStream. */
+int
+uipcp_rib::ribsync_handler(const CDAPMessage *rm, NeighFlow *nf)
+{
+    const char *objbuf;
+    size_t objlen;
+    CDAPMessage m;
+
+    if (rm->op_code == gpb::M_WRITE_R) {
+        return 0;
+    }
+
+    if (rm->op_code != gpb::M_WRITE) {
+        UPE(uipcp, "M_WRITE expected\n");
+        return 0;
+    }
+
+    m.m_write_r(gpb::F_NO_FLAGS, 0, string());
+    m.obj_class = obj_class::ribsync;
+    m.obj_name = obj_name::ribsync;
+    if (nf->send_to_port_id(&m, rm->invoke_id, NULL)) {
+        UPE(uipcp, "send_to_port_id() failed\n");
+    }
+
+    rm->get_obj_value(objbuf, objlen);
+    if (!objbuf) {
+        UPE(uipcp, "M_WRITE does not contain a nested message\n");
+        return 0;
+    }
+
+#ifdef RL_HAVE_ZLIB
+    {
+        string batch;
+        size_t ofs = 0;
+
+        if (zlib_inflate(objbuf, objlen, batch, RL_RIBSYNC_BATCH_MAX)) {
+            UPE(uipcp, "Failed to decompress RIB synchronization batch\n");
+            return 0;
+        }
+
+        while (ofs + 4 <= batch.size()) {
+            const unsigned char *p =
+                reinterpret_cast<const unsigned char *>(batch.data() + ofs);
+            size_t len = (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+            CDAPMessage *im;
+
+            ofs += 4;
+            if (len > batch.size() - ofs) {
+                UPE(uipcp, "Truncated RIB synchronization batch\n");
+                break;
+            }
+
+            im = msg_deser_stateless(batch.data() + ofs, len);
+            ofs += len;
+            if (!im || im->op_code != gpb::M_CREATE) {
+                UPE(uipcp, "Invalid message in RIB synchronization batch\n");
+                if (im) {
+                    delete im;
+                }
+                continue;
+            }
+
+            cdap_dispatch(im, nf);
+            delete im;
+        }
+    }
+#else  /* !RL_HAVE_ZLIB */
+    UPE(uipcp, "Compressed RIB synchronization not supported\n");
+#endif /* !RL_HAVE_ZLIB */
+
+    return 0;
+}
+
 void
 sync_timeout_cb(struct rl_evloop *loop, void *arg)
 {
     uipcp_rib *rib = static_cast<uipcp_rib *>(arg);
     ScopeLock(rib->lock);
-    CDAPMessage m;
+    time_t now = mono_secs();
 
     UPV(rib->uipcp, "Syncing lower flows with neighbors\n");
 
-    rib->remote_refresh_lower_flows();
+    /* Our own entries are re-originated only once in a while, to
+     * refresh their age in the other IPCPs. */
+    if (now - rib->lfdb_refreshed >= RL_LFDB_REFRESH_INTVAL) {
+        rib->remote_refresh_lower_flows();
+        rib->lfdb_refreshed = now;
+    }
+
+    if (normal_dir_params.replicas &&
+            now - rib->dft_refreshed >= RL_DFT_REFRESH_INTVAL) {
+        rib->dft_refresh();
+        rib->dft_refreshed = now;
+    }
+
+    /* Exchange the LFDB summaries, so that only the missing or stale
+     * entries are transferred. */
+    for (map<string, Neighbor*>::iterator neigh = rib->neighbors.begin();
+                        neigh != rib->neighbors.end(); neigh++) {
+        if (neigh->second->has_mgmt_flow() &&
+                neigh->second->enrollment_complete()) {
+            rib->lfdb_summary_send(neigh->second->mgmt_conn());
+        }
+    }
+
     rib->sync_tmrid = rl_evloop_schedule(&rib->uipcp->loop,
 					 RL_NEIGH_SYNC_INTVAL * 1000,
                                          sync_timeout_cb, rib);
@@ -1287,6 +1836,16 @@ uipcp_rib::keepalive_handler(const CDAPMessage *rm, NeighFlow *nf)
     }
 
     if (rm->op_code == gpb::M_READ_R) {
+        if (nf->pending_keepalive_reqs == 1) {
+            struct timespec now;
+
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            nf->rtt_sample((now.tv_sec - nf->keepalive_sent.tv_sec) *
+                            1000000U + (now.tv_nsec -
+                            nf->keepalive_sent.tv_nsec) / 1000);
+            lower_flow_cost_update(*nf->neigh);
+        }
+
         /* Reset the keepalive request counter, we know the neighbor
          * is alive on this flow. */
         nf->pending_keepalive_reqs = 0;
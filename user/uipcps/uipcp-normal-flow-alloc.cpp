@@ -28,6 +28,33 @@
 using namespace std;
 
 
+/* Sender congestion control algorithms, indexed by RL_CC_*, carried as
+ * the name of the transmission control policy. */
+static const char *cong_ctrl_names[] = { "", "aimd", "cubic" };
+
+static string
+cong_ctrl_name(uint8_t cong_ctrl)
+{
+    if (cong_ctrl < sizeof(cong_ctrl_names) / sizeof(cong_ctrl_names[0])) {
+        return cong_ctrl_names[cong_ctrl];
+    }
+
+    return string();
+}
+
+static uint8_t
+cong_ctrl_id(const string& name)
+{
+    for (uint8_t i = 0; i < sizeof(cong_ctrl_names) /
+                                sizeof(cong_ctrl_names[0]); i++) {
+        if (name == cong_ctrl_names[i]) {
+            return i;
+        }
+    }
+
+    return RL_CC_NONE;
+}
+
 /* Translate a local flow configuration into the standard
  * representation to be used in the FlowRequest CDAP
  * message. */
@@ -35,6 +62,7 @@ static void
 flowcfg2policies(const struct rl_flow_config *cfg,
                  QosSpec &q, ConnPolicies& p)
 {
+    q.qos_id = cfg->qos_id;
     q.partial_delivery = cfg->partial_delivery;
     /* req->flowcfg.incomplete_delivery ? */
     q.in_order_delivery = cfg->in_order_delivery;
@@ -53,6 +81,8 @@ flowcfg2policies(const struct rl_flow_config *cfg,
                         cfg->dtcp.fc.cfg.w.max_cwq_len;
         p.dtcp_cfg.flow_ctrl_cfg.win.initial_credit =
                         cfg->dtcp.fc.cfg.w.initial_credit;
+        p.dtcp_cfg.flow_ctrl_cfg.win.tx_ctrl.name =
+                        cong_ctrl_name(cfg->dtcp.fc.cfg.w.cong_ctrl);
 
     } else if (cfg->dtcp.fc.fc_type == RLITE_FC_T_RATE) {
         p.dtcp_cfg.flow_ctrl_cfg.rate.sending_rate =
@@ -75,6 +105,7 @@ static void
 policies2flowcfg(struct rl_flow_config *cfg,
                  const QosSpec &q, const ConnPolicies& p)
 {
+    cfg->qos_id = q.qos_id;
     cfg->partial_delivery = q.partial_delivery;
     cfg->in_order_delivery = q.in_order_delivery;
     cfg->max_sdu_gap = q.max_sdu_gap;
@@ -92,6 +123,8 @@ policies2flowcfg(struct rl_flow_config *cfg,
                         p.dtcp_cfg.flow_ctrl_cfg.win.max_cwq_len;
         cfg->dtcp.fc.cfg.w.initial_credit =
                         p.dtcp_cfg.flow_ctrl_cfg.win.initial_credit;
+        cfg->dtcp.fc.cfg.w.cong_ctrl =
+                        cong_ctrl_id(p.dtcp_cfg.flow_ctrl_cfg.win.tx_ctrl.name);
 
     } else if (cfg->dtcp.fc.fc_type == RLITE_FC_T_RATE) {
         cfg->dtcp.fc.cfg.r.sending_rate =
@@ -128,9 +161,11 @@ flowspec2flowcfg(struct rl_flow_spec *spec, struct rl_flow_config *cfg)
         cfg->dtcp.initial_a = RL_A_MSECS_DFLT;
     }
 
-    /* Delay and jitter ignored for now. */
-    (void)spec->max_delay;
-    (void)spec->max_jitter;
+    /* Delay and jitter bounds are only used to ask the RMTs for low
+     * latency scheduling. */
+    if (spec->max_delay || spec->max_jitter) {
+        cfg->qos_id = RL_QOS_ID_LOW_LATENCY;
+    }
 
     if (spec->flow_control) {
         /* This is temporary used to test flow control */
@@ -138,6 +173,7 @@ flowspec2flowcfg(struct rl_flow_spec *spec, struct rl_flow_config *cfg)
         cfg->dtcp.flow_control = 1;
         cfg->dtcp.fc.cfg.w.max_cwq_len = 100;
         cfg->dtcp.fc.cfg.w.initial_credit = 60;
+        cfg->dtcp.fc.cfg.w.cong_ctrl = RL_CC_AIMD;
         cfg->dtcp.fc.fc_type = RLITE_FC_T_WIN;
         cfg->dtcp.initial_a = RL_A_MSECS_DFLT;
     }
@@ -154,16 +190,14 @@ uipcp_rib::fa_req(struct rl_kmsg_fa_req *req)
 {
     RinaName dest_appl(&req->remote_appl);
     rl_addr_t remote_addr;
-    CDAPMessage *m;
     FlowRequest freq;
     ConnId conn_id;
-    stringstream obj_name;
     string cubename;
     struct rl_flow_config flowcfg;
     int ret;
 
     ret = dft_lookup(dest_appl, remote_addr);
-    if (ret) {
+    if (ret && !normal_dir_params.replicas) {
         /* Return a negative flow allocation response immediately. */
         UPI(uipcp, "No DFT matching entry for destination %s\n",
                 static_cast<string>(dest_appl).c_str());
@@ -184,7 +218,7 @@ uipcp_rib::fa_req(struct rl_kmsg_fa_req *req)
     freq.src_port = req->local_port;
     freq.dst_port = 0;
     freq.src_addr = uipcp->addr;
-    freq.dst_addr = remote_addr;
+    freq.dst_addr = 0;
     freq.connections.push_back(conn_id);
     freq.cur_conn_idx = 0;
     freq.state = true;
@@ -217,8 +251,27 @@ uipcp_rib::fa_req(struct rl_kmsg_fa_req *req)
     freq.create_flow_retries = 0;
     freq.hop_cnt = 0;
 
+    if (ret) {
+        /* The destination is not in the local directory: ask its home
+         * IPCPs, the request is sent when the answer comes. */
+        return dft_query(freq);
+    }
+
+    freq.dst_addr = remote_addr;
+
+    return fa_req_send(freq);
+}
+
+/* Send the M_CREATE for a flow request whose destination address has
+ * been resolved. */
+int
+uipcp_rib::fa_req_send(FlowRequest& freq)
+{
+    stringstream obj_name;
+    CDAPMessage *m;
+
     obj_name << obj_name::flows << "/" << freq.src_addr
-                << "-" << req->local_port;
+                << "-" << freq.src_port;
 
     m = new CDAPMessage();
     m->m_create(gpb::F_NO_FLAGS, obj_class::flow, obj_name.str(),
@@ -384,6 +437,11 @@ uipcp_rib::flows_handler_create_r(const CDAPMessage *rm)
 
     FlowRequest& freq = f->second;
 
+    if (rm->result && normal_dir_params.replicas) {
+        /* The cached location of the destination may be stale. */
+        dft_cache_del(freq.dst_app);
+    }
+
     /* Update the local freq object with the remote one. */
     freq.dst_port = remote_freq.dst_port;
     freq.connections.front().dst_cep = remote_freq.connections.front().dst_cep;
@@ -21,7 +21,9 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
  */
 
-#include <climits>
+#include <vector>
+#include <algorithm>
+#include <ctime>
 
 #include "uipcp-normal.hpp"
 
@@ -60,6 +62,16 @@ uipcp_rib::lfdb_add(const LowerFlow &lf)
     LowerFlow lfz = lf;
 
     lfz.age = 0;
+    lfz.refreshed = mono_secs();
+    spe.lfdb_changed(lf.local_addr, lf.remote_addr);
+
+    if (lf.local_addr != uipcp->addr) {
+        /* Entries generated by me don't age, we pretend they are
+         * always refreshed. */
+        lfdb_expiry.insert(make_pair(lfz.refreshed + RL_AGE_MAX,
+                           make_pair(lf.local_addr, lf.remote_addr)));
+        lfdb_age_arm();
+    }
 
     if (it == lfdb.end()) {
         lfdb[lf.local_addr][lf.remote_addr] = lfz;
@@ -87,13 +99,24 @@ uipcp_rib::lfdb_del(rl_addr_t local_addr, rl_addr_t remote_addr)
     }
 
     it->second.erase(jt);
+    spe.lfdb_changed(local_addr, remote_addr);
 }
 
+/* Hysteresis for the re-advertisement of the cost of our lower flows:
+ * the new cost must differ from the advertised one by more than
+ * RL_LINK_COST_HYST_PCT percent (and at least RL_LINK_COST_HYST_MIN),
+ * and at least RL_LINK_COST_HOLD ms must have passed since the last
+ * advertisement. */
+#define RL_LINK_COST_HYST_PCT   25
+#define RL_LINK_COST_HYST_MIN   2
+#define RL_LINK_COST_HOLD       15000
+
 int
-uipcp_rib::commit_lower_flow(rl_addr_t local_addr, const Neighbor& neigh)
+uipcp_rib::commit_lower_flow(rl_addr_t local_addr, Neighbor& neigh)
 {
     LowerFlow lf;
     rl_addr_t remote_addr = lookup_neighbor_address(neigh.ipcp_name);
+    LowerFlow *cur;
     int ret;
 
     if (remote_addr == 0) {
@@ -103,14 +126,22 @@ uipcp_rib::commit_lower_flow(rl_addr_t local_addr, const Neighbor& neigh)
     }
 
     /* Insert the lower flow in the database. */
+    cur = lfdb_find(local_addr, remote_addr);
     lf.local_addr = local_addr;
     lf.remote_addr = remote_addr;
-    lf.cost = 1;
-    lf.seqnum = 1;
+    lf.cost = neigh.link_cost();
+    /* Bump the sequence number, so that the other IPCPs replace the
+     * entry they already have. */
+    lf.seqnum = cur ? cur->seqnum + 1 : 1;
     lf.state = true;
     lf.age = 0;
     lfdb_add(lf);
 
+    if (local_addr == uipcp->addr) {
+        neigh.adv_cost = lf.cost;
+        clock_gettime(CLOCK_MONOTONIC, &neigh.adv_ts);
+    }
+
     LowerFlowList lfl;
 
     /* Send the new lower flow to the other neighbors. */
@@ -119,12 +150,69 @@ uipcp_rib::commit_lower_flow(rl_addr_t local_addr, const Neighbor& neigh)
                                     obj_name::lfdb, &lfl);
 
     /* Update the routing table. */
-    spe.run(uipcp->addr, this);
-    pduft_sync();
+    spf_schedule();
 
     return ret;
 }
 
+/* Re-advertise the cost of our lower flow towards a neighbor if it
+ * changed significantly since the last advertisement. */
+void
+uipcp_rib::lower_flow_cost_update(Neighbor& neigh)
+{
+    unsigned int cost = neigh.link_cost();
+    unsigned int diff;
+    LowerFlow *lf;
+
+    if (!neigh.adv_cost || !neigh.enrollment_complete()) {
+        /* Not advertised yet. */
+        return;
+    }
+
+    diff = cost > neigh.adv_cost ? cost - neigh.adv_cost :
+                                   neigh.adv_cost - cost;
+    if (diff < RL_LINK_COST_HYST_MIN ||
+            diff * 100 <= neigh.adv_cost * RL_LINK_COST_HYST_PCT ||
+            ms_since(&neigh.adv_ts) < RL_LINK_COST_HOLD) {
+        return;
+    }
+
+    UPD(uipcp, "Cost of lower flow towards %s changes %u --> %u\n",
+        static_cast<string>(neigh.ipcp_name).c_str(), neigh.adv_cost,
+        cost);
+
+    commit_lower_flow(uipcp->addr, neigh);
+
+    /* commit_lower_flow() does not send the update to the neighbor
+     * itself, so do it here. */
+    lf = lfdb_find(uipcp->addr, lookup_neighbor_address(neigh.ipcp_name));
+    if (lf) {
+        LowerFlowList lfl;
+
+        lfl.flows.push_back(*lf);
+        neigh.remote_sync_obj(neigh.mgmt_conn(), true, obj_class::lfdb,
+                              obj_name::lfdb, &lfl);
+    }
+}
+
+/* Called when the kernel reports the statistics of an N-1 flow. */
+void
+uipcp_rib::flow_stats_update(rl_port_t port_id,
+                             const struct rl_flow_stats *stats)
+{
+    for (map<string, Neighbor*>::iterator neigh = neighbors.begin();
+                                    neigh != neighbors.end(); neigh++) {
+        map<rl_port_t, NeighFlow *>::iterator f =
+                                    neigh->second->flows.find(port_id);
+
+        if (f != neigh->second->flows.end()) {
+            f->second->stats_update(stats);
+            lower_flow_cost_update(*neigh->second);
+            return;
+        }
+    }
+}
+
 int
 uipcp_rib::lfdb_handler(const CDAPMessage *rm, NeighFlow *nf)
 {
@@ -149,11 +237,21 @@ uipcp_rib::lfdb_handler(const CDAPMessage *rm, NeighFlow *nf)
     }
 
     LowerFlowList lfl(objbuf, objlen);
+
+    lfdb_update(lfl, add, nf);
+
+    return 0;
+}
+
+/* Merge a list of LFDB entries received from a neighbor, and flood
+ * the ones that changed our LFDB to the other neighbors. */
+void
+uipcp_rib::lfdb_update(const LowerFlowList& lfl, bool add, NeighFlow *nf)
+{
     LowerFlowList prop_lfl;
-    RinaName my_name = RinaName(&uipcp->name);
     bool modified = false;
 
-    for (list<LowerFlow>::iterator f = lfl.flows.begin();
+    for (list<LowerFlow>::const_iterator f = lfl.flows.begin();
                                 f != lfl.flows.end(); f++) {
         string key = static_cast<string>(*f);
         LowerFlow *lf = lfdb_find(f->local_addr, f->remote_addr);
@@ -188,223 +286,619 @@ uipcp_rib::lfdb_handler(const CDAPMessage *rm, NeighFlow *nf)
                                   obj_name::lfdb, &prop_lfl);
 
         /* Update the routing table. */
-        spe.run(uipcp->addr, this);
-        pduft_sync();
+        spf_schedule();
     }
+}
 
-    return 0;
+static void
+spf_timeout_cb(struct rl_evloop *loop, void *arg)
+{
+    struct uipcp_rib *rib = (struct uipcp_rib *)arg;
+    ScopeLock lock_(rib->lock);
+
+    rib->spf_tmrid = 0;
+    rib->spf_run();
 }
 
-int
-SPEngine::run(rl_addr_t local_addr, struct uipcp_rib *rib)
+/* Update the routing table and the PDUFT. */
+void
+uipcp_rib::spf_run()
 {
-    /* Clean up state left from the previous run. */
-    next_hops.clear();
-    graph.clear();
-    info.clear();
-
-    /* Build the graph from the Lower Flow Database. */
-    for (map<rl_addr_t, map<rl_addr_t, LowerFlow > >::const_iterator it
-                = rib->lfdb.begin(); it != rib->lfdb.end(); it++) {
-        for (map<rl_addr_t, LowerFlow>::const_iterator jt
-                    = it->second.begin(); jt != it->second.end(); jt++) {
-            const LowerFlow *revlf;
-
-            revlf = rib->lfdb_find(jt->second.local_addr,
-                                   jt->second.remote_addr);
-
-            if (revlf == NULL || revlf->cost != jt->second.cost) {
-                /* Something is wrong, this could be malicious or erroneous. */
-                continue;
-            }
+    spe.run(uipcp->addr, this);
+    pduft_sync();
+    clock_gettime(CLOCK_MONOTONIC, &spf_last);
+    spf_stats.runs++;
+}
 
-            graph[jt->second.local_addr].push_back(Edge(jt->second.remote_addr,
-                        jt->second.cost));
-        }
+/* Schedule a routing table computation after an LFDB change, throttling
+ * computations in the style of OSPF SPF throttling. After a quiet
+ * period the computation runs after the initial delay. Further
+ * computations are spaced by the hold time, which doubles each time up
+ * to the maximum, and is reset once a whole maximum hold time passes
+ * without computations. All the changes that arrive while a computation
+ * is pending are coalesced into it. */
+void
+uipcp_rib::spf_schedule()
+{
+    const struct uipcp_spf_params *params = &normal_spf_params;
+    unsigned long delay = params->initial_delay;
+    unsigned long elapsed;
+
+    spf_stats.requests++;
+
+    if (spf_tmrid > 0) {
+        /* A computation is already pending. */
+        return;
     }
 
-#if 1
-    PV_S("Graph [%lu]:\n", rib->lfdb.size());
-    for (map<rl_addr_t, list<Edge> >::iterator g = graph.begin();
-                                            g != graph.end(); g++) {
-        PV_S("%lu: {", (long unsigned)g->first);
-        for (list<Edge>::iterator l = g->second.begin();
-                                    l != g->second.end(); l++) {
-            PV_S("(%lu, %u), ", (long unsigned)l->to, l->cost);
+    elapsed = ms_since(&spf_last);
+    if (spf_stats.runs == 0 || elapsed >= params->max_hold) {
+        spf_hold = params->hold;
+    } else {
+        if (elapsed < spf_hold && spf_hold - elapsed > delay) {
+            delay = spf_hold - elapsed;
         }
-        PV_S("}\n");
+        spf_hold = min(spf_hold * 2, params->max_hold);
     }
-#endif
 
-    /* Initialize the per-node info map. */
-    for (map<rl_addr_t, list<Edge> >::iterator g = graph.begin();
-                                            g != graph.end(); g++) {
-        struct Info inf;
+    spf_tmrid = rl_evloop_schedule(&uipcp->loop, delay, spf_timeout_cb,
+                                   this);
+    if (spf_tmrid <= 0) {
+        UPE(uipcp, "Failed to schedule SPF, running it now\n");
+        spf_tmrid = 0;
+        spf_run();
+        return;
+    }
+
+    UPV(uipcp, "SPF scheduled in %lu ms\n", delay);
+}
 
-        inf.dist = UINT_MAX;
-        inf.visited = false;
+/* Append to 'set' the kernel entries for destination 'dst'. */
+static void
+pduft_route_entries(rl_addr_t dst, const PduftRoute& route,
+                    vector<struct rl_pduft_mod_entry>& set)
+{
+    struct rl_pduft_mod_entry e;
 
-        info[g->first] = inf;
+    e.dst_addr = dst;
+    e.flags = 0;
+    for (unsigned int i = 0; i < route.ports.size(); i++) {
+        e.local_port = route.ports[i];
+        set.push_back(e);
     }
-    info[local_addr].dist = 0;
 
-    for (;;) {
-        rl_addr_t min = UINT_MAX;
-        unsigned int min_dist = UINT_MAX;
+    if (route.has_backup) {
+        e.local_port = route.backup;
+        e.flags = RL_PDUFT_F_BACKUP;
+        set.push_back(e);
+    }
+}
+
+int
+uipcp_rib::pduft_sync()
+{
+    map<rl_addr_t, vector<rl_port_t> > next_hop_to_ports;
+    map<rl_addr_t, PduftRoute> next_pduft;
+    vector<struct rl_pduft_mod_entry> set;
+    vector<rl_addr_t> del;
+    unsigned int added = 0, updated = 0, unchanged = 0;
+    unsigned int backups = 0;
+    int ret;
+
+    /* Precompute the port-ids corresponding to all the possible
+     * next-hops (primary and backup). All the enrolled N-1 flows
+     * towards a neighbor are used, so that the kernel spreads the
+     * traffic across them. */
+    for (map<rl_addr_t, vector<rl_addr_t> >::iterator r =
+            spe.next_hops.begin(); r != spe.next_hops.end(); r++) {
+        vector<rl_addr_t> hops = r->second;
+        map<rl_addr_t, rl_addr_t>::iterator b =
+                                        spe.backup_hops.find(r->first);
+
+        if (b != spe.backup_hops.end()) {
+            hops.push_back(b->second);
+        }
+
+        for (unsigned int i = 0; i < hops.size(); i++) {
+            rl_addr_t next_hop = hops[i];
+            map<string, Neighbor*>::iterator neigh;
+            vector<rl_port_t> ports;
+            string neigh_name;
+
+            if (next_hop_to_ports.count(next_hop)) {
+                continue;
+            }
+
+            neigh_name = static_cast<string>(
+                                    lookup_neighbor_by_address(next_hop));
+            if (neigh_name == string()) {
+                UPE(uipcp, "Could not find neighbor with address %lu\n",
+                        (long unsigned)next_hop);
+                continue;
+            }
+
+            neigh = neighbors.find(neigh_name);
+
+            if (neigh == neighbors.end()) {
+                UPE(uipcp, "Could not find neighbor with name %s\n",
+                        neigh_name.c_str());
+                continue;
+            }
+
+            assert(neigh->second->has_mgmt_flow());
+            neigh->second->healthy_ports(ports);
+            if (ports.empty()) {
+                /* No enrolled flows yet, fall back to the mgmt one. */
+                ports.push_back(neigh->second->mgmt_conn()->port_id);
+            }
+            next_hop_to_ports[next_hop].swap(ports);
+        }
+    }
 
-        /* Select the closest node from the ones in the frontier. */
-        for (map<rl_addr_t, Info>::iterator i = info.begin();
-                                        i != info.end(); i++) {
-            if (!i->second.visited && i->second.dist < min_dist) {
-                min = i->first;
-                min_dist = i->second.dist;
+    /* Generate the new PDUFT entries, merging the N-1 flows of all the
+     * equal-cost next hops. The port sets are sorted, deduplicated and
+     * capped to the kernel limit. The backup is the first N-1 flow
+     * towards the loop-free alternate that is not a primary one. */
+    for (map<rl_addr_t, vector<rl_addr_t> >::iterator r =
+            spe.next_hops.begin(); r != spe.next_hops.end(); r++) {
+        map<rl_addr_t, rl_addr_t>::iterator b =
+                                        spe.backup_hops.find(r->first);
+        map<rl_addr_t, vector<rl_port_t> >::iterator p;
+        PduftRoute route;
+
+        for (unsigned int i = 0; i < r->second.size(); i++) {
+            p = next_hop_to_ports.find(r->second[i]);
+            if (p != next_hop_to_ports.end()) {
+                route.ports.insert(route.ports.end(), p->second.begin(),
+                                   p->second.end());
             }
         }
 
-        if (min_dist == UINT_MAX) {
-            break;
+        if (route.ports.empty()) {
+            continue;
         }
 
-        assert(min != UINT_MAX);
+        sort(route.ports.begin(), route.ports.end());
+        route.ports.erase(unique(route.ports.begin(), route.ports.end()),
+                          route.ports.end());
+        if (route.ports.size() > RLITE_PDUFT_ECMP_MAX) {
+            route.ports.resize(RLITE_PDUFT_ECMP_MAX);
+        }
 
-        PV_S("Selecting node %lu\n", (long unsigned)min);
+        if (b != spe.backup_hops.end() &&
+                (p = next_hop_to_ports.find(b->second)) !=
+                                        next_hop_to_ports.end()) {
+            for (unsigned int i = 0; i < p->second.size(); i++) {
+                if (!binary_search(route.ports.begin(), route.ports.end(),
+                                   p->second[i])) {
+                    route.backup = p->second[i];
+                    route.has_backup = true;
+                    backups++;
+                    break;
+                }
+            }
+        }
 
-        list<Edge>& edges = graph[min];
-        Info& info_min = info[min];
+        next_pduft[r->first] = route;
+    }
 
-        info_min.visited = true;
+    /* Compare with the entries currently installed in the kernel, and
+     * collect the entries to be added (or updated) and removed. The
+     * kernel replaces the whole multipath set of each destination
+     * listed in 'set'. */
+    for (map<rl_addr_t, PduftRoute>::iterator n = next_pduft.begin();
+                                        n != next_pduft.end(); n++) {
+        map<rl_addr_t, PduftRoute>::iterator o = pduft.find(n->first);
 
-        for (list<Edge>::iterator edge = edges.begin();
-                                edge != edges.end(); edge++) {
-            Info& info_to = info[edge->to];
+        if (o != pduft.end() && o->second == n->second) {
+            unchanged++;
+            continue;
+        }
 
-            if (info_to.dist > info_min.dist + edge->cost) {
-                info_to.dist = info_min.dist + edge->cost;
-                next_hops[edge->to] = (min == local_addr) ? edge->to :
-                                                    next_hops[min];
-            }
+        if (o == pduft.end()) {
+            added++;
+        } else {
+            updated++;
         }
+        pduft_route_entries(n->first, n->second, set);
+        UPV(uipcp, "Set PDUFT entry %lu --> %u (%u paths%s)\n",
+            (long unsigned)n->first, n->second.ports[0],
+            (unsigned int)n->second.ports.size(),
+            n->second.has_backup ? ", with backup" : "");
     }
 
-    PV_S("Dijkstra result:\n");
-    for (map<rl_addr_t, Info>::iterator i = info.begin();
-                                    i != info.end(); i++) {
-        PV_S("    Address: %lu, Dist: %u, Visited %u\n",
-                (long unsigned)i->first, i->second.dist,
-                (i->second.visited));
+    for (map<rl_addr_t, PduftRoute>::iterator o = pduft.begin();
+                                        o != pduft.end(); o++) {
+        if (!next_pduft.count(o->first)) {
+            del.push_back(o->first);
+            UPV(uipcp, "Remove PDUFT entry %lu\n", (long unsigned)o->first);
+        }
     }
 
-    PV_S("Routing table:\n");
-    for (map<rl_addr_t, rl_addr_t>::iterator h = next_hops.begin();
-                                        h != next_hops.end(); h++) {
-        PV_S("    Address: %lu, Next hop: %lu\n",
-             (long unsigned)h->first, (long unsigned)h->second);
+    if (pduft_stats.syncs == 0 || !set.empty() || !del.empty()) {
+        /* The first time we replace the whole kernel table, since we
+         * don't know what is in there. The kernel applies the changes
+         * in a single step, so forwarding never sees a partially
+         * updated table. */
+        ret = uipcp_pduft_mod(uipcp, uipcp->id, pduft_stats.syncs == 0,
+                              set.empty() ? NULL : &set[0], set.size(),
+                              del.empty() ? NULL : &del[0], del.size());
+        if (ret) {
+            /* The kernel table has not been modified. */
+            UPE(uipcp, "Failed to update PDUFT [%u set, %u del]\n",
+                (unsigned int)set.size(), (unsigned int)del.size());
+            return ret;
+        }
     }
 
+    pduft.swap(next_pduft);
+    pduft_stats.syncs++;
+    pduft_stats.added += added;
+    pduft_stats.updated += updated;
+    pduft_stats.removed += del.size();
+    pduft_stats.unchanged += unchanged;
+    pduft_stats.backups = backups;
+
+    UPD(uipcp, "PDUFT sync: %u added, %u updated, %u removed, "
+        "%u unchanged, %u with backup\n", added, updated,
+        (unsigned int)del.size(), unchanged, backups);
+
     return 0;
 }
 
-int
-uipcp_rib::pduft_sync()
+/* Remove 'port_id' from a route, returning true if it was there. */
+static bool
+pduft_route_remove_port(PduftRoute& route, rl_port_t port_id)
 {
-    map<rl_addr_t, rl_port_t> next_hop_to_port_id;
+    vector<rl_port_t>::iterator p = find(route.ports.begin(),
+                                         route.ports.end(), port_id);
+    bool found = false;
 
-    /* Flush previous entries. */
-    uipcp_pduft_flush(uipcp, uipcp->id);
+    if (p != route.ports.end()) {
+        route.ports.erase(p);
+        found = true;
+    }
+    if (route.has_backup && route.backup == port_id) {
+        route.has_backup = false;
+        found = true;
+    }
 
-    /* Precompute the port-ids corresponding to all the possible
-     * next-hops. */
-    for (map<rl_addr_t, rl_addr_t>::iterator r = spe.next_hops.begin();
-                                        r !=  spe.next_hops.end(); r++) {
-        map<string, Neighbor*>::iterator neigh;
-        string neigh_name;
+    return found;
+}
 
-        if (next_hop_to_port_id.count(r->second)) {
-            continue;
-        }
+/* Called when an N-1 flow is declared dead, to move the traffic to
+ * the remaining N-1 flows of the multipath sets (or to the backup ones)
+ * without waiting for the next routing computation. The kernel does the
+ * same on its own as soon as the flow is deallocated; this also covers
+ * the destinations that are left without a route. */
+int
+uipcp_rib::pduft_flow_down(rl_port_t port_id)
+{
+    vector<struct rl_pduft_mod_entry> set;
+    vector<rl_addr_t> del;
+    int ret;
 
-        neigh_name = static_cast<string>(
-                                lookup_neighbor_by_address(r->second));
-        if (neigh_name == string()) {
-            UPE(uipcp, "Could not find neighbor with address %lu\n",
-                    (long unsigned)r->second);
+    for (map<rl_addr_t, PduftRoute>::iterator o = pduft.begin();
+                                        o != pduft.end(); o++) {
+        PduftRoute route = o->second;
+
+        if (!pduft_route_remove_port(route, port_id)) {
             continue;
         }
 
-        neigh = neighbors.find(neigh_name);
-
-        if (neigh == neighbors.end()) {
-            UPE(uipcp, "Could not find neighbor with name %s\n",
-                    neigh_name.c_str());
-            continue;
+        if (route.ports.empty() && !route.has_backup) {
+            del.push_back(o->first);
+        } else {
+            pduft_route_entries(o->first, route, set);
         }
+    }
 
-        /* Just take one for now. */
-        assert(neigh->second->has_mgmt_flow());
-        next_hop_to_port_id[r->second] = neigh->second->mgmt_conn()->port_id;
+    if (set.empty() && del.empty()) {
+        return 0;
     }
 
-    /* Generate PDUFT entries. */
-    for (map<rl_addr_t, rl_addr_t>::iterator r = spe.next_hops.begin();
-                                        r !=  spe.next_hops.end(); r++) {
-            rl_port_t port_id = next_hop_to_port_id[r->second];
-            int ret = uipcp_pduft_set(uipcp, uipcp->id, r->first,
-                                      port_id);
-            if (ret) {
-                UPE(uipcp, "Failed to insert %lu --> %u PDUFT entry\n",
-                    (long unsigned)r->first, port_id);
-            } else {
-                UPV(uipcp, "Add PDUFT entry %lu --> %u\n",
-                    (long unsigned)r->first, port_id);
-            }
+    ret = uipcp_pduft_mod(uipcp, uipcp->id, 0,
+                          set.empty() ? NULL : &set[0], set.size(),
+                          del.empty() ? NULL : &del[0], del.size());
+    if (ret) {
+        UPE(uipcp, "Failed to remove port %u from the PDUFT\n", port_id);
+        return ret;
     }
 
+    pduft_flow_removed(port_id);
+    pduft_stats.failovers++;
+
+    UPD(uipcp, "PDUFT failover: port %u removed [%u entries set, "
+        "%u removed]\n", port_id, (unsigned int)set.size(),
+        (unsigned int)del.size());
+
     return 0;
 }
 
+/* Called when a lower flow is deallocated: the kernel has already
+ * removed the PDUFT entries pointing to it. */
 void
-age_incr_cb(struct rl_evloop *loop, void *arg)
+uipcp_rib::pduft_flow_removed(rl_port_t port_id)
+{
+    for (map<rl_addr_t, PduftRoute>::iterator o = pduft.begin();
+                                        o != pduft.end();) {
+        pduft_route_remove_port(o->second, port_id);
+        if (o->second.ports.empty() && !o->second.has_backup) {
+            pduft.erase(o++);
+        } else {
+            o++;
+        }
+    }
+}
+
+static void
+lfdb_age_cb(struct rl_evloop *loop, void *arg)
 {
     struct uipcp_rib *rib = (struct uipcp_rib *)arg;
-    ScopeLock(rib->lock);
+    ScopeLock lock_(rib->lock);
+
+    rib->lfdb_age_tmrid = 0;
+    rib->lfdb_age_expire();
+}
+
+/* Arm the aging timer for the earliest expiration deadline, unless it
+ * is already armed. Deadlines are inserted in increasing order, so an
+ * armed timer never needs to be moved earlier. */
+void
+uipcp_rib::lfdb_age_arm()
+{
+    time_t now, deadline;
+
+    if (lfdb_age_tmrid > 0 || lfdb_expiry.empty()) {
+        return;
+    }
+
+    now = mono_secs();
+    deadline = lfdb_expiry.begin()->first;
+    lfdb_age_tmrid = rl_evloop_schedule(&uipcp->loop,
+                                        deadline > now ?
+                                        (deadline - now) * 1000 : 0,
+                                        lfdb_age_cb, this);
+}
+
+/* Discard the LFDB entries that have not been refreshed in the last
+ * RL_AGE_MAX seconds. Only the expired deadlines are visited. */
+void
+uipcp_rib::lfdb_age_expire()
+{
+    time_t now = mono_secs();
     bool discarded = false;
 
-    for (map<rl_addr_t, map< rl_addr_t, LowerFlow > >::iterator it
-                = rib->lfdb.begin(); it != rib->lfdb.end(); it++) {
-        list<map<rl_addr_t, LowerFlow >::iterator> discard_list;
+    while (!lfdb_expiry.empty() && lfdb_expiry.begin()->first <= now) {
+        multimap<time_t, pair<rl_addr_t, rl_addr_t> >::iterator e =
+                                                    lfdb_expiry.begin();
+        LowerFlow *lf = lfdb_find(e->second.first, e->second.second);
+
+        /* Skip the deadlines of entries that have been deleted or
+         * refreshed in the meanwhile. */
+        if (lf && lf->refreshed + RL_AGE_MAX <= now) {
+            UPI(uipcp, "Discarded lower-flow %s\n",
+                static_cast<string>(*lf).c_str());
+            lfdb_del(e->second.first, e->second.second);
+            lfdb_stats.expired++;
+            discarded = true;
+        }
 
-        if (it->first == rib->uipcp->addr) {
-            /* Don't age the entries generated by me, we pretend they
-             * are always refreshed. */
-            continue;
+        lfdb_expiry.erase(e);
+    }
+
+    if (discarded) {
+        /* Update the routing table. */
+        spf_schedule();
+    }
+
+    lfdb_age_arm();
+}
+
+/* Max number of LFDB entries carried by a single message, so that it
+ * fits a management PDU. Summaries only carry keys and sequence
+ * numbers. */
+#define RL_LFDB_CHUNK           10
+#define RL_LFDB_SUMMARY_CHUNK   100
+
+/* Send a list of LFDB entries to a neighbor, in as many messages as
+ * needed. M_CREATE and M_DELETE carry full entries, M_WRITE (summary)
+ * and M_READ (request) only the keys. */
+static int
+lfdb_send_chunked(NeighFlow *nf, const list<LowerFlow>& flows,
+                  gpb::opCode_t op_code)
+{
+    bool summary = op_code == gpb::M_WRITE || op_code == gpb::M_READ;
+    unsigned int limit = op_code == gpb::M_WRITE ? RL_LFDB_SUMMARY_CHUNK :
+                                                   RL_LFDB_CHUNK;
+    list<LowerFlow>::const_iterator f = flows.begin();
+    int ret = 0;
+
+    while (f != flows.end()) {
+        LowerFlowList lfl;
+        CDAPMessage m;
+
+        lfl.summary = summary;
+        while (lfl.flows.size() < limit && f != flows.end()) {
+            lfl.flows.push_back(*f);
+            f++;
         }
 
-        for (map<rl_addr_t, LowerFlow >::iterator jt = it->second.begin();
-                                                jt != it->second.end(); jt++) {
-            jt->second.age += RL_AGE_INCR_INTERVAL;
+        switch (op_code) {
+            case gpb::M_CREATE:
+                m.m_create(gpb::F_NO_FLAGS, obj_class::lfdb, obj_name::lfdb,
+                           0, 0, "");
+                break;
+
+            case gpb::M_DELETE:
+                m.m_delete(gpb::F_NO_FLAGS, obj_class::lfdb, obj_name::lfdb,
+                           0, 0, "");
+                break;
+
+            case gpb::M_WRITE:
+                m.m_write(gpb::F_NO_FLAGS, obj_class::lfdb_summary,
+                          obj_name::lfdb_summary, 0, 0, "");
+                break;
+
+            default:
+                m.m_read(gpb::F_NO_FLAGS, obj_class::lfdb_summary,
+                         obj_name::lfdb_summary, 0, 0, "");
+                break;
+        }
 
-            if (jt->second.age > RL_AGE_MAX) {
-                /* Insert this into the list of entries to be discarded. */
-                discard_list.push_back(jt);
-                discarded = true;
+        ret |= nf->send_to_port_id(&m, 0, &lfl);
+    }
+
+    return ret;
+}
+
+/* Send the summary of our LFDB to a neighbor. As in the IS-IS CSNP/PSNP
+ * exchange, the neighbor compares it with its own LFDB, requests the
+ * entries that it misses or has stale, and pushes to us the ones that
+ * it has newer. Since both the neighbors send their summary, only the
+ * differences are transferred. */
+int
+uipcp_rib::lfdb_summary_send(NeighFlow *nf)
+{
+    list<LowerFlow> flows;
+
+    for (map<rl_addr_t, map<rl_addr_t, LowerFlow> >::const_iterator
+            it = lfdb.begin(); it != lfdb.end(); it++) {
+        for (map<rl_addr_t, LowerFlow>::const_iterator jt =
+                it->second.begin(); jt != it->second.end(); jt++) {
+            flows.push_back(jt->second);
+        }
+    }
+
+    if (flows.empty()) {
+        return 0;
+    }
+
+    lfdb_stats.summaries_sent++;
+
+    return lfdb_send_chunked(nf, flows, gpb::M_WRITE);
+}
+
+int
+uipcp_rib::lfdb_summary_handler(const CDAPMessage *rm, NeighFlow *nf)
+{
+    list<LowerFlow> req, push, purge;
+    list<LowerFlow> own;
+    const char *objbuf;
+    size_t objlen;
+    CDAPMessage m;
+
+    if (rm->op_code == gpb::M_WRITE_R) {
+        return 0;
+    }
+
+    if (rm->op_code != gpb::M_WRITE && rm->op_code != gpb::M_READ &&
+            rm->op_code != gpb::M_READ_R) {
+        UPE(uipcp, "M_WRITE, M_READ or M_READ_R expected\n");
+        return 0;
+    }
+
+    rm->get_obj_value(objbuf, objlen);
+    if (!objbuf) {
+        UPE(uipcp, "LFDB summary does not contain a nested message\n");
+        return 0;
+    }
+
+    LowerFlowList lfl(objbuf, objlen);
+
+    if (rm->op_code == gpb::M_READ_R) {
+        /* The entries we requested. */
+        lfdb_update(lfl, true, nf);
+        return 0;
+    }
+
+    if (rm->op_code == gpb::M_READ) {
+        LowerFlowList resp;
+
+        /* The neighbor requests some entries of its summary. */
+        for (list<LowerFlow>::const_iterator f = lfl.flows.begin();
+                                    f != lfl.flows.end(); f++) {
+            const LowerFlow *lf = lfdb_find(f->local_addr, f->remote_addr);
+
+            if (lf) {
+                resp.flows.push_back(*lf);
             }
         }
+        lfdb_stats.pushed += resp.flows.size();
 
-        for (list<map<rl_addr_t, LowerFlow >::iterator>::iterator dit
-                    = discard_list.begin(); dit != discard_list.end(); dit++) {
-            UPI(rib->uipcp, "Discarded lower-flow %s\n",
-                            static_cast<string>((*dit)->second).c_str());
-            it->second.erase(*dit);
+        m.m_read_r(gpb::F_NO_FLAGS, obj_class::lfdb_summary,
+                   obj_name::lfdb_summary, 0, 0, string());
+        if (nf->send_to_port_id(&m, rm->invoke_id, &resp)) {
+            UPE(uipcp, "send_to_port_id() failed\n");
         }
+
+        return 0;
     }
 
-    if (discarded) {
-        /* Update the routing table. */
-        rib->spe.run(rib->uipcp->addr, rib);
-        rib->pduft_sync();
+    /* A summary: acknowledge it, and compare it with our LFDB. */
+    m.m_write_r(gpb::F_NO_FLAGS, 0, string());
+    m.obj_class = obj_class::lfdb_summary;
+    m.obj_name = obj_name::lfdb_summary;
+    if (nf->send_to_port_id(&m, rm->invoke_id, NULL)) {
+        UPE(uipcp, "send_to_port_id() failed\n");
+    }
+
+    lfdb_stats.summaries_rcvd++;
+
+    for (list<LowerFlow>::const_iterator f = lfl.flows.begin();
+                                    f != lfl.flows.end(); f++) {
+        LowerFlow *lf = lfdb_find(f->local_addr, f->remote_addr);
+
+        if (f->local_addr == uipcp->addr) {
+            if (lf == NULL) {
+                /* An entry generated by us that does not exist anymore
+                 * (e.g. before a restart): purge it. */
+                purge.push_back(*f);
+
+            } else if (f->seqnum > lf->seqnum) {
+                /* The neighbor has an entry generated by a previous
+                 * instance of us: re-originate ours, so that it
+                 * replaces the stale one everywhere. */
+                lf->seqnum = f->seqnum + 1;
+                own.push_back(*lf);
+
+            } else if (f->seqnum < lf->seqnum) {
+                push.push_back(*lf);
+            }
+
+        } else if (lf == NULL || f->seqnum > lf->seqnum) {
+            req.push_back(*f);
+
+        } else if (f->seqnum < lf->seqnum) {
+            push.push_back(*lf);
+        }
+    }
+
+    if (req.size() || push.size() || purge.size() || own.size()) {
+        UPD(uipcp, "LFDB summary from %s: %u entries requested, %u pushed, "
+            "%u purged, %u re-originated\n",
+            static_cast<string>(nf->neigh->ipcp_name).c_str(),
+            (unsigned int)req.size(), (unsigned int)push.size(),
+            (unsigned int)purge.size(), (unsigned int)own.size());
     }
 
-    /* Reschedule */
-    rib->age_incr_tmrid = rl_evloop_schedule(loop, RL_AGE_INCR_INTERVAL * 1000,
-                                             age_incr_cb, rib);
+    lfdb_stats.requested += req.size();
+    lfdb_stats.pushed += push.size();
+    lfdb_stats.purged += purge.size();
+    lfdb_send_chunked(nf, req, gpb::M_READ);
+    lfdb_send_chunked(nf, push, gpb::M_CREATE);
+    lfdb_send_chunked(nf, purge, gpb::M_DELETE);
+
+    for (list<LowerFlow>::iterator f = own.begin(); f != own.end();) {
+        LowerFlowList own_lfl;
+
+        while (own_lfl.flows.size() < RL_LFDB_CHUNK && f != own.end()) {
+            own_lfl.flows.push_back(*f);
+            f++;
+        }
+        remote_sync_obj_all(true, obj_class::lfdb, obj_name::lfdb,
+                            &own_lfl);
+    }
+
+    return 0;
 }
@@ -84,6 +84,11 @@ update_qos_cube(struct rl_flow_config& flowcfg, const string& param,
 {
     int field_int;
 
+    if (!parse_flowcfg_int(param, value, &field_int, "qos_id")) {
+        flowcfg.qos_id = field_int;
+        return 0;
+    }
+
     if (!parse_flowcfg_bool(param, value, &flowcfg.partial_delivery,
                                             "partial_delivery")) {
         return 0;
@@ -169,6 +174,15 @@ update_qos_cube(struct rl_flow_config& flowcfg, const string& param,
         return 0;
     }
 
+    if (!parse_flowcfg_int(param, value, &field_int,
+                                            "dtcp.fc.cong_ctrl")) {
+        flowcfg.dtcp.fc.fc_type = RLITE_FC_T_WIN;
+        flowcfg.dtcp.flow_control = 1;
+        flowcfg.dtcp_present = 1;
+        flowcfg.dtcp.fc.cfg.w.cong_ctrl = field_int;
+        return 0;
+    }
+
     if (!parse_flowcfg_int(param, value, &field_int,
                                         "dtcp.rtx.max_time_to_retry")) {
         flowcfg.dtcp.rtx_control = 1;
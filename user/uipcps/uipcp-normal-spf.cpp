@@ -0,0 +1,814 @@
+/*
+ * Shortest Path First routing engine for normal uipcps.
+ *
+ * Copyright (C) 2015-2016 Nextworks (SPF code formerly in
+ *                                  uipcp-normal-lower-flows.cpp)
+ * Copyright (C) 2026 rlite contributors
+ *
+ * This file is part of rlite.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <climits>
+#include <algorithm>
+#include <vector>
+
+#include "uipcp-normal.hpp"
+
+using namespace std;
+
+#define SPF_INF     UINT_MAX    /* infinite distance or removed edge */
+#define SPF_NONE    UINT_MAX    /* invalid node or edge index */
+
+/* Maximum number of edges added incrementally before the CSR is
+ * rebuilt from scratch. */
+#define SPF_EXTRA_MAX(_num_edges)   ((_num_edges) / 8 + 64)
+
+/* Maximum number of LFDB changes handled incrementally. */
+#define SPF_INCR_MAX(_num_nodes)    ((_num_nodes) / 16 + 1)
+
+unsigned int
+SPEngine::node_index(rl_addr_t addr) const
+{
+    vector<rl_addr_t>::const_iterator it;
+
+    it = lower_bound(nodes.begin(), nodes.end(), addr);
+    if (it == nodes.end() || *it != addr) {
+        return SPF_NONE;
+    }
+
+    return it - nodes.begin();
+}
+
+unsigned int
+SPEngine::distance(rl_addr_t dst) const
+{
+    unsigned int i = node_index(dst);
+
+    if (!valid || i == SPF_NONE) {
+        return SPF_INF;
+    }
+
+    return dist[i];
+}
+
+unsigned int
+SPEngine::find_edge(unsigned int u, unsigned int v) const
+{
+    map<unsigned int, vector<unsigned int> >::const_iterator x;
+
+    for (unsigned int k = adj_start[u]; k < adj_start[u + 1]; k++) {
+        if (adj_to[k] == v) {
+            return k;
+        }
+    }
+
+    x = extra_out.find(u);
+    if (x != extra_out.end()) {
+        for (unsigned int i = 0; i < x->second.size(); i++) {
+            if (adj_to[x->second[i]] == v) {
+                return x->second[i];
+            }
+        }
+    }
+
+    return SPF_NONE;
+}
+
+void
+SPEngine::relax(unsigned int u, Heap& heap)
+{
+    map<unsigned int, vector<unsigned int> >::const_iterator x =
+                                                        extra_out.end();
+    unsigned int k = adj_start[u];
+    unsigned int i = 0;
+
+    if (!extra_out.empty()) {
+        x = extra_out.find(u);
+    }
+
+    for (;;) {
+        unsigned int e, v, d;
+
+        if (k < adj_start[u + 1]) {
+            e = k++;
+        } else if (x != extra_out.end() && i < x->second.size()) {
+            e = x->second[i++];
+        } else {
+            break;
+        }
+
+        if (adj_cost[e] == SPF_INF) {
+            continue;
+        }
+
+        v = adj_to[e];
+        d = dist[u] + adj_cost[e];
+        if (d < dist[v]) {
+            dist[v] = d;
+            pred[v] = u;
+            heap.push(HeapItem(d, v));
+        }
+    }
+}
+
+/* Dijkstra main loop. Nodes are pushed again when their distance
+ * improves, and stale heap items are skipped. Settled nodes are
+ * appended to 'touched', in order of distance. */
+void
+SPEngine::propagate(Heap& heap, vector<unsigned int> *touched)
+{
+    while (!heap.empty()) {
+        HeapItem top = heap.top();
+        unsigned int u = top.second;
+
+        heap.pop();
+        if (top.first > dist[u]) {
+            continue;
+        }
+
+        PV_S("Selecting node %lu\n", (long unsigned)nodes[u]);
+
+        if (touched) {
+            touched->push_back(u);
+        }
+
+        relax(u, heap);
+    }
+}
+
+/* Recompute the set of equal-cost next hops of node v, merging the
+ * sets of all its predecessors along shortest paths. Returns true if
+ * the set changed. */
+bool
+SPEngine::nhops_update(unsigned int v)
+{
+    map<unsigned int, vector<unsigned int> >::const_iterator x;
+    unsigned int k = rev_start[v];
+    vector<unsigned int> nh;
+    unsigned int j = 0;
+
+    x = extra_in.find(v);
+    for (;;) {
+        unsigned int e, u;
+
+        if (v == src || dist[v] == SPF_INF) {
+            break;
+        }
+
+        if (k < rev_start[v + 1]) {
+            e = rev_edge[k++];
+        } else if (x != extra_in.end() && j < x->second.size()) {
+            e = x->second[j++];
+        } else {
+            break;
+        }
+
+        u = adj_from[e];
+        if (adj_cost[e] == SPF_INF || dist[u] == SPF_INF ||
+                dist[u] + adj_cost[e] != dist[v]) {
+            continue;
+        }
+
+        if (u == src) {
+            nh.push_back(v);
+        } else {
+            nh.insert(nh.end(), nhops[u].begin(), nhops[u].end());
+        }
+    }
+
+    sort(nh.begin(), nh.end());
+    nh.erase(unique(nh.begin(), nh.end()), nh.end());
+    if (nh.size() > RLITE_PDUFT_ECMP_MAX) {
+        nh.resize(RLITE_PDUFT_ECMP_MAX);
+    }
+
+    if (nh == nhops[v]) {
+        return false;
+    }
+    nhops[v].swap(nh);
+
+    return true;
+}
+
+void
+SPEngine::next_hops_set(unsigned int v)
+{
+    vector<rl_addr_t> addrs;
+
+    if (nhops[v].empty()) {
+        next_hops.erase(nodes[v]);
+        return;
+    }
+
+    for (unsigned int i = 0; i < nhops[v].size(); i++) {
+        addrs.push_back(nodes[nhops[v][i]]);
+    }
+    next_hops[nodes[v]].swap(addrs);
+}
+
+int
+SPEngine::run(rl_addr_t local_addr, struct uipcp_rib *rib)
+{
+    int ret = update(local_addr, rib->lfdb);
+
+    if (ret == 0) {
+        compute_backups();
+    }
+
+    return ret;
+}
+
+/* Plain Dijkstra from 'root', computing only the distances. */
+void
+SPEngine::distances_from(unsigned int root, vector<unsigned int>& d) const
+{
+    Heap heap;
+
+    d.assign(nodes.size(), SPF_INF);
+    d[root] = 0;
+    heap.push(HeapItem(0, root));
+
+    while (!heap.empty()) {
+        HeapItem top = heap.top();
+        unsigned int u = top.second;
+        map<unsigned int, vector<unsigned int> >::const_iterator x =
+                                                        extra_out.end();
+        unsigned int k = adj_start[u];
+        unsigned int i = 0;
+
+        heap.pop();
+        if (top.first > d[u]) {
+            continue;
+        }
+
+        if (!extra_out.empty()) {
+            x = extra_out.find(u);
+        }
+        for (;;) {
+            unsigned int e, v;
+
+            if (k < adj_start[u + 1]) {
+                e = k++;
+            } else if (x != extra_out.end() && i < x->second.size()) {
+                e = x->second[i++];
+            } else {
+                break;
+            }
+
+            if (adj_cost[e] == SPF_INF) {
+                continue;
+            }
+
+            v = adj_to[e];
+            if (d[u] + adj_cost[e] < d[v]) {
+                d[v] = d[u] + adj_cost[e];
+                heap.push(HeapItem(d[v], v));
+            }
+        }
+    }
+}
+
+/* Compute a loop-free alternate (RFC 5286) for each destination that
+ * has a single primary next hop. A neighbor N of the local node S is a
+ * loop-free alternate for destination D if
+ *
+ *      dist(N, D) < dist(N, S) + dist(S, D),
+ *
+ * i.e. N does not route back through S to reach D. Among the valid
+ * alternates, the one with the cheapest path to D is selected. This
+ * requires one shortest path tree rooted at each neighbor, which is
+ * cached in 'nbr_dist' across runs (see nbr_dist_update()). */
+void
+SPEngine::compute_backups()
+{
+    map<unsigned int, vector<unsigned int> >::const_iterator x;
+    vector<unsigned int> best_cost;
+    vector<unsigned int> best;
+    unsigned int k, i = 0;
+
+    if (backups_valid) {
+        return;
+    }
+
+    backup_hops.clear();
+    if (!valid) {
+        return;
+    }
+
+    best_cost.assign(nodes.size(), SPF_INF);
+    best.assign(nodes.size(), SPF_NONE);
+
+    k = adj_start[src];
+    x = extra_out.find(src);
+    for (;;) {
+        unsigned int e, n;
+
+        if (k < adj_start[src + 1]) {
+            e = k++;
+        } else if (x != extra_out.end() && i < x->second.size()) {
+            e = x->second[i++];
+        } else {
+            break;
+        }
+
+        n = adj_to[e];
+        if (adj_cost[e] == SPF_INF || n == src) {
+            continue;
+        }
+
+        vector<unsigned int>& dn = nbr_dist[n];
+
+        if (dn.empty()) {
+            distances_from(n, dn);
+            lfa_runs++;
+        }
+        if (dn[src] == SPF_INF) {
+            /* The neighbor cannot reach us, this is not a usable
+             * link. */
+            continue;
+        }
+
+        for (unsigned int v = 0; v < nodes.size(); v++) {
+            unsigned long long through_src;
+            unsigned int cost;
+
+            if (v == src || dist[v] == SPF_INF || dn[v] == SPF_INF ||
+                    nhops[v].size() != 1 || nhops[v][0] == n) {
+                continue;
+            }
+
+            through_src = (unsigned long long)dn[src] + dist[v];
+            if (dn[v] >= through_src) {
+                continue; /* not loop-free */
+            }
+
+            cost = adj_cost[e] + dn[v];
+            if (cost < best_cost[v]) {
+                best_cost[v] = cost;
+                best[v] = n;
+            }
+        }
+    }
+
+    for (unsigned int v = 0; v < nodes.size(); v++) {
+        if (best[v] != SPF_NONE) {
+            backup_hops.insert(backup_hops.end(),
+                               make_pair(nodes[v], nodes[best[v]]));
+        }
+    }
+
+    backups_valid = true;
+
+    PV_S("Loop-free alternates computed for %u destinations\n",
+         (unsigned int)backup_hops.size());
+}
+
+/* The cost of edge 'e' changed from 'old_cost' to adj_cost[e]. Drop the
+ * cached neighbor distances that this may change: a cheaper edge
+ * matters only if it shortens the path to its destination, while a
+ * more expensive (or removed) edge matters only if it lies on a
+ * shortest path. All the other vectors stay exact. */
+void
+SPEngine::nbr_dist_update(unsigned int e, unsigned int old_cost)
+{
+    map<unsigned int, vector<unsigned int> >::iterator x;
+    unsigned int u = adj_from[e];
+    unsigned int v = adj_to[e];
+    unsigned int cost = adj_cost[e];
+
+    for (x = nbr_dist.begin(); x != nbr_dist.end();) {
+        const vector<unsigned int>& dn = x->second;
+        bool stale = false;
+
+        if (dn[u] != SPF_INF) {
+            if (cost < old_cost) {
+                stale = dn[u] + cost < dn[v];
+            } else if (cost > old_cost && old_cost != SPF_INF) {
+                stale = dn[u] + old_cost == dn[v];
+            }
+        }
+
+        if (stale) {
+            nbr_dist.erase(x++);
+        } else {
+            x++;
+        }
+    }
+}
+
+void
+SPEngine::lfdb_changed(rl_addr_t local_addr, rl_addr_t remote_addr)
+{
+    if (valid) {
+        changes.insert(make_pair(local_addr, remote_addr));
+    }
+}
+
+int
+SPEngine::compute(rl_addr_t local_addr,
+                  const map<rl_addr_t, map<rl_addr_t, LowerFlow> >& lfdb)
+{
+    map<rl_addr_t, map<rl_addr_t, LowerFlow> >::const_iterator it;
+    vector<unsigned int> rev_fill;
+    vector<unsigned int> order;
+    unsigned int num_nodes;
+    Heap heap;
+    unsigned int i;
+
+    /* Clean up state left from the previous run. The vectors keep
+     * their capacity, so that steady-state runs do not allocate. */
+    valid = false;
+    changes.clear();
+    next_hops.clear();
+    nodes.clear();
+    adj_start.clear();
+    adj_from.clear();
+    adj_to.clear();
+    adj_cost.clear();
+    extra_out.clear();
+    extra_in.clear();
+    num_extra = 0;
+    nbr_dist.clear();
+    backups_valid = false;
+    full_runs++;
+
+    /* Assign dense indices to all the addresses in the Lower Flow
+     * Database. */
+    for (it = lfdb.begin(); it != lfdb.end(); it++) {
+        nodes.push_back(it->first);
+        for (map<rl_addr_t, LowerFlow>::const_iterator jt
+                    = it->second.begin(); jt != it->second.end(); jt++) {
+            nodes.push_back(jt->second.remote_addr);
+        }
+    }
+    sort(nodes.begin(), nodes.end());
+    nodes.erase(unique(nodes.begin(), nodes.end()), nodes.end());
+    num_nodes = nodes.size();
+
+    /* Build the graph in CSR form. Both the LFDB and the 'nodes' vector
+     * are sorted by address, so the rows can be filled in order. */
+    it = lfdb.begin();
+    for (i = 0; i < num_nodes; i++) {
+        adj_start.push_back(adj_to.size());
+        if (it == lfdb.end() || it->first != nodes[i]) {
+            continue;
+        }
+
+        for (map<rl_addr_t, LowerFlow>::const_iterator jt
+                    = it->second.begin(); jt != it->second.end(); jt++) {
+            adj_from.push_back(i);
+            adj_to.push_back(node_index(jt->second.remote_addr));
+            adj_cost.push_back(jt->second.cost);
+        }
+        it++;
+    }
+    adj_start.push_back(adj_to.size());
+
+    /* Build the reverse graph, used by incremental updates. */
+    rev_start.assign(num_nodes + 1, 0);
+    for (i = 0; i < adj_to.size(); i++) {
+        rev_start[adj_to[i] + 1]++;
+    }
+    for (i = 0; i < num_nodes; i++) {
+        rev_start[i + 1] += rev_start[i];
+    }
+    rev_fill.assign(rev_start.begin(), rev_start.end() - 1);
+    rev_edge.resize(adj_to.size());
+    for (i = 0; i < adj_to.size(); i++) {
+        rev_edge[rev_fill[adj_to[i]]++] = i;
+    }
+
+    PV_S("Graph [%u nodes, %u edges]:\n", num_nodes,
+         (unsigned int)adj_to.size());
+    for (i = 0; rl_verbosity >= RL_VERB_VERY && i < num_nodes; i++) {
+        PV_S("%lu: {", (long unsigned)nodes[i]);
+        for (unsigned int k = adj_start[i]; k < adj_start[i + 1]; k++) {
+            PV_S("(%lu, %u), ", (long unsigned)nodes[adj_to[k]],
+                 adj_cost[k]);
+        }
+        PV_S("}\n");
+    }
+
+    src = node_index(local_addr);
+    if (src == SPF_NONE) {
+        /* We are not in the graph yet. */
+        return 0;
+    }
+
+    dist.assign(num_nodes, SPF_INF);
+    pred.assign(num_nodes, SPF_NONE);
+    nhops.assign(num_nodes, vector<unsigned int>());
+    mark.assign(num_nodes, 0);
+    dist[src] = 0;
+    heap.push(HeapItem(0, src));
+    propagate(heap, &order);
+
+    /* Compute the equal-cost next hops in order of distance, so that
+     * all the predecessors of a node are processed before the node. */
+    for (i = 0; i < order.size(); i++) {
+        nhops_update(order[i]);
+    }
+
+    /* Fill in the routing table. Nodes are sorted, so we can insert
+     * at the end of the map in constant time. */
+    for (i = 0; i < num_nodes; i++) {
+        if (!nhops[i].empty()) {
+            vector<rl_addr_t> addrs;
+
+            for (unsigned int j = 0; j < nhops[i].size(); j++) {
+                addrs.push_back(nodes[nhops[i][j]]);
+            }
+            next_hops.insert(next_hops.end(), make_pair(nodes[i], addrs));
+        }
+    }
+
+    local = local_addr;
+    valid = true;
+
+    PV_S("Dijkstra result:\n");
+    for (i = 0; rl_verbosity >= RL_VERB_VERY && i < num_nodes; i++) {
+        PV_S("    Address: %lu, Dist: %u\n", (long unsigned)nodes[i],
+             dist[i]);
+    }
+
+    PV_S("Routing table:\n");
+    for (map<rl_addr_t, vector<rl_addr_t> >::iterator h = next_hops.begin();
+            rl_verbosity >= RL_VERB_VERY && h != next_hops.end(); h++) {
+        PV_S("    Address: %lu, Next hops: {", (long unsigned)h->first);
+        for (unsigned int j = 0; j < h->second.size(); j++) {
+            PV_S("%lu, ", (long unsigned)h->second[j]);
+        }
+        PV_S("}\n");
+    }
+
+    return 0;
+}
+
+/* The cost of edge 'e' decreased, or 'e' was added: the nodes whose
+ * distance improves are reached from the edge destination. */
+void
+SPEngine::edge_decreased(unsigned int e, vector<unsigned int>& touched)
+{
+    unsigned int u = adj_from[e];
+    unsigned int v = adj_to[e];
+    Heap heap;
+
+    if (dist[u] == SPF_INF || dist[u] + adj_cost[e] >= dist[v]) {
+        return;
+    }
+
+    dist[v] = dist[u] + adj_cost[e];
+    pred[v] = u;
+    heap.push(HeapItem(dist[v], v));
+    propagate(heap, &touched);
+}
+
+/* The cost of edge 'e' increased, or 'e' was removed. If 'e' is part
+ * of the shortest path tree, only the subtree rooted at the edge
+ * destination is affected (Ramalingam-Reps): its nodes are detached,
+ * given a tentative distance through their unaffected in-neighbors and
+ * settled again with Dijkstra. */
+void
+SPEngine::edge_increased(unsigned int e, vector<unsigned int>& touched)
+{
+    map<unsigned int, vector<unsigned int> >::const_iterator x;
+    unsigned int v = adj_to[e];
+    vector<unsigned int> aff;
+    Heap heap;
+    unsigned int i;
+
+    if (pred[v] != adj_from[e]) {
+        /* Not a tree edge, nothing changes. */
+        return;
+    }
+
+    /* Collect the subtree rooted at v. */
+    aff.push_back(v);
+    mark[v] = 1;
+    for (i = 0; i < aff.size(); i++) {
+        unsigned int y = aff[i];
+
+        for (unsigned int k = adj_start[y]; k < adj_start[y + 1]; k++) {
+            unsigned int z = adj_to[k];
+
+            if (pred[z] == y && !mark[z]) {
+                mark[z] = 1;
+                aff.push_back(z);
+            }
+        }
+
+        x = extra_out.find(y);
+        if (x == extra_out.end()) {
+            continue;
+        }
+        for (unsigned int j = 0; j < x->second.size(); j++) {
+            unsigned int z = adj_to[x->second[j]];
+
+            if (pred[z] == y && !mark[z]) {
+                mark[z] = 1;
+                aff.push_back(z);
+            }
+        }
+    }
+
+    for (i = 0; i < aff.size(); i++) {
+        dist[aff[i]] = SPF_INF;
+        pred[aff[i]] = SPF_NONE;
+        touched.push_back(aff[i]);
+    }
+
+    /* Seed the heap with the best path from an unaffected node. */
+    for (i = 0; i < aff.size(); i++) {
+        unsigned int z = aff[i];
+        unsigned int best = SPF_INF;
+        unsigned int best_pred = SPF_NONE;
+        unsigned int k = rev_start[z];
+        unsigned int j = 0;
+
+        x = extra_in.find(z);
+        for (;;) {
+            unsigned int in, w;
+
+            if (k < rev_start[z + 1]) {
+                in = rev_edge[k++];
+            } else if (x != extra_in.end() && j < x->second.size()) {
+                in = x->second[j++];
+            } else {
+                break;
+            }
+
+            w = adj_from[in];
+            if (adj_cost[in] == SPF_INF || mark[w] || dist[w] == SPF_INF) {
+                continue;
+            }
+            if (dist[w] + adj_cost[in] < best) {
+                best = dist[w] + adj_cost[in];
+                best_pred = w;
+            }
+        }
+
+        if (best_pred != SPF_NONE) {
+            dist[z] = best;
+            pred[z] = best_pred;
+            heap.push(HeapItem(best, z));
+        }
+    }
+
+    for (i = 0; i < aff.size(); i++) {
+        mark[aff[i]] = 0;
+    }
+
+    propagate(heap, &touched);
+}
+
+int
+SPEngine::update(rl_addr_t local_addr,
+                 const map<rl_addr_t, map<rl_addr_t, LowerFlow> >& lfdb)
+{
+    set< pair<rl_addr_t, rl_addr_t> >::iterator c;
+    unsigned int num_changes = changes.size();
+    vector<unsigned int> touched;
+    vector<unsigned int> updated;
+    unsigned int num_touched;
+    Heap heap;
+    unsigned int i;
+
+    if (!valid || local_addr != local ||
+            changes.size() > SPF_INCR_MAX(nodes.size())) {
+        return compute(local_addr, lfdb);
+    }
+
+    for (c = changes.begin(); c != changes.end(); c++) {
+        map<rl_addr_t, map<rl_addr_t, LowerFlow> >::const_iterator it;
+        map<rl_addr_t, LowerFlow>::const_iterator jt;
+        unsigned int u = node_index(c->first);
+        unsigned int v = node_index(c->second);
+        unsigned int cost = SPF_INF;
+        unsigned int old_cost;
+        unsigned int e;
+
+        if (u == SPF_NONE || v == SPF_NONE) {
+            /* A new node showed up. */
+            return compute(local_addr, lfdb);
+        }
+
+        it = lfdb.find(c->first);
+        if (it != lfdb.end()) {
+            jt = it->second.find(c->second);
+            if (jt != it->second.end()) {
+                cost = jt->second.cost;
+            }
+        }
+
+        e = find_edge(u, v);
+        if (e == SPF_NONE) {
+            if (cost == SPF_INF) {
+                continue;
+            }
+            if (num_extra >= SPF_EXTRA_MAX(adj_start.back())) {
+                return compute(local_addr, lfdb);
+            }
+            e = adj_to.size();
+            adj_from.push_back(u);
+            adj_to.push_back(v);
+            adj_cost.push_back(SPF_INF);
+            extra_out[u].push_back(e);
+            extra_in[v].push_back(e);
+            num_extra++;
+        }
+
+        /* Whatever happens, the destination of the edge may gain or
+         * lose an equal-cost next hop. */
+        touched.push_back(v);
+
+        old_cost = adj_cost[e];
+        adj_cost[e] = cost;
+        nbr_dist_update(e, old_cost);
+        backups_valid = false;
+        if (cost < old_cost) {
+            edge_decreased(e, touched);
+        } else if (cost > old_cost) {
+            edge_increased(e, touched);
+        }
+    }
+    changes.clear();
+    incr_runs++;
+
+    /* The next hops may change for the nodes whose distance changed
+     * and for their out-neighbors, since edges may have become (or
+     * stopped being) part of a shortest path. Changes then propagate
+     * along shortest paths, in order of distance. */
+    for (i = 0, num_touched = touched.size(); i < num_touched; i++) {
+        unsigned int u = touched[i];
+        map<unsigned int, vector<unsigned int> >::const_iterator x;
+
+        for (unsigned int k = adj_start[u]; k < adj_start[u + 1]; k++) {
+            touched.push_back(adj_to[k]);
+        }
+        x = extra_out.find(u);
+        if (x != extra_out.end()) {
+            for (unsigned int j = 0; j < x->second.size(); j++) {
+                touched.push_back(adj_to[x->second[j]]);
+            }
+        }
+    }
+    for (i = 0; i < touched.size(); i++) {
+        heap.push(HeapItem(dist[touched[i]], touched[i]));
+    }
+
+    while (!heap.empty()) {
+        unsigned int u = heap.top().second;
+        map<unsigned int, vector<unsigned int> >::const_iterator x;
+
+        heap.pop();
+        if (mark[u]) {
+            continue;
+        }
+        mark[u] = 1;
+        updated.push_back(u);
+
+        if (!nhops_update(u)) {
+            continue;
+        }
+        next_hops_set(u);
+
+        for (unsigned int k = adj_start[u]; k < adj_start[u + 1]; k++) {
+            if (!mark[adj_to[k]]) {
+                heap.push(HeapItem(dist[adj_to[k]], adj_to[k]));
+            }
+        }
+        x = extra_out.find(u);
+        if (x != extra_out.end()) {
+            for (unsigned int j = 0; j < x->second.size(); j++) {
+                unsigned int w = adj_to[x->second[j]];
+
+                if (!mark[w]) {
+                    heap.push(HeapItem(dist[w], w));
+                }
+            }
+        }
+    }
+
+    for (i = 0; i < updated.size(); i++) {
+        mark[updated[i]] = 0;
+    }
+
+    PV_S("Incremental SPF: %u changes, %u nodes updated\n",
+         num_changes, (unsigned int)updated.size());
+
+    return 0;
+}
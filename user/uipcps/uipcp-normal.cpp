@@ -49,10 +49,12 @@ namespace obj_class {
     string status = "operational_status";
     string address = "address";
     string lfdb = "fsodb"; /* Lower Flow DB */
+    string lfdb_summary = "fsodb_summary";
     string flows = "flows"; /* Supported flows */
     string flow = "flow";
     string keepalive = "keepalive";
     string lowerflow = "lowerflow";
+    string ribsync = "rib_sync";
 };
 
 namespace obj_name {
@@ -63,13 +65,16 @@ namespace obj_name {
     string status = "/daf/mgmt/" + obj_class::status;
     string address = "/daf/mgmt/naming" + obj_class::address;
     string lfdb = "/dif/mgmt/pduft/linkstate/" + obj_class::lfdb;
+    string lfdb_summary = "/dif/mgmt/pduft/linkstate/" +
+                          obj_class::lfdb_summary;
     string whatevercast = "/daf/mgmt/naming/whatevercast";
     string flows = "/dif/ra/fa/" + obj_class::flows;
     string keepalive = "/daf/mgmt/" + obj_class::keepalive;
     string lowerflow = "/daf/mgmt/" + obj_class::lowerflow;
+    string ribsync = "/daf/mgmt/" + obj_class::ribsync;
 };
 
-#define MGMTBUF_SIZE_MAX 4096
+#define MGMTBUF_SIZE_MAX (RL_MGMT_SDU_MAX + sizeof(struct rl_mgmt_hdr))
 
 static int
 mgmt_write(struct uipcp *uipcp, const struct rl_mgmt_hdr *mhdr,
@@ -80,9 +85,10 @@ mgmt_write(struct uipcp *uipcp, const struct rl_mgmt_hdr *mhdr,
     int n;
     int ret = 0;
 
-    if (buflen > MGMTBUF_SIZE_MAX) {
+    if (buflen > RL_MGMT_SDU_MAX) {
         UPE(uipcp, "Dropping oversized mgmt message %d/%d\n",
-            (int)buflen, MGMTBUF_SIZE_MAX);
+            (int)buflen, RL_MGMT_SDU_MAX);
+        return -1;
     }
 
     mgmtbuf = (char *)malloc(sizeof(*mhdr) + buflen);
@@ -264,6 +270,17 @@ uipcp_rib::uipcp_rib(struct uipcp *_u) : uipcp(_u), enrolled(0)
     pthread_mutex_init(&lock, NULL);
 
     kevent_id_cnt = 1;
+    spf_tmrid = 0;
+    spf_hold = normal_spf_params.hold;
+    memset(&spf_last, 0, sizeof(spf_last));
+    memset(&spf_stats, 0, sizeof(spf_stats));
+    memset(&pduft_stats, 0, sizeof(pduft_stats));
+    lfdb_age_tmrid = 0;
+    lfdb_refreshed = 0;
+    memset(&lfdb_stats, 0, sizeof(lfdb_stats));
+    memset(&ribsync_stats, 0, sizeof(ribsync_stats));
+    dft_refreshed = 0;
+    memset(&dft_stats, 0, sizeof(dft_stats));
 
     mgmtfd = rl_open_mgmt_port(uipcp->id);
     if (mgmtfd < 0) {
@@ -289,14 +306,15 @@ uipcp_rib::uipcp_rib(struct uipcp *_u) : uipcp(_u), enrolled(0)
     handlers.insert(make_pair(obj_name::neighbors,
                               &uipcp_rib::neighbors_handler));
     handlers.insert(make_pair(obj_name::lfdb, &uipcp_rib::lfdb_handler));
+    handlers.insert(make_pair(obj_name::lfdb_summary,
+                              &uipcp_rib::lfdb_summary_handler));
     handlers.insert(make_pair(obj_name::flows, &uipcp_rib::flows_handler));
     handlers.insert(make_pair(obj_name::keepalive,
                               &uipcp_rib::keepalive_handler));
+    handlers.insert(make_pair(obj_name::ribsync,
+                              &uipcp_rib::ribsync_handler));
 
     /* Start timers for periodic tasks. */
-    age_incr_tmrid = rl_evloop_schedule(&uipcp->loop,
-                                        RL_AGE_INCR_INTERVAL * 1000,
-                                        age_incr_cb, this);
     sync_tmrid = rl_evloop_schedule(&uipcp->loop, RL_NEIGH_SYNC_INTVAL * 1000,
                                     sync_timeout_cb, this);
 }
@@ -304,7 +322,20 @@ uipcp_rib::uipcp_rib(struct uipcp *_u) : uipcp(_u), enrolled(0)
 uipcp_rib::~uipcp_rib()
 {
     rl_evloop_schedule_canc(&uipcp->loop, sync_tmrid);
-    rl_evloop_schedule_canc(&uipcp->loop, age_incr_tmrid);
+    if (lfdb_age_tmrid > 0) {
+        rl_evloop_schedule_canc(&uipcp->loop, lfdb_age_tmrid);
+    }
+    if (spf_tmrid > 0) {
+        rl_evloop_schedule_canc(&uipcp->loop, spf_tmrid);
+    }
+
+    for (map<string, DFTQuery *>::iterator qit = dft_queries.begin();
+                                        qit != dft_queries.end(); qit++) {
+        if (qit->second->tmrid > 0) {
+            rl_evloop_schedule_canc(&uipcp->loop, qit->second->tmrid);
+        }
+        delete qit->second;
+    }
 
     for (map<string, Neighbor*>::iterator mit = neighbors.begin();
                                     mit != neighbors.end(); mit++) {
@@ -324,6 +355,7 @@ u82boolstr(uint8_t v) {
 char *
 uipcp_rib::dump() const
 {
+    struct timespec now;
     stringstream ss;
 
 #ifdef RL_USE_QOS_CUBES
@@ -333,6 +365,7 @@ uipcp_rib::dump() const
             const struct rl_flow_config& c = i->second;
 
             ss << i->first.c_str() << ": {" << endl;
+            ss << "   qos_id=" << static_cast<unsigned int>(c.qos_id) << endl;
             ss << "   partial_delivery=" << u82boolstr(c.partial_delivery)
                 << endl << "   incomplete_delivery=" <<
                 u82boolstr(c.incomplete_delivery) << endl <<
@@ -353,6 +386,8 @@ uipcp_rib::dump() const
                     static_cast<unsigned int>(c.dtcp.fc.cfg.w.max_cwq_len)
                     << endl << "   dtcp.fc.initial_credit=" <<
                     static_cast<unsigned int>(c.dtcp.fc.cfg.w.initial_credit)
+                    << endl << "   dtcp.fc.cong_ctrl=" <<
+                    static_cast<unsigned int>(c.dtcp.fc.cfg.w.cong_ctrl)
                     << endl;
             } else if (c.dtcp.fc.fc_type == RLITE_FC_T_RATE) {
                 ss << "   dtcp.fc.sending_rate=" <<
@@ -406,17 +441,30 @@ uipcp_rib::dump() const
     ss << endl;
 
     ss << "Directory Forwarding Table:" << endl;
-    for (map<string, DFTEntry>::const_iterator
+    for (DFT::const_iterator
             mit = dft.begin(); mit != dft.end(); mit++) {
-        const DFTEntry& entry = mit->second;
+        const DFTRecord& entry = *mit;
 
         ss << "    Application: " << static_cast<string>(entry.appl_name)
             << ", Address: " << entry.address << ", Timestamp: "
                 << entry.timestamp << endl;
     }
 
+    if (normal_dir_params.replicas) {
+        ss << "Directory: " << normal_dir_params.replicas
+            << " replicas, " << dft_cache.size() << " cached, "
+            << dft_queries.size() << " pending queries, "
+            << dft_stats.queries << " queries, " << dft_stats.answered
+            << " answered, " << dft_stats.hits << " cache hits, "
+            << dft_stats.failures << " failures, " << dft_stats.published
+            << " entries published, " << dft_stats.dropped << " dropped"
+            << endl;
+    }
+
     ss << endl;
 
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
     ss << "Lower Flow Database:" << endl;
     for (map<rl_addr_t, map<rl_addr_t, LowerFlow > >::const_iterator
             it = lfdb.begin(); it != lfdb.end(); it++) {
@@ -427,12 +475,36 @@ uipcp_rib::dump() const
         ss << "    LocalAddr: " << flow.local_addr << ", RemoteAddr: "
             << flow.remote_addr << ", Cost: " << flow.cost <<
                 ", Seqnum: " << flow.seqnum << ", State: " << flow.state
-                    << ", Age: " << flow.age << endl;
+                    << ", Age: " << now.tv_sec - flow.refreshed << endl;
         }
     }
 
     ss << endl;
 
+    ss << "SPF: " << spf_stats.requests << " requests, " << spf_stats.runs
+        << " runs (" << spf_stats.requests - spf_stats.runs << " saved), "
+        << spe.full_runs << " full, " << spe.incr_runs << " incremental, "
+        << spe.lfa_runs << " LFA trees, hold " << spf_hold << " ms" << endl;
+    ss << "PDUFT synchronization: " << pduft.size() << " entries, "
+        << pduft_stats.syncs << " syncs, " << pduft_stats.added
+        << " added, " << pduft_stats.updated << " updated, "
+        << pduft_stats.removed << " removed, " << pduft_stats.unchanged
+        << " unchanged, " << pduft_stats.failovers << " failovers, "
+        << pduft_stats.backups << " destinations with backup"
+        << endl;
+    ss << "LFDB summaries: " << lfdb_stats.summaries_sent << " sent, "
+        << lfdb_stats.summaries_rcvd << " received, "
+        << lfdb_stats.requested << " entries requested, "
+        << lfdb_stats.pushed << " pushed, " << lfdb_stats.purged
+        << " purged, " << lfdb_stats.expired << " expired"
+        << endl;
+    ss << "RIB sync: " << ribsync_stats.syncs << " syncs, "
+        << ribsync_stats.entries << " entries, " << ribsync_stats.msgs
+        << " messages, " << ribsync_stats.bytes << " bytes ("
+        << ribsync_stats.raw_bytes << " uncompressed), last sync "
+        << ribsync_stats.last_ms << " ms, last enrollment "
+        << ribsync_stats.enroll_last_ms << " ms" << endl << endl;
+
     ss << "Supported flows:" << endl;
     for (map<string, FlowRequest>::const_iterator
             mit = flow_reqs.begin(); mit != flow_reqs.end(); mit++) {
@@ -767,6 +839,25 @@ normal_flow_deallocated(struct rl_evloop *loop,
     return 0;
 }
 
+static int
+normal_flow_stats(struct rl_evloop *loop,
+                  const struct rl_msg_base *b_resp,
+                  const struct rl_msg_base *b_req)
+{
+    struct uipcp *uipcp = container_of(loop, struct uipcp, loop);
+    struct rl_kmsg_flow_stats_resp *resp =
+                (struct rl_kmsg_flow_stats_resp *)b_resp;
+    struct rl_kmsg_flow_stats_req *req =
+                (struct rl_kmsg_flow_stats_req *)b_req;
+    struct rl_flow_stats stats = resp->stats;
+    uipcp_rib *rib = UIPCP_RIB(uipcp);
+    ScopeLock lock_(rib->lock);
+
+    rib->flow_stats_update(req->port_id, &stats);
+
+    return 0;
+}
+
 static int
 normal_init(struct uipcp *uipcp)
 {
@@ -841,6 +932,21 @@ normal_ipcp_rib_show(struct uipcp *uipcp)
     return rib->dump();
 }
 
+struct uipcp_spf_params normal_spf_params = {
+    .initial_delay = RL_SPF_INITIAL_DELAY,
+    .hold = RL_SPF_HOLD,
+    .max_hold = RL_SPF_MAX_HOLD,
+};
+
+struct uipcp_mgmt_params normal_mgmt_params = {
+    .sdu_max = RL_MGMT_SDU_DFLT,
+    .compress = 0,
+};
+
+struct uipcp_dir_params normal_dir_params = {
+    .replicas = 0,
+};
+
 struct uipcp_ops normal_ops = {
     .init = normal_init,
     .fini = normal_fini,
@@ -853,6 +959,7 @@ struct uipcp_ops normal_ops = {
     .fa_req = normal_fa_req,
     .fa_resp = normal_fa_resp,
     .flow_deallocated = normal_flow_deallocated,
+    .flow_stats = normal_flow_stats,
     .get_enrollment_targets = normal_get_enrollment_targets,
 };
 
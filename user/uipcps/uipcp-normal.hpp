@@ -27,6 +27,11 @@
 #include <string>
 #include <map>
 #include <list>
+#include <vector>
+#include <set>
+#include <queue>
+#include <functional>
+#include <ctime>
 #include <pthread.h>
 
 #include "rlite/common.h"
@@ -46,10 +51,12 @@ namespace obj_class {
     extern std::string status;
     extern std::string address;
     extern std::string lfdb; /* Lower Flow DB */
+    extern std::string lfdb_summary;
     extern std::string flows; /* Supported flows */
     extern std::string flow;
     extern std::string keepalive;
     extern std::string lowerflow;
+    extern std::string ribsync;
 };
 
 namespace obj_name {
@@ -60,23 +67,66 @@ namespace obj_name {
     extern std::string status;
     extern std::string address;
     extern std::string lfdb;
+    extern std::string lfdb_summary;
     extern std::string whatevercast;
     extern std::string flows;
     extern std::string keepalive;
     extern std::string lowerflow;
+    extern std::string ribsync;
 };
 
-/* Time interval (in seconds) between two consecutive increments
- * of the age of LFDB entries. */
-#define RL_AGE_INCR_INTERVAL    2
+/* Max age (in seconds) for an LFDB entry not to be discarded. Must be
+ * the same for all the IPCPs in a DIF, and a few times larger than
+ * RL_LFDB_REFRESH_INTVAL. */
+#define RL_AGE_MAX              900
 
-/* Max age (in seconds) for an LFDB entry not to be discarded. */
-#define RL_AGE_MAX              120
+/* Time interval (in seconds) between two consecutive re-originations
+ * of the LFDB entries generated by this IPCP. */
+#define RL_LFDB_REFRESH_INTVAL  300
 
 /* Time interval (in seconds) between two consecutive periodic
- * RIB synchronizations. */
+ * RIB synchronizations (LFDB summary exchanges). */
 #define RL_NEIGH_SYNC_INTVAL           30
 
+/* Default SPF scheduling parameters (in milliseconds), see
+ * struct uipcp_spf_params. */
+#define RL_SPF_INITIAL_DELAY    50
+#define RL_SPF_HOLD             200
+#define RL_SPF_MAX_HOLD         5000
+
+/* Distributed directory (see struct uipcp_dir_params): time interval
+ * (in seconds) between two consecutive checks for IPCPs joining or
+ * leaving the DIF, which move the entries to new home IPCPs, timeout
+ * (in milliseconds) for a query to a home IPCP, and lifetime (in
+ * seconds) and maximum number of the cached query results. */
+#define RL_DFT_REFRESH_INTVAL   60
+#define RL_DFT_QUERY_TIMEOUT    1000
+#define RL_DFT_CACHE_TTL        60
+#define RL_DFT_CACHE_MAX        4096
+
+/* Seconds on the monotonic clock, used for the expiration times. */
+static inline time_t
+mono_secs()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec;
+}
+
+/* Milliseconds elapsed since 't1' (monotonic clock). */
+static inline double
+ms_since(const struct timespec *t1)
+{
+    struct timespec t2;
+
+    clock_gettime(CLOCK_MONOTONIC, &t2);
+
+    return (t2.tv_sec - t1->tv_sec) * 1000.0 +
+            (t2.tv_nsec - t1->tv_nsec) / 1000000.0;
+}
+
 enum enroll_state_t {
     NEIGH_NONE = 0,
     NEIGH_I_WAIT_CONNECT_R,
@@ -107,10 +157,23 @@ struct NeighFlow {
     int enroll_tmrid;
     pthread_cond_t enrollment_stopped;
     enum enroll_state_t enrollment_state;
+    struct timespec enroll_start;
 
     int keepalive_tmrid;
     int pending_keepalive_reqs;
 
+    /* Measurements used to compute the cost of the lower flow: smoothed
+     * keepalive RTT (us, 0 if unknown), current and peak throughput
+     * (bytes per second). The peak is our estimate of the capacity,
+     * since lower flows do not report it. */
+    struct timespec keepalive_sent;
+    unsigned int srtt_us;
+    struct rl_flow_stats last_stats;
+    struct timespec last_stats_ts;
+    bool stats_valid;
+    uint64_t rate;
+    uint64_t peak_rate;
+
     NeighFlow(Neighbor *n, const std::string& supp_dif, unsigned int pid,
               int ffd, unsigned int lid);
     ~NeighFlow();
@@ -126,6 +189,10 @@ struct NeighFlow {
 
     int send_to_port_id(CDAPMessage *m, int invoke_id,
                         const UipcpObject *obj) const;
+
+    void rtt_sample(unsigned int rtt_us);
+    void stats_update(const struct rl_flow_stats *stats);
+    unsigned int cost() const;
 };
 
 /* Holds the information about a neighbor IPCP. */
@@ -142,6 +209,11 @@ struct Neighbor {
 
     int enroll_attempts;
 
+    /* Cost of the lower flow currently advertised in the LFDB (0 if
+     * not advertised yet) and time of the last advertisement. */
+    unsigned int adv_cost;
+    struct timespec adv_ts;
+
     std::map<rl_port_t, NeighFlow *> flows;
     rl_port_t mgmt_port_id;
 
@@ -160,9 +232,11 @@ struct Neighbor {
     const char *enrollment_state_repr(enroll_state_t s) const;
 
     NeighFlow *mgmt_conn();
+    void healthy_ports(std::vector<rl_port_t>& ports) const;
     const NeighFlow *mgmt_conn() const { return _mgmt_conn(); };
     bool has_mgmt_flow() const { return flows.size() > 0; }
     bool enrollment_complete() const;
+    unsigned int link_cost() const;
     int enroll_fsm_run(NeighFlow *nf, const CDAPMessage *rm);
     int alloc_flow(const char *supp_dif_name);
 
@@ -191,31 +265,204 @@ private:
     const NeighFlow *_mgmt_conn() const;
 };
 
+/* The lower flows used to reach a destination: the sorted set of
+ * equal-cost primary lower flows, plus an optional backup one. */
+struct PduftRoute {
+    std::vector<rl_port_t> ports;
+    rl_port_t backup;
+    bool has_backup;
+
+    PduftRoute() : backup(0), has_backup(false) { }
+    bool operator==(const PduftRoute& o) const
+        { return ports == o.ports && has_backup == o.has_backup &&
+                 (!has_backup || backup == o.backup); }
+};
+
 /* Shortest Path algorithm. */
 class SPEngine {
 public:
-    SPEngine() {};
+    SPEngine() : full_runs(0), incr_runs(0), lfa_runs(0), valid(false),
+                 local(0), src(0), num_extra(0), backups_valid(false) {};
     int run(rl_addr_t, struct uipcp_rib *rib);
 
-    /* The routing table computed by run(). */
-    std::map<rl_addr_t, rl_addr_t> next_hops;
+    /* Full routing table computation. */
+    int compute(rl_addr_t local_addr,
+                const std::map<rl_addr_t,
+                               std::map<rl_addr_t, LowerFlow> >& lfdb);
+
+    /* Incremental routing table update, taking into account the LFDB
+     * changes notified through lfdb_changed() since the last run. Falls
+     * back to compute() when the change set is large. */
+    int update(rl_addr_t local_addr,
+               const std::map<rl_addr_t,
+                              std::map<rl_addr_t, LowerFlow> >& lfdb);
+
+    /* Tell the engine that the LFDB entry (local_addr, remote_addr) has
+     * been added, removed or modified. */
+    void lfdb_changed(rl_addr_t local_addr, rl_addr_t remote_addr);
+
+    /* Distance of 'dst' from the local node in the last routing table
+     * computed, or UINT_MAX if 'dst' is not reachable. */
+    unsigned int distance(rl_addr_t dst) const;
+
+    /* Compute the loop-free alternate next hops for the last routing
+     * table computed. Called by run(). Nothing is done if the routing
+     * table did not change since the last call. */
+    void compute_backups();
+
+    /* The routing table computed by run(): the set of equal-cost next
+     * hops for each destination, sorted by address. */
+    std::map<rl_addr_t, std::vector<rl_addr_t> > next_hops;
+
+    /* Backup next hop for the destinations that have a loop-free
+     * alternate to their (single) primary next hop. */
+    std::map<rl_addr_t, rl_addr_t> backup_hops;
+
+    /* Statistics. */
+    unsigned long full_runs;
+    unsigned long incr_runs;
+    unsigned long lfa_runs; /* shortest path trees rooted at neighbors */
 
 private:
-    struct Edge {
-        rl_addr_t to;
-        unsigned int cost;
+    typedef std::pair<unsigned int, unsigned int> HeapItem; /* (dist, node) */
+    typedef std::priority_queue<HeapItem, std::vector<HeapItem>,
+                                std::greater<HeapItem> > Heap;
+
+    unsigned int node_index(rl_addr_t addr) const;
+    unsigned int find_edge(unsigned int u, unsigned int v) const;
+    void relax(unsigned int u, Heap& heap);
+    void propagate(Heap& heap, std::vector<unsigned int> *touched);
+    void edge_decreased(unsigned int e, std::vector<unsigned int>& touched);
+    void edge_increased(unsigned int e, std::vector<unsigned int>& touched);
+    bool nhops_update(unsigned int v);
+    void distances_from(unsigned int root,
+                        std::vector<unsigned int>& d) const;
+    void next_hops_set(unsigned int v);
+    void nbr_dist_update(unsigned int e, unsigned int old_cost);
+
+    /* True if the state below corresponds to the last computation. */
+    bool valid;
+    rl_addr_t local;
+    unsigned int src;
+
+    /* Dense node indices: nodes[i] is the address of node i. The
+     * vector is kept sorted, so that addresses can be mapped to
+     * indices with a binary search. */
+    std::vector<rl_addr_t> nodes;
+
+    /* The graph in Compressed Sparse Row form: the edges leaving
+     * node i are the edges k in [adj_start[i], adj_start[i+1]), going
+     * from adj_from[k] to adj_to[k] with cost adj_cost[k]. Removed
+     * edges have an infinite cost. The reverse graph is in rev_start
+     * and rev_edge, the latter containing edge indices. */
+    std::vector<unsigned int> adj_start;
+    std::vector<unsigned int> adj_from;
+    std::vector<unsigned int> adj_to;
+    std::vector<unsigned int> adj_cost;
+    std::vector<unsigned int> rev_start;
+    std::vector<unsigned int> rev_edge;
+
+    /* Edges added by incremental updates, appended to the adj_*
+     * vectors and indexed by source and destination node. */
+    std::map<unsigned int, std::vector<unsigned int> > extra_out;
+    std::map<unsigned int, std::vector<unsigned int> > extra_in;
+    unsigned int num_extra;
+
+    /* Per-node shortest path tree: distance from the local node,
+     * predecessor and set of equal-cost next hops. */
+    std::vector<unsigned int> dist;
+    std::vector<unsigned int> pred;
+    std::vector< std::vector<unsigned int> > nhops;
+    std::vector<char> mark;
+
+    /* Distances from each neighbor of the local node, used to compute
+     * the loop-free alternates. A vector is dropped (and computed again
+     * by compute_backups()) only when an edge change can modify it. */
+    std::map<unsigned int, std::vector<unsigned int> > nbr_dist;
+    bool backups_valid;
+
+    /* LFDB entries changed since the last run. */
+    std::set< std::pair<rl_addr_t, rl_addr_t> > changes;
+};
 
-        Edge(rl_addr_t to_, unsigned int cost_) :
-                            to(to_), cost(cost_) { }
-    };
+/* An entry of the Directory Forwarding Table, as stored by DFT. The
+ * hash of the name is computed once, when the entry is inserted. */
+struct DFTRecord {
+    RinaName appl_name;
+    rl_addr_t address;
+    uint64_t timestamp;
+    uint32_t hash;
+    /* True if the application is registered locally. */
+    bool local;
+    /* Home IPCPs of the name as of the last dft_refresh(), empty if not
+     * computed yet. This is a cache, and so it can be updated through
+     * the const iterators of DFT. */
+    mutable std::vector<rl_addr_t> homes;
+
+    DFTEntry entry() const;
+};
+
+/* Directory Forwarding Table, indexed by application name. Records are
+ * kept in a dense vector, and indexed by an open addressing hash table
+ * with linear probing, so that lookups take constant time and don't
+ * need to build the string form of the name. */
+class DFT {
+public:
+    typedef std::vector<DFTRecord>::const_iterator const_iterator;
+
+    DFT();
+
+    const DFTRecord *find(const RinaName& appl_name) const;
+
+    /* Insert a new record or overwrite the existing one for the same
+     * name. */
+    void set(const DFTEntry& entry);
+
+    /* Returns false if there is no record for the name. */
+    bool erase(const RinaName& appl_name);
 
-    struct Info {
-        unsigned int dist;
-        bool visited;
+    void clear();
+    size_t size() const { return records.size(); }
+    const_iterator begin() const { return records.begin(); }
+    const_iterator end() const { return records.end(); }
+
+    static uint32_t name_hash(const RinaName& appl_name);
+
+private:
+    /* A slot of the hash table: index of the record plus one (zero
+     * for empty slots) and the hash of its name, so that most of the
+     * mismatching records are not accessed. */
+    struct Slot {
+        uint32_t idx;
+        uint32_t hash;
     };
 
-    std::map<rl_addr_t, std::list<Edge> > graph;
-    std::map<rl_addr_t, Info> info;
+    unsigned int slot_find(const RinaName& appl_name, uint32_t hash) const;
+    void slot_insert(uint32_t idx, uint32_t hash);
+    void slot_remove(unsigned int i);
+    void rehash(size_t nslots);
+
+    std::vector<DFTRecord> records;
+    std::vector<Slot> slots;
+    size_t mask;
+};
+
+/* A result of a directory query, cached by the IPCP that issued it. */
+struct DFTCacheEntry {
+    rl_addr_t address;
+    time_t expires;
+};
+
+/* A pending directory query, with the flow allocation requests waiting
+ * for its result. Home IPCPs are queried one after the other until one
+ * of them knows the name. */
+struct DFTQuery {
+    struct uipcp_rib *rib;
+    RinaName appl_name;
+    std::vector<rl_addr_t> homes;
+    unsigned int next;
+    int tmrid;
+    std::list<FlowRequest> reqs;
 };
 
 class ScopeLock {
@@ -263,14 +510,97 @@ struct uipcp_rib {
     std::map< std::string, NeighborCandidate > neighbors_seen;
     std::set< std::string > neighbors_cand;
 
-    /* Directory Forwarding Table. */
-    std::map< std::string, DFTEntry > dft;
+    /* Directory Forwarding Table. With the distributed directory, it
+     * only contains the local registrations and the entries this IPCP
+     * is a home for, while the results of the queries are cached. */
+    DFT dft;
+    std::map< std::string, DFTCacheEntry > dft_cache;
+    std::map< std::string, DFTQuery * > dft_queries;
+    time_t dft_refreshed;
+
+    /* Expiration deadlines of the cached entries, ordered by time. As
+     * for lfdb_expiry, items are checked against DFTCacheEntry::expires
+     * when they are used. */
+    std::multimap< time_t, std::string > dft_cache_expiry;
+
+    /* IPCPs in the DIF (sorted) at the last dft_refresh(): the homes are
+     * only computed again when this set changes. */
+    std::vector<rl_addr_t> dft_nodes;
+
+    /* Distributed directory counters. */
+    struct {
+        unsigned long queries;
+        unsigned long answered;
+        unsigned long hits;
+        unsigned long failures;
+        unsigned long published;
+        unsigned long dropped;
+    } dft_stats;
 
     /* Lower Flow Database. */
     std::map< rl_addr_t, std::map<rl_addr_t, LowerFlow > > lfdb;
 
+    /* Expiration deadlines of the LFDB entries not generated by us,
+     * ordered by time. Items are not removed when an entry is refreshed
+     * or deleted, but they are checked against LowerFlow::refreshed
+     * when they expire. A single timer is armed for the earliest
+     * deadline. */
+    std::multimap< time_t, std::pair<rl_addr_t, rl_addr_t> > lfdb_expiry;
+    int lfdb_age_tmrid;
+
+    /* Last re-origination of our LFDB entries. */
+    time_t lfdb_refreshed;
+
+    /* LFDB summary exchange counters. */
+    struct {
+        unsigned long summaries_sent;
+        unsigned long summaries_rcvd;
+        unsigned long requested;
+        unsigned long pushed;
+        unsigned long purged;
+        unsigned long expired;
+    } lfdb_stats;
+
     SPEngine spe;
 
+    /* PDUFT entries currently installed in the kernel, so that
+     * pduft_sync() only needs to push the differences. */
+    std::map< rl_addr_t, PduftRoute > pduft;
+
+    /* SPF scheduler: pending timer, current hold time (ms) and time of
+     * the last computation. LFDB changes arriving while a computation is
+     * scheduled are coalesced into it. */
+    int spf_tmrid;
+    unsigned int spf_hold;
+    struct timespec spf_last;
+    struct {
+        unsigned long requests;
+        unsigned long runs;
+    } spf_stats;
+
+    /* PDUFT synchronization counters. */
+    struct {
+        unsigned long syncs;
+        unsigned long added;
+        unsigned long updated;
+        unsigned long removed;
+        unsigned long unchanged;
+        unsigned long failovers;
+        unsigned long backups;
+    } pduft_stats;
+
+    /* RIB synchronization counters: bytes are the sizes of the object
+     * values sent, before and after compression. */
+    struct {
+        unsigned long syncs;
+        unsigned long entries;
+        unsigned long msgs;
+        unsigned long bytes;
+        unsigned long raw_bytes;
+        unsigned long last_ms;
+        unsigned long enroll_last_ms;
+    } ribsync_stats;
+
     int sync_tmrid;
 
     /* For A-DATA messages. */
@@ -285,9 +615,6 @@ struct uipcp_rib {
     std::map< std::string, struct rl_flow_config > qos_cubes;
 #endif /* RL_USE_QOS_CUBES */
 
-    /* Timer ID for age increment of LFDB entries. */
-    int age_incr_tmrid;
-
     uipcp_rib(struct uipcp *_u);
     ~uipcp_rib();
 
@@ -296,8 +623,18 @@ struct uipcp_rib {
     int set_address(rl_addr_t address);
     Neighbor *get_neighbor(const struct rina_name *neigh_name, bool initiator);
     int del_neighbor(const RinaName& neigh_name);
-    int dft_lookup(const RinaName& appl_name, rl_addr_t& dstaddr) const;
+    int dft_lookup(const RinaName& appl_name, rl_addr_t& dstaddr);
     int dft_set(const RinaName& appl_name, rl_addr_t remote_addr);
+    void dft_homes(const RinaName& appl_name,
+                   std::vector<rl_addr_t>& homes) const;
+    int dft_publish(bool create, const DFTEntry& entry);
+    void dft_homes_update(const std::vector<rl_addr_t>& nodes);
+    void dft_refresh();
+    int dft_query(const FlowRequest& freq);
+    void dft_query_next(DFTQuery *q);
+    void dft_query_done(DFTQuery *q, rl_addr_t address);
+    void dft_cache_del(const RinaName& appl_name);
+    void dft_cache_evict();
     int register_to_lower(int reg, std::string lower_dif);
     int appl_register(const struct rl_kmsg_appl_register *req);
     int flow_deallocated(struct rl_kmsg_flow_deallocated *req);
@@ -305,10 +642,18 @@ struct uipcp_rib {
     RinaName lookup_neighbor_by_address(rl_addr_t address);
     int lookup_neigh_flow_by_port_id(rl_port_t port_id,
                                      NeighFlow **nfp);
-    int commit_lower_flow(rl_addr_t local_addr, const Neighbor& neigh);
+    int commit_lower_flow(rl_addr_t local_addr, Neighbor& neigh);
+    void lower_flow_cost_update(Neighbor& neigh);
+    void flow_stats_update(rl_port_t port_id,
+                           const struct rl_flow_stats *stats);
     int fa_req(struct rl_kmsg_fa_req *req);
+    int fa_req_send(FlowRequest& freq);
     int fa_resp(struct rl_kmsg_fa_resp *resp);
     int pduft_sync();
+    void spf_schedule();
+    void spf_run();
+    void pduft_flow_removed(rl_port_t port_id);
+    int pduft_flow_down(rl_port_t port_id);
     rl_addr_t address_allocate() const;
 
     const LowerFlow *lfdb_find(rl_addr_t local_addr,
@@ -318,6 +663,9 @@ struct uipcp_rib {
     LowerFlow *lfdb_find(rl_addr_t local_addr, rl_addr_t remote_addr);
     void lfdb_add(const LowerFlow &lf);
     void lfdb_del(rl_addr_t local_addr, rl_addr_t remote_addr);
+    void lfdb_update(const LowerFlowList& lfl, bool add, NeighFlow *nf);
+    void lfdb_age_arm();
+    void lfdb_age_expire();
 
     int send_to_dst_addr(CDAPMessage *m, rl_addr_t dst_addr,
                          const UipcpObject *obj);
@@ -331,16 +679,20 @@ struct uipcp_rib {
                         const std::string& obj_name,
                         const UipcpObject *obj_value) const;
     int remote_refresh_lower_flows();
+    int lfdb_summary_send(NeighFlow *nf);
 
     /* Receive info from neighbors. */
     int cdap_dispatch(const CDAPMessage *rm, NeighFlow *nf);
 
     /* RIB handlers for received CDAP messages. */
     int dft_handler(const CDAPMessage *rm, NeighFlow *nf);
+    int dft_handler_query(const CDAPMessage *rm);
     int neighbors_handler(const CDAPMessage *rm, NeighFlow *nf);
     int lfdb_handler(const CDAPMessage *rm, NeighFlow *nf);
+    int lfdb_summary_handler(const CDAPMessage *rm, NeighFlow *nf);
     int flows_handler(const CDAPMessage *rm, NeighFlow *nf);
     int keepalive_handler(const CDAPMessage *rm, NeighFlow *nf);
+    int ribsync_handler(const CDAPMessage *rm, NeighFlow *nf);
 
     int flows_handler_create(const CDAPMessage *rm);
     int flows_handler_create_r(const CDAPMessage *rm);
@@ -377,7 +729,6 @@ int rib_neigh_set_flow_fd(struct uipcp_rib *rib,
                           const struct rina_name *neigh_name,
                           rl_port_t neigh_port_id, int neigh_fd);
 
-void age_incr_cb(struct rl_evloop *loop, void *arg);
 void sync_timeout_cb(struct rl_evloop *loop, void *arg);
 
 #define UIPCP_RIB(_u) ((uipcp_rib *)((_u)->priv))
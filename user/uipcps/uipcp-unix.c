@@ -481,6 +481,18 @@ usage(void)
         "   -h : show this help\n"
         "   -v VERB_LEVEL: set verbosity LEVEL: QUIET, WARN, INFO, "
                            "DBG (default), VERY\n"
+        "   -s INITIAL,HOLD,MAX: SPF initial delay, hold time and maximum "
+                           "hold time in milliseconds (default %u,%u,%u)\n"
+        "   -m BYTES: maximum size of the management SDUs used to "
+                           "synchronize the RIB with new neighbors "
+                           "(default %u)\n"
+        "   -z : compress the RIB synchronization (all the IPCPs in the "
+                           "DIF must support it)\n"
+        "   -d REPLICAS: store each directory entry only on REPLICAS "
+                           "IPCPs, instead of all of them (all the IPCPs "
+                           "in the DIF must use the same value)\n",
+        normal_spf_params.initial_delay, normal_spf_params.hold,
+        normal_spf_params.max_hold, normal_mgmt_params.sdu_max
           );
 }
 
@@ -508,7 +520,7 @@ int main(int argc, char **argv)
         return -1;
     }
 
-    while ((opt = getopt(argc, argv, "hv:")) != -1) {
+    while ((opt = getopt(argc, argv, "hv:s:m:zd:")) != -1) {
         switch (opt) {
             case 'h':
                 usage();
@@ -518,6 +530,50 @@ int main(int argc, char **argv)
                 verbosity = optarg;
                 break;
 
+            case 's':
+                if (sscanf(optarg, "%u,%u,%u",
+                           &normal_spf_params.initial_delay,
+                           &normal_spf_params.hold,
+                           &normal_spf_params.max_hold) != 3 ||
+                        normal_spf_params.hold == 0 ||
+                        normal_spf_params.max_hold <
+                            normal_spf_params.hold) {
+                    printf("    Invalid SPF parameters %s\n", optarg);
+                    return -1;
+                }
+                break;
+
+            case 'm':
+                normal_mgmt_params.sdu_max = strtoul(optarg, NULL, 10);
+                if (normal_mgmt_params.sdu_max < RL_MGMT_SDU_MIN ||
+                        normal_mgmt_params.sdu_max > RL_MGMT_SDU_MAX) {
+                    printf("    Invalid management SDU size %s "
+                           "(must be in [%u, %u])\n", optarg,
+                           RL_MGMT_SDU_MIN, RL_MGMT_SDU_MAX);
+                    return -1;
+                }
+                break;
+
+            case 'z':
+#ifdef RL_HAVE_ZLIB
+                normal_mgmt_params.compress = 1;
+#else  /* !RL_HAVE_ZLIB */
+                printf("    Compression not supported (missing zlib)\n");
+                return -1;
+#endif /* !RL_HAVE_ZLIB */
+                break;
+
+            case 'd':
+                normal_dir_params.replicas = strtoul(optarg, NULL, 10);
+                if (normal_dir_params.replicas < 1 ||
+                        normal_dir_params.replicas > RL_DFT_REPLICAS_MAX) {
+                    printf("    Invalid number of directory replicas %s "
+                           "(must be in [1, %u])\n", optarg,
+                           RL_DFT_REPLICAS_MAX);
+                    return -1;
+                }
+                break;
+
             default:
                 printf("    Unrecognized option %c\n", opt);
                 usage();